@@ -1,154 +1,1554 @@
+#include <bitmap.h>
 #include <debug.h>
+#include <hash.h>
+#include <inttypes.h>
+#include <list.h>
+#include <round.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "filesys/cache.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "filesys/journal.h"
+#include "devices/timer.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 
-#define BUFFER_CACHE_SIZE 64
+/* Each slot caches a cluster of CLUSTER_SECTORS consecutive
+   sectors, aligned to a multiple of CLUSTER_SECTORS, in one page.
+   A miss reads the whole cluster with a single disk command. */
+#define CLUSTER_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
+#define CLUSTER_ALL ((1u << CLUSTER_SECTORS) - 1)
+
+/* Unless fixed with buffer_cache_set_size(), the cache starts at
+   1/16 of the kernel pool, may grow to 1/2 of it while more than
+   1/4 of the pool is free, and gives pages back when less than
+   1/8 is free or an allocation fails.  It never has fewer than
+   MIN_SLOTS slots. */
+#define MIN_SLOTS 8
+#define INITIAL_DIVISOR 16
+#define MAX_DIVISOR 2
+#define GROW_DIVISOR 4
+#define SHRINK_DIVISOR 8
+
+/* Slots kept beyond the maximum above, which get pages only for a
+   thread that needs a slot while every other one awaits a journal
+   commit that cannot start until this thread goes on: one running
+   an operation the commit must wait for, or the committer. */
+#define RESERVE_SLOTS 4
+
+/* Size of the buffer in which write-back gathers runs of sectors
+   from adjacent clusters into one disk command. */
+#define FLUSH_BUFFER_PAGES 8
+#define FLUSH_BUFFER_SECTORS (FLUSH_BUFFER_PAGES * CLUSTER_SECTORS)
+
+/* Defaults for the write-behind thread: how often it runs, in
+   milliseconds, and the percentage of dirty slots above which
+   writers must write back before dirtying more. */
+#define FLUSH_INTERVAL_DEFAULT 1000
+#define DIRTY_RATIO_DEFAULT 50
+
+/* Replacement policies. */
+enum buffer_cache_policy
+  {
+    POLICY_CLOCK,               /* Clock (second chance). */
+    POLICY_2Q                   /* 2Q: scans stay in a probation FIFO. */
+  };
+
+/* A cluster remembered in the 2Q ghost ring. */
+struct buffer_cache_ghost
+  {
+    block_sector_t sector;      /* First sector, or GHOST_NONE. */
+    struct hash_elem hash_elem; /* Element in ghost_index. */
+  };
 
 struct buffer_cache_entry_t {
-  bool occupied;  
+  bool occupied;
+
+  block_sector_t disk_sector;    /* First sector of the cluster. */
+  uint8_t *buffer;               /* CLUSTER_SECTORS sectors of data, or
+                                    a null pointer if the slot has no
+                                    page. */
+
+  uint8_t valid;                 /* Sectors read in or overwritten. */
+  uint8_t overwriting;           /* Sectors got to overwrite, not yet
+                                    released. */
+  uint8_t dirty;                 /* Sectors modified, not written back. */
+  int chances;                   /* Eviction passes left to survive. */
+  bool meta;                     /* Holds file system metadata? */
+  uint8_t jdirty;                /* Sectors awaiting a journal commit. */
+  uint8_t jcommit;               /* Sectors being committed. */
+  bool held_meta;                /* Holder got its sector as metadata? */
+  int64_t dirty_since;           /* Timer tick when DIRTY was set. */
 
-  block_sector_t disk_sector;
-  uint8_t buffer[BLOCK_SECTOR_SIZE];
+  struct list_elem queue_elem;   /* Element in a 2Q queue. */
+  bool in_main;                  /* In the 2Q main queue? */
 
-  bool dirty;     
-  bool access;    
+  struct hash_elem hash_elem;    /* Element in buffer_cache_index. */
+
+  int pin_cnt;                   /* Threads using the slot; >0: no evict. */
+  bool io_pending;               /* BUFFER not yet filled in. */
+  struct condition io_done;      /* Signaled when IO_PENDING clears. */
+
+  struct lock lock;              /* Protects BUFFER. */
 };
+
+/* Protects the slot index, the replacement policy state and
+   every slot's fields except BUFFER's contents.  Never held across
+   disk I/O or while waiting for a slot's own lock.  A slot's lock
+   is held only by a thread that has the slot pinned.
+
+   VALID and DIRTY have one bit per sector of the cluster.  A
+   sector's DIRTY bit is set only after it has been modified and
+   cleared just before it is written back, so a write that races
+   with write-back leaves it dirty.  Sectors that are not VALID are
+   read in without the slot's lock, which is safe because no one
+   uses them until they are.  A sector got with
+   BUFFER_CACHE_OVERWRITE that was not VALID is marked OVERWRITING
+   instead, and becomes VALID only when it is released, so that
+   neither readers nor write-back see it before its holder has
+   filled it in; it is not read in without the slot's lock. */
 static struct lock buffer_cache_lock;
-static struct buffer_cache_entry_t cache[BUFFER_CACHE_SIZE];
+static struct condition buffer_cache_unpinned;
+static struct buffer_cache_entry_t *cache;
+static size_t buffer_cache_size;        /* Slots with pages. */
+static size_t buffer_cache_max;         /* Slots in CACHE. */
+static size_t buffer_cache_used;        /* Occupied slots. */
+static size_t buffer_cache_dirty_cnt;
+
+/* Size requested with buffer_cache_set_size(), in slots, or 0 to
+   size the cache from the kernel pool. */
+static size_t fixed_slots;
+static size_t shrink_cursor;            /* Next slot to try reclaiming. */
+
+/* Write-behind settings. */
+static unsigned flush_interval = FLUSH_INTERVAL_DEFAULT;
+static unsigned dirty_ratio = DIRTY_RATIO_DEFAULT;
+
+/* Serializes write-behind passes, so that buffer_cache_close()
+   returns only after any pass in progress has finished, and keeps
+   buffer_cache_write_through() from writing a sector that a pass
+   has gathered but not yet written, which the pass would then
+   overwrite with its older copy.  Acquired before
+   buffer_cache_lock. */
+static struct lock buffer_cache_flush_lock;
+
+/* Slots being written back by a write-behind pass, one element
+   per slot, and the buffer their data is gathered in, or a null
+   pointer if it could not be allocated.  Protected by
+   buffer_cache_flush_lock. */
+static struct buffer_cache_entry_t **flush_victims;
+static uint8_t *flush_buffer;
+
+/* A run of consecutive sectors gathered in flush_buffer, waiting
+   to be written with one disk command. */
+struct write_run
+  {
+    block_sector_t start;       /* First sector. */
+    size_t cnt;                 /* Number of sectors. */
+    size_t cmds;                /* Disk commands issued so far. */
+  };
+
+/* Journaling, on between buffer_cache_journal_start() and
+   buffer_cache_journal_stop().  A sector released dirty by a holder
+   that got it as metadata, or whose copy is in a journal record not
+   yet checkpointed, is marked JDIRTY.  It is not written home until
+   a commit has copied it into the journal, and is marked JCOMMIT
+   while the commit is written.  Slots with such sectors are not
+   evicted.  Protected by buffer_cache_lock. */
+static struct bitmap *journaled;        /* Sectors in live records. */
+static size_t journal_dirty_cnt;        /* JDIRTY sectors. */
+static size_t journal_slot_cnt;         /* Slots with JDIRTY or JCOMMIT. */
+static size_t journal_limit;            /* JDIRTY sectors that force a
+                                           commit. */
+
+/* Occupied slots, keyed by disk_sector. */
+static struct hash buffer_cache_index;
+
+/* Replacement policy state, protected by buffer_cache_lock.
+
+   2Q admits a cluster on its first miss to the probation FIFO,
+   which is kept to a quarter of the cache, and remembers the
+   clusters it pushes out in a ghost ring as long as the cache's
+   maximum size.  A cluster that misses again while still in the
+   ghost ring, or that holds metadata, goes to the main LRU
+   queue instead.  So a large sequential read only cycles through
+   the probation FIFO and leaves the working set alone.
+
+   Both policies let a metadata slot survive one more eviction
+   pass than a data slot. */
+static enum buffer_cache_policy policy = POLICY_2Q;
+static struct list free_slots;          /* Unoccupied slots. */
+static struct list probation;           /* 2Q A1in, newest first. */
+static size_t probation_cnt;
+static struct list main_queue;          /* 2Q Am, most recent first. */
+static struct buffer_cache_ghost *ghosts; /* 2Q A1out ring. */
+#define GHOST_NONE ((block_sector_t) -1) /* Empty ghost entry. */
+static size_t ghost_cnt;
+static size_t ghost_next;
+static struct hash ghost_index;         /* Ghosts not GHOST_NONE, keyed
+                                           by sector. */
+
+/* Sectors queued for the read-ahead thread, as a ring buffer.
+   Protected by buffer_cache_lock. */
+#define READ_AHEAD_QUEUE_SIZE 64
+static block_sector_t read_ahead_queue[READ_AHEAD_QUEUE_SIZE];
+static size_t read_ahead_head;
+static size_t read_ahead_cnt;
+static struct condition read_ahead_ready;
+
+/* Statistics. */
+static unsigned long long buffer_cache_hits;
+static unsigned long long buffer_cache_misses;
+static unsigned long long buffer_cache_read_aheads;
+static unsigned long long buffer_cache_throttles;
+static unsigned long long buffer_cache_grown;
+static unsigned long long buffer_cache_reclaimed;
+
+static thread_func buffer_cache_read_ahead_daemon NO_RETURN;
+static thread_func buffer_cache_flush_daemon NO_RETURN;
+static bool buffer_cache_grow (bool reserve);
+static palloc_reclaim_func buffer_cache_reclaim;
+static void buffer_cache_dequeue (struct buffer_cache_entry_t *);
+static struct buffer_cache_entry_t *buffer_cache_lookup (block_sector_t);
+
+
+static unsigned
+buffer_cache_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct buffer_cache_entry_t *entry
+    = hash_entry (e, struct buffer_cache_entry_t, hash_elem);
+  return hash_int (entry->disk_sector);
+}
+
+static bool
+buffer_cache_less (const struct hash_elem *a, const struct hash_elem *b,
+                   void *aux UNUSED)
+{
+  return hash_entry (a, struct buffer_cache_entry_t, hash_elem)->disk_sector
+         < hash_entry (b, struct buffer_cache_entry_t, hash_elem)->disk_sector;
+}
+
+static unsigned
+buffer_cache_ghost_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct buffer_cache_ghost,
+                               hash_elem)->sector);
+}
+
+static bool
+buffer_cache_ghost_less (const struct hash_elem *a, const struct hash_elem *b,
+                         void *aux UNUSED)
+{
+  return hash_entry (a, struct buffer_cache_ghost, hash_elem)->sector
+         < hash_entry (b, struct buffer_cache_ghost, hash_elem)->sector;
+}
+
+/* Fixes the buffer cache at SECTORS sectors, rounded up to a
+   whole cluster, instead of sizing it from free memory.  Must be
+   called before buffer_cache_init(). */
+void
+buffer_cache_set_size (size_t sectors)
+{
+  ASSERT (cache == NULL);
+  fixed_slots = DIV_ROUND_UP (sectors, CLUSTER_SECTORS);
+}
+
+/* Selects the replacement policy by NAME, "clock" or "2q".
+   Returns false if NAME is unknown.  Must be called before
+   buffer_cache_init(). */
+bool
+buffer_cache_set_policy (const char *name)
+{
+  if (!strcmp (name, "clock"))
+    policy = POLICY_CLOCK;
+  else if (!strcmp (name, "2q"))
+    policy = POLICY_2Q;
+  else
+    return false;
+  return true;
+}
+
+/* Sets the write-behind thread to run every MS milliseconds, or
+   never if MS is 0.  Must be called before buffer_cache_init(). */
+void
+buffer_cache_set_flush_interval (unsigned ms)
+{
+  flush_interval = ms;
+}
 
+/* Returns how often the write-behind thread runs, in
+   milliseconds, or 0 if it does not. */
+unsigned
+buffer_cache_flush_interval (void)
+{
+  return flush_interval;
+}
 
+/* Sets the percentage of dirty slots at which writers are
+   throttled.  Must be called before buffer_cache_init(). */
+void
+buffer_cache_set_dirty_ratio (unsigned percent)
+{
+  if (percent > 0 && percent <= 100)
+    dirty_ratio = percent;
+}
 
 void
 buffer_cache_init (void)
 {
+  size_t slots;
+
   lock_init (&buffer_cache_lock);
+  lock_init (&buffer_cache_flush_lock);
+  cond_init (&buffer_cache_unpinned);
+  if (!hash_init (&buffer_cache_index, buffer_cache_hash, buffer_cache_less,
+                  NULL)
+      || !hash_init (&ghost_index, buffer_cache_ghost_hash,
+                     buffer_cache_ghost_less, NULL))
+    PANIC ("buffer cache index creation failed");
+
+  if (fixed_slots > 0)
+    slots = buffer_cache_max = fixed_slots;
+  else {
+    slots = palloc_kernel_pages () / INITIAL_DIVISOR;
+    buffer_cache_max = palloc_kernel_pages () / MAX_DIVISOR;
+    if (slots < MIN_SLOTS)
+      slots = MIN_SLOTS;
+    if (buffer_cache_max < slots)
+      buffer_cache_max = slots;
+  }
+  buffer_cache_max += RESERVE_SLOTS;
+
+  cache = calloc (buffer_cache_max, sizeof *cache);
+  ghost_cnt = buffer_cache_max;
+  ghosts = malloc (ghost_cnt * sizeof *ghosts);
+  flush_victims = malloc (buffer_cache_max * sizeof *flush_victims);
+  if (cache == NULL || ghosts == NULL || flush_victims == NULL)
+    PANIC ("buffer cache allocation failed--%zu sectors is too many",
+           buffer_cache_max * CLUSTER_SECTORS);
+  flush_buffer = palloc_get_multiple (0, FLUSH_BUFFER_PAGES);
+  ghost_next = 0;
+  list_init (&free_slots);
+  list_init (&probation);
+  list_init (&main_queue);
+  probation_cnt = 0;
 
   size_t i;
-  for (i = 0; i < BUFFER_CACHE_SIZE; ++ i)
+  for (i = 0; i < ghost_cnt; ++ i)
+    ghosts[i].sector = GHOST_NONE;
+  for (i = 0; i < buffer_cache_max; ++ i)
   {
     cache[i].occupied = false;
+    cache[i].valid = cache[i].dirty = cache[i].overwriting = 0;
+    cache[i].buffer = NULL;
+    cache[i].pin_cnt = 0;
+    cache[i].io_pending = false;
+    cond_init (&cache[i].io_done);
+    lock_init (&cache[i].lock);
   }
+
+  lock_acquire (&buffer_cache_lock);
+  for (i = 0; i < slots; ++ i)
+    if (!buffer_cache_grow (false))
+      PANIC ("buffer cache allocation failed--%zu sectors is too many",
+             slots * CLUSTER_SECTORS);
+  buffer_cache_grown = 0;
+  lock_release (&buffer_cache_lock);
+  if (fixed_slots == 0)
+    palloc_set_reclaim (buffer_cache_reclaim);
+
+  read_ahead_head = read_ahead_cnt = 0;
+  cond_init (&read_ahead_ready);
+  thread_create ("read-ahead", PRI_DEFAULT,
+                 buffer_cache_read_ahead_daemon, NULL);
+  if (flush_interval > 0)
+    thread_create ("write-behind", PRI_DEFAULT,
+                   buffer_cache_flush_daemon, NULL);
 }
 
+/* Gives a page to a slot that has none.  Returns false if the
+   cache is at its maximum size, counting the reserve slots only if
+   RESERVE is true, or no page is available. */
+static bool
+buffer_cache_grow (bool reserve)
+{
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+
+  if (buffer_cache_size >= buffer_cache_max - (reserve ? 0 : RESERVE_SLOTS))
+    return false;
 
+  size_t i;
+  for (i = 0; i < buffer_cache_max; ++ i)
+    if (cache[i].buffer == NULL)
+      break;
+  if (i >= buffer_cache_max)
+    return false;
+
+  cache[i].buffer = palloc_get_page (0);
+  if (cache[i].buffer == NULL)
+    return false;
+  if (policy == POLICY_2Q)
+    list_push_back (&free_slots, &cache[i].queue_elem);
+  buffer_cache_size ++;
+  buffer_cache_grown ++;
+  return true;
+}
+
+/* Returns true if the cache should grow instead of evicting. */
+static bool
+buffer_cache_want_grow (void)
+{
+  return (fixed_slots == 0
+          && buffer_cache_used >= buffer_cache_size
+          && buffer_cache_size < buffer_cache_max - RESERVE_SLOTS
+          && (palloc_free_kernel_pages ()
+              > palloc_kernel_pages () / GROW_DIVISOR));
+}
+
+/* Returns true if the cache should give memory back. */
+static bool
+buffer_cache_want_shrink (void)
+{
+  return (fixed_slots == 0
+          && (palloc_free_kernel_pages ()
+              < palloc_kernel_pages () / SHRINK_DIVISOR));
+}
+
+/* Frees the page of a slot that is unused or clean and unpinned,
+   dropping the cluster it held.  Returns false if there is no
+   such slot, or if the cache is already at its minimum size. */
+static bool
+buffer_cache_shrink (void)
+{
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+
+  if (buffer_cache_size <= MIN_SLOTS)
+    return false;
+
+  size_t tries;
+  for (tries = 0; tries < buffer_cache_max; ++ tries)
+  {
+    struct buffer_cache_entry_t *slot = &cache[shrink_cursor];
+    shrink_cursor = (shrink_cursor + 1) % buffer_cache_max;
+    if (slot->buffer == NULL
+        || (slot->occupied
+            && (slot->pin_cnt > 0 || slot->dirty || slot->io_pending)))
+      continue;
+
+    buffer_cache_dequeue (slot);
+    if (slot->occupied) {
+      hash_delete (&buffer_cache_index, &slot->hash_elem);
+      slot->occupied = false;
+      buffer_cache_used --;
+    }
+    palloc_free_page (slot->buffer);
+    slot->buffer = NULL;
+    buffer_cache_size --;
+    buffer_cache_reclaimed ++;
+    return true;
+  }
+  return false;
+}
+
+/* Gives back up to PAGE_CNT pages to the kernel pool, if the cache
+   can do so without waiting.  Called by palloc when it runs out of
+   kernel pages. */
+static size_t
+buffer_cache_reclaim (size_t page_cnt)
+{
+  size_t freed = 0;
+
+  if (lock_held_by_current_thread (&buffer_cache_lock)
+      || !lock_try_acquire (&buffer_cache_lock))
+    return 0;
+  while (freed < page_cnt && buffer_cache_shrink ())
+    freed ++;
+  lock_release (&buffer_cache_lock);
+  return freed;
+}
+
+/* Pins ENTRY so that it cannot be evicted, waiting for any disk
+   transfer on it to finish. */
 static void
-buffer_cache_flush (struct buffer_cache_entry_t *entry)
+buffer_cache_pin (struct buffer_cache_entry_t *entry)
 {
   ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
-  ASSERT (entry != NULL && entry->occupied == true);
 
-  if (entry->dirty) {
-    block_write (fs_device, entry->disk_sector, entry->buffer);
-    entry->dirty = false;
+  entry->pin_cnt ++;
+  while (entry->io_pending)
+    cond_wait (&entry->io_done, &buffer_cache_lock);
+}
+
+static void
+buffer_cache_unpin_locked (struct buffer_cache_entry_t *entry)
+{
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+  ASSERT (entry->pin_cnt > 0);
+
+  if (-- entry->pin_cnt == 0)
+    cond_signal (&buffer_cache_unpinned, &buffer_cache_lock);
+}
+
+/* Marks the sectors in MASK of ENTRY, which the caller has just
+   modified, as dirty. */
+static void
+buffer_cache_mark_dirty (struct buffer_cache_entry_t *entry, uint8_t mask)
+{
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+
+  if (!entry->dirty) {
+    entry->dirty_since = timer_ticks ();
+    buffer_cache_dirty_cnt ++;
   }
+  entry->dirty |= mask;
 }
 
-void
-buffer_cache_close (void)
+/* Returns the bit for SECTOR in the masks of the slot caching it. */
+static uint8_t
+sector_bit (block_sector_t sector)
+{
+  return 1u << (sector % CLUSTER_SECTORS);
+}
+
+/* Returns a mask of the sectors of ENTRY's cluster that exist on
+   the disk, which for the last cluster may be fewer than all. */
+static uint8_t
+cluster_mask (const struct buffer_cache_entry_t *entry)
 {
+  block_sector_t left = block_size (fs_device) - entry->disk_sector;
+  return left >= CLUSTER_SECTORS ? CLUSTER_ALL : (1u << left) - 1;
+}
+
+/* Returns the sectors of ENTRY that may not be written home until
+   the journal has committed them. */
+static uint8_t
+journal_held (const struct buffer_cache_entry_t *entry)
+{
+  return entry->jdirty | entry->jcommit;
+}
+
+/* Returns the sectors of ENTRY whose copies are in journal records
+   not yet checkpointed. */
+static uint8_t
+journal_live (const struct buffer_cache_entry_t *entry)
+{
+  uint8_t mask = 0;
+  int i;
+
+  if (journaled == NULL)
+    return 0;
+  for (i = 0; i < CLUSTER_SECTORS; i++)
+    if (entry->disk_sector + i < bitmap_size (journaled)
+        && bitmap_test (journaled, entry->disk_sector + i))
+      mask |= 1u << i;
+  return mask;
+}
+
+/* Returns true if ENTRY may not be evicted: it is pinned, or holds
+   sectors the journal has yet to commit. */
+static bool
+buffer_cache_busy (const struct buffer_cache_entry_t *entry)
+{
+  return entry->pin_cnt > 0 || journal_held (entry);
+}
+
+/* Writes the sectors gathered in RUN to disk. */
+static void
+write_run_flush (struct write_run *run)
+{
+  if (run->cnt > 0) {
+    block_write_multiple (fs_device, run->start, run->cnt, flush_buffer);
+    run->cmds ++;
+    run->cnt = 0;
+  }
+}
+
+/* Writes the CNT sectors at DATA to disk starting at SECTOR.  If
+   RUN is not null, they are gathered in flush_buffer instead, and
+   written out together with the sectors around them once RUN is
+   broken or full.  Until then, the caller must keep the slot
+   holding them pinned, so that the stale copy on disk cannot be
+   read back in. */
+static void
+write_run_add (struct write_run *run, block_sector_t sector, size_t cnt,
+               const void *data)
+{
+  if (run == NULL || flush_buffer == NULL) {
+    block_write_multiple (fs_device, sector, cnt, data);
+    if (run != NULL)
+      run->cmds ++;
+    return;
+  }
+
+  if (run->cnt > 0 && (run->start + run->cnt != sector
+                       || run->cnt + cnt > FLUSH_BUFFER_SECTORS))
+    write_run_flush (run);
+  if (run->cnt == 0)
+    run->start = sector;
+  memcpy (flush_buffer + run->cnt * BLOCK_SECTOR_SIZE, data,
+          cnt * BLOCK_SECTOR_SIZE);
+  run->cnt += cnt;
+}
+
+/* Writes the sectors of ENTRY in DIRTY back to disk, through RUN
+   if it is not null.  Valid clean sectors between dirty ones are
+   written along with them, so that each run of VALID sectors takes
+   at most one disk command. */
+static void
+buffer_cache_write_sectors (struct buffer_cache_entry_t *entry,
+                            uint8_t dirty, uint8_t valid,
+                            struct write_run *run)
+{
+  int first = 0;
+  while (first < CLUSTER_SECTORS) {
+    if (!(dirty & (1u << first))) {
+      first ++;
+      continue;
+    }
+    int last = first;
+    int i;
+    for (i = first + 1; i < CLUSTER_SECTORS && (valid & (1u << i)); i++)
+      if (dirty & (1u << i))
+        last = i;
+    write_run_add (run, entry->disk_sector + first, last - first + 1,
+                   entry->buffer + first * BLOCK_SECTOR_SIZE);
+    first = last + 1;
+  }
+}
+
+/* Reads in the sectors of ENTRY's cluster in MISSING, one disk
+   command per run of them, and marks them valid.  ENTRY must be
+   pinned by the caller.  buffer_cache_lock is released during the
+   reads. */
+static void
+buffer_cache_fill_sectors (struct buffer_cache_entry_t *entry,
+                           uint8_t missing)
+{
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+  ASSERT (entry->pin_cnt > 0 && !entry->io_pending);
+
+  if (missing == 0)
+    return;
+
+  entry->io_pending = true;
+  lock_release (&buffer_cache_lock);
+  int first = 0;
+  while (first < CLUSTER_SECTORS) {
+    if (!(missing & (1u << first))) {
+      first ++;
+      continue;
+    }
+    int end = first + 1;
+    while (end < CLUSTER_SECTORS && (missing & (1u << end)))
+      end ++;
+    block_read_multiple (fs_device, entry->disk_sector + first, end - first,
+                         entry->buffer + first * BLOCK_SECTOR_SIZE);
+    first = end;
+  }
+  lock_acquire (&buffer_cache_lock);
+
+  entry->valid |= missing;
+  entry->io_pending = false;
+  cond_broadcast (&entry->io_done, &buffer_cache_lock);
+}
+
+/* Reads in the sectors of ENTRY's cluster that are not yet valid,
+   except those being overwritten, without the slot's lock. */
+static void
+buffer_cache_fill (struct buffer_cache_entry_t *entry)
+{
+  buffer_cache_fill_sectors (entry, ~(entry->valid | entry->overwriting)
+                                    & cluster_mask (entry));
+}
+
+/* Writes ENTRY back to disk if it is dirty, through RUN if it is
+   not null, and returns true if it did.  ENTRY must be pinned by
+   the caller.  If WAIT is false and another thread is using
+   ENTRY's data, returns false at once instead of waiting.  Sectors
+   the journal has yet to commit stay dirty, and so do sectors
+   whose copies are in the journal if DATA_ONLY is true.
+   buffer_cache_lock is released during the write. */
+static bool
+buffer_cache_flush (struct buffer_cache_entry_t *entry, bool wait,
+                    bool data_only, struct write_run *run)
+{
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+  ASSERT (entry != NULL && entry->occupied == true);
+  ASSERT (entry->pin_cnt > 0 && !entry->io_pending);
+
+  if (!(entry->dirty & ~journal_held (entry))
+      || lock_held_by_current_thread (&entry->lock))
+    return false;
+
+  lock_release (&buffer_cache_lock);
+  if (wait)
+    lock_acquire (&entry->lock);
+  else if (!lock_try_acquire (&entry->lock)) {
+    lock_acquire (&buffer_cache_lock);
+    return false;
+  }
+
+  lock_acquire (&buffer_cache_lock);
+  uint8_t dirty = entry->dirty & ~journal_held (entry);
+  uint8_t valid = entry->valid;
+  if (data_only)
+    dirty &= ~journal_live (entry);
+  if (dirty) {
+    entry->dirty &= ~dirty;
+    if (!entry->dirty)
+      buffer_cache_dirty_cnt --;
+  }
+  lock_release (&buffer_cache_lock);
+
+  if (dirty)
+    buffer_cache_write_sectors (entry, dirty, valid, run);
+  lock_release (&entry->lock);
+
   lock_acquire (&buffer_cache_lock);
+  return dirty != 0;
+}
+
+/* qsort() comparison function for pointers to slots. */
+static int
+compare_sector (const void *a_, const void *b_)
+{
+  const struct buffer_cache_entry_t *a
+    = *(const struct buffer_cache_entry_t * const *) a_;
+  const struct buffer_cache_entry_t *b
+    = *(const struct buffer_cache_entry_t * const *) b_;
+  return a->disk_sector < b->disk_sector ? -1 : a->disk_sector > b->disk_sector;
+}
 
+/* Writes back every slot that has been dirty for at least MIN_AGE
+   timer ticks, in ascending sector order, and returns the number
+   written.  Dirty sectors of adjacent clusters are written with
+   one disk command.  Slots whose data is in use, or still being
+   read in, are waited for if WAIT is true, otherwise skipped.  If
+   CMDS is not null, stores the number of disk commands issued in
+   *CMDS.  Changes to the free map are first copied into the cache,
+   so that they age alongside the inodes that use the sectors they
+   allocate.  If DATA_ONLY is true, only sectors the journal knows
+   nothing of are written. */
+static size_t
+buffer_cache_write_behind (int64_t min_age, bool wait, bool data_only,
+                           size_t *cmds)
+{
+  struct buffer_cache_entry_t **victims = flush_victims;
+  struct write_run run = { 0, 0, 0 };
+  size_t cnt = 0;
+  size_t done = 0;
   size_t i;
-  for (i = 0; i < BUFFER_CACHE_SIZE; ++ i)
+
+  free_map_flush ();
+  lock_acquire (&buffer_cache_flush_lock);
+  lock_acquire (&buffer_cache_lock);
+  int64_t now = timer_ticks ();
+  for (i = 0; i < buffer_cache_max; ++ i)
+  {
+    struct buffer_cache_entry_t *slot = &cache[i];
+    if (!slot->occupied || !slot->dirty
+        || now - slot->dirty_since < min_age
+        || (slot->io_pending && !wait))
+      continue;
+    slot->pin_cnt ++;
+
+    /* A slot being read into, or not yet taken by the thread about
+       to overwrite it, is written once its I/O is done. */
+    while (slot->io_pending)
+      cond_wait (&slot->io_done, &buffer_cache_lock);
+    if (slot->dirty)
+      victims[cnt++] = slot;
+    else
+      buffer_cache_unpin_locked (slot);
+  }
+  qsort (victims, cnt, sizeof *victims, compare_sector);
+  size_t written = 0;
+  for (i = 0; i < cnt; ++ i)
   {
-    if (cache[i].occupied == false) continue;
-    buffer_cache_flush( &(cache[i]) );
+    size_t cmds_before = run.cmds;
+    written += buffer_cache_flush (victims[i], wait, data_only, &run);
+    if (run.cmds != cmds_before) {
+      /* Everything gathered from the slots before this one is on
+         disk now. */
+      for (; done < i; ++ done)
+        buffer_cache_unpin_locked (victims[done]);
+    }
+  }
+  lock_release (&buffer_cache_lock);
+  write_run_flush (&run);
+  lock_acquire (&buffer_cache_lock);
+  for (; done < cnt; ++ done)
+    buffer_cache_unpin_locked (victims[done]);
+  lock_release (&buffer_cache_lock);
+  lock_release (&buffer_cache_flush_lock);
+
+  if (cmds != NULL)
+    *cmds = run.cmds;
+  return written;
+}
+
+/* Write-behind thread: every flush_interval milliseconds, writes
+   back the slots that have stayed dirty for a whole interval, so
+   that eviction seldom has to. */
+static void
+buffer_cache_flush_daemon (void *aux UNUSED)
+{
+  int64_t min_age = (int64_t) flush_interval * TIMER_FREQ / 1000;
+  for (;;) {
+    timer_msleep (flush_interval);
+    buffer_cache_write_behind (min_age, false, false, NULL);
+  }
+}
+
+/* Returns true if so many sectors await a journal commit that one
+   should be forced rather than left to the placement thread:
+   more than fit one journal record comfortably, or half the slots
+   held, so that the other half stays free for the operations that
+   the commit waits on. */
+static bool
+buffer_cache_journal_full (void)
+{
+  lock_acquire (&buffer_cache_lock);
+  bool full = (journaled != NULL
+               && (journal_dirty_cnt >= journal_limit
+                   || journal_slot_cnt * 2 >= buffer_cache_size));
+  lock_release (&buffer_cache_lock);
+  return full;
+}
+
+/* Returns true if no more than MAX sectors await a journal commit,
+   and the slots holding them leave over half the cache to others.
+   journal_begin() lets an operation start only if this is true of
+   the sectors the operations running may still add. */
+bool
+buffer_cache_journal_fits (size_t max)
+{
+  lock_acquire (&buffer_cache_lock);
+  bool fits = (journaled == NULL
+               || (journal_dirty_cnt <= max
+                   && journal_slot_cnt * 2 < buffer_cache_size));
+  lock_release (&buffer_cache_lock);
+  return fits;
+}
+
+/* Blocks a writer while the dirty slots exceed dirty_ratio percent
+   of the cache, writing them back itself, and asks for a journal
+   commit if too many sectors await one. */
+static void
+buffer_cache_throttle (void)
+{
+  if (buffer_cache_journal_full ()) {
+    buffer_cache_throttles ++;
+    journal_force ();
+  }
+  while (buffer_cache_dirty_cnt * 100 >= buffer_cache_size * dirty_ratio) {
+    buffer_cache_throttles ++;
+    if (buffer_cache_write_behind (0, false, false, NULL) == 0)
+      break;
   }
+}
 
+/* Writes every dirty sector back to disk, in ascending sector
+   order and merging adjacent ones, and returns the number of disk
+   commands this took. */
+size_t
+buffer_cache_sync (void)
+{
+  size_t cmds;
+  buffer_cache_write_behind (0, true, false, &cmds);
+  return cmds;
+}
+
+/* Like buffer_cache_sync(), but leaves alone the sectors that the
+   journal orders, so that a journal commit made afterward finds
+   the data it refers to already on disk. */
+size_t
+buffer_cache_sync_data (void)
+{
+  size_t cmds;
+  buffer_cache_write_behind (0, true, true, &cmds);
+  return cmds;
+}
+
+/* Writes the cluster holding SECTOR back to disk now if it is
+   cached and dirty, for a caller that must know SECTOR is on disk
+   before it goes on.  Sectors awaiting a journal commit are left
+   to it, which orders them instead.  Waits for any write-behind
+   pass in progress to finish first. */
+void
+buffer_cache_write_through (block_sector_t sector)
+{
+  lock_acquire (&buffer_cache_flush_lock);
+  lock_acquire (&buffer_cache_lock);
+  struct buffer_cache_entry_t *slot = buffer_cache_lookup (sector);
+  if (slot != NULL) {
+    buffer_cache_pin (slot);
+    buffer_cache_flush (slot, true, false, NULL);
+    buffer_cache_unpin_locked (slot);
+  }
   lock_release (&buffer_cache_lock);
+  lock_release (&buffer_cache_flush_lock);
 }
 
+/* Turns on journaling of metadata, forcing a commit whenever LIMIT
+   sectors await one. */
+void
+buffer_cache_journal_start (size_t limit)
+{
+  struct bitmap *map = bitmap_create (block_size (fs_device));
+  if (map == NULL)
+    PANIC ("can't allocate journal map");
 
+  lock_acquire (&buffer_cache_lock);
+  journaled = map;
+  journal_limit = limit;
+  journal_dirty_cnt = journal_slot_cnt = 0;
+  lock_release (&buffer_cache_lock);
+}
 
-static struct buffer_cache_entry_t*
-buffer_cache_lookup (block_sector_t sector)
+/* Turns journaling off.  Sectors still awaiting a commit become
+   ordinary dirty sectors. */
+void
+buffer_cache_journal_stop (void)
+{
+  struct bitmap *map;
+  size_t i;
+
+  lock_acquire (&buffer_cache_lock);
+  for (i = 0; i < buffer_cache_max; ++ i)
+    cache[i].jdirty = cache[i].jcommit = 0;
+  journal_dirty_cnt = journal_slot_cnt = 0;
+  map = journaled;
+  journaled = NULL;
+  cond_broadcast (&buffer_cache_unpinned, &buffer_cache_lock);
+  lock_release (&buffer_cache_lock);
+  bitmap_destroy (map);
+}
+
+/* Copies up to MAX sectors awaiting a journal commit into DATA,
+   and their sector numbers into SECTORS, marking them as being
+   committed, and returns how many were copied.  Each is copied
+   under its slot's lock, so it is not caught half modified. */
+size_t
+buffer_cache_journal_collect (block_sector_t *sectors, void *data_,
+                              size_t max)
 {
+  uint8_t *data = data_;
+  size_t cnt = 0;
   size_t i;
-  for (i = 0; i < BUFFER_CACHE_SIZE; ++ i)
+
+  lock_acquire (&buffer_cache_lock);
+  for (i = 0; i < buffer_cache_max && cnt < max; ++ i)
   {
-    if (cache[i].occupied == false) continue;
-    if (cache[i].disk_sector == sector) {
-      return &(cache[i]);
+    struct buffer_cache_entry_t *slot = &cache[i];
+    if (!slot->occupied || !slot->jdirty)
+      continue;
+
+    buffer_cache_pin (slot);
+    lock_release (&buffer_cache_lock);
+    lock_acquire (&slot->lock);
+    lock_acquire (&buffer_cache_lock);
+
+    int j;
+    for (j = 0; j < CLUSTER_SECTORS && cnt < max; j++) {
+      uint8_t bit = 1u << j;
+      if (!(slot->jdirty & bit))
+        continue;
+      sectors[cnt] = slot->disk_sector + j;
+      memcpy (data + cnt * BLOCK_SECTOR_SIZE,
+              slot->buffer + j * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+      bitmap_mark (journaled, sectors[cnt]);
+      slot->jdirty &= ~bit;
+      slot->jcommit |= bit;
+      journal_dirty_cnt --;
+      cnt ++;
+    }
+    lock_release (&slot->lock);
+    buffer_cache_unpin_locked (slot);
+  }
+  lock_release (&buffer_cache_lock);
+  return cnt;
+}
+
+/* Called once the sectors collected by
+   buffer_cache_journal_collect() are in the journal, so that they
+   may be written home. */
+void
+buffer_cache_journal_done (void)
+{
+  size_t i;
+
+  lock_acquire (&buffer_cache_lock);
+  for (i = 0; i < buffer_cache_max; ++ i)
+    if (cache[i].jcommit) {
+      cache[i].jcommit = 0;
+      if (!cache[i].jdirty)
+        journal_slot_cnt --;
     }
+  cond_broadcast (&buffer_cache_unpinned, &buffer_cache_lock);
+  lock_release (&buffer_cache_lock);
+}
+
+/* Returns true if sectors still await a journal commit, as after
+   buffer_cache_journal_collect() has copied out as many as it
+   could take. */
+bool
+buffer_cache_journal_pending (void)
+{
+  lock_acquire (&buffer_cache_lock);
+  bool pending = journal_dirty_cnt > 0;
+  lock_release (&buffer_cache_lock);
+  return pending;
+}
+
+/* Called once every journal record has been checkpointed, so that
+   only the sectors of the commit in progress, if any, still have
+   copies in the journal. */
+void
+buffer_cache_journal_checkpointed (void)
+{
+  size_t i;
+  int j;
+
+  lock_acquire (&buffer_cache_lock);
+  if (journaled != NULL) {
+    bitmap_set_all (journaled, false);
+    for (i = 0; i < buffer_cache_max; ++ i)
+      for (j = 0; j < CLUSTER_SECTORS; j++)
+        if (cache[i].jcommit & (1u << j))
+          bitmap_mark (journaled, cache[i].disk_sector + j);
   }
-  return NULL; 
+  lock_release (&buffer_cache_lock);
+}
+
+void
+buffer_cache_close (void)
+{
+  buffer_cache_sync ();
 }
 
 
+/* Returns the entry of INDEX that holds SECTOR, or a null
+   pointer if there is none. */
+static struct buffer_cache_entry_t *
+buffer_cache_index_find (struct hash *index, block_sector_t sector)
+{
+  struct buffer_cache_entry_t key;
+  struct hash_elem *e;
+
+  key.disk_sector = sector;
+  e = hash_find (index, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct buffer_cache_entry_t, hash_elem)
+                   : NULL;
+}
+
+/* Returns the slot caching the cluster that contains SECTOR, or
+   a null pointer if there is none. */
 static struct buffer_cache_entry_t*
-buffer_cache_evict (void)
+buffer_cache_lookup (block_sector_t sector)
 {
-  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+  return buffer_cache_index_find (&buffer_cache_index,
+                                  sector - sector % CLUSTER_SECTORS);
+}
+
 
+/* Chooses a slot to reuse with the clock algorithm, skipping
+   busy slots.  Returns a null pointer if every slot is busy. */
+static struct buffer_cache_entry_t*
+buffer_cache_evict_clock (void)
+{
   static size_t clock = 0;
-  while (true) {
-    if (cache[clock].occupied == false) {
-      return &(cache[clock]);
+  size_t i;
+  for (i = 0; i < 3 * buffer_cache_max; i++) {
+    struct buffer_cache_entry_t *slot = &cache[clock];
+    if (slot->buffer == NULL) {
+      /* Page not allocated. */
     }
-
-    if (cache[clock].access) {
-      cache[clock].access = false;
+    else if (slot->occupied == false) {
+      return slot;
+    }
+    else if (!buffer_cache_busy (slot)) {
+      if (slot->chances > 0)
+        slot->chances --;
+      else
+        return slot;
     }
-    else break;
 
     clock ++;
-    clock %= BUFFER_CACHE_SIZE;
+    clock %= buffer_cache_max;
   }
+  return NULL;
+}
+
+/* Returns the least recently used slot in QUEUE that is not busy,
+   or a null pointer if all of QUEUE's slots are.  A metadata
+   slot that has not yet been passed over since it was last
+   referenced is moved to the front of QUEUE instead. */
+static struct buffer_cache_entry_t *
+buffer_cache_queue_victim (struct list *queue)
+{
+  struct list_elem *e = list_rbegin (queue);
 
-  struct buffer_cache_entry_t *slot = &cache[clock];
-  if (slot->dirty) {
-    buffer_cache_flush (slot);
+  while (e != list_rend (queue)) {
+    struct buffer_cache_entry_t *slot
+      = list_entry (e, struct buffer_cache_entry_t, queue_elem);
+    e = list_prev (e);
+    if (!buffer_cache_busy (slot)) {
+      if (slot->chances < 2)
+        return slot;
+      slot->chances = 0;
+      list_remove (&slot->queue_elem);
+      list_push_front (queue, &slot->queue_elem);
+    }
   }
+  return NULL;
+}
+
+/* Chooses a slot to reuse under 2Q: a free slot if there is one,
+   else the oldest probation slot if probation has more than its
+   share, else the least recently used main slot. */
+static struct buffer_cache_entry_t*
+buffer_cache_evict_2q (void)
+{
+  struct buffer_cache_entry_t *slot = NULL;
 
-  slot->occupied = false;
+  if (!list_empty (&free_slots))
+    return list_entry (list_front (&free_slots), struct buffer_cache_entry_t,
+                       queue_elem);
+
+  if (probation_cnt > buffer_cache_size / 4)
+    slot = buffer_cache_queue_victim (&probation);
+  if (slot == NULL)
+    slot = buffer_cache_queue_victim (&main_queue);
+  if (slot == NULL)
+    slot = buffer_cache_queue_victim (&probation);
   return slot;
 }
 
+/* Chooses a slot to reuse, skipping pinned slots and slots the
+   journal has yet to commit.  Returns a null pointer if every slot
+   is one or the other. */
+static struct buffer_cache_entry_t*
+buffer_cache_evict (void)
+{
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
 
-void
-buffer_cache_read (block_sector_t sector, void *target)
+  return policy == POLICY_2Q ? buffer_cache_evict_2q ()
+                             : buffer_cache_evict_clock ();
+}
+
+/* Returns true if SECTOR is in the 2Q ghost ring, removing it.
+   Called on every miss, so the ring is looked up by hash, as the
+   slots are, not scanned. */
+static bool
+buffer_cache_ghost_take (block_sector_t sector)
 {
-  lock_acquire (&buffer_cache_lock);
+  struct buffer_cache_ghost key;
+  struct hash_elem *e;
 
-  struct buffer_cache_entry_t *slot = buffer_cache_lookup (sector);
-  if (slot == NULL) {
+  key.sector = sector;
+  e = hash_delete (&ghost_index, &key.hash_elem);
+  if (e == NULL)
+    return false;
+  hash_entry (e, struct buffer_cache_ghost, hash_elem)->sector = GHOST_NONE;
+  return true;
+}
+
+/* Remembers SECTOR in the 2Q ghost ring, forgetting the oldest
+   ghost if the ring is full. */
+static void
+buffer_cache_ghost_put (block_sector_t sector)
+{
+  struct buffer_cache_ghost *ghost = &ghosts[ghost_next];
+  struct hash_elem *old;
+
+  if (ghost->sector != GHOST_NONE)
+    hash_delete (&ghost_index, &ghost->hash_elem);
+  ghost->sector = sector;
+  old = hash_replace (&ghost_index, &ghost->hash_elem);
+  if (old != NULL)
+    hash_entry (old, struct buffer_cache_ghost, hash_elem)->sector
+      = GHOST_NONE;
+  ghost_next = (ghost_next + 1) % ghost_cnt;
+}
+
+/* Takes SLOT, which is about to be reused, off its queue.  Under
+   2Q a sector leaving probation is remembered as a ghost. */
+static void
+buffer_cache_dequeue (struct buffer_cache_entry_t *slot)
+{
+  if (policy != POLICY_2Q)
+    return;
+
+  list_remove (&slot->queue_elem);
+  if (slot->occupied && !slot->in_main) {
+    probation_cnt --;
+    buffer_cache_ghost_put (slot->disk_sector);
+  }
+}
+
+/* Records a reference to SLOT, which holds metadata if META is
+   true.  NEW is true if the sector was just installed in SLOT. */
+static void
+buffer_cache_touch (struct buffer_cache_entry_t *slot, bool meta, bool new)
+{
+  if (new)
+    slot->meta = false;
+  slot->meta |= meta;
+  slot->chances = slot->meta ? 2 : 1;
+  if (policy != POLICY_2Q)
+    return;
+
+  if (!new) {
+    /* Repeated references to a probation slot, as from a reader
+       working through a sector in pieces, do not promote it,
+       except for metadata. */
+    if (!slot->in_main && !slot->meta)
+      return;
+    list_remove (&slot->queue_elem);
+    if (!slot->in_main)
+      probation_cnt --;
+  }
+  else if (!slot->meta && !buffer_cache_ghost_take (slot->disk_sector)) {
+    slot->in_main = false;
+    list_push_front (&probation, &slot->queue_elem);
+    probation_cnt ++;
+    return;
+  }
+  slot->in_main = true;
+  list_push_front (&main_queue, &slot->queue_elem);
+}
+
+/* Returns the slot caching SECTOR's cluster, pinned.  On a miss,
+   reuses an evicted slot.  If READ is true, SECTOR is read in if
+   it is not valid, along with the rest of the cluster that is not,
+   unless another thread is overwriting it.  If READ is false,
+   SECTOR is marked OVERWRITING, not read, if it is not valid, and
+   a newly installed slot is returned with IO_PENDING still set, so
+   the caller must clear it.  META tells the replacement policy
+   whether SECTOR holds metadata.
+
+   buffer_cache_lock is dropped during disk I/O, so hits on other
+   slots proceed meanwhile, and threads missing on the same cluster
+   wait for the one read instead of issuing their own. */
+static struct buffer_cache_entry_t *
+buffer_cache_fetch (block_sector_t sector, bool read, bool meta)
+{
+  ASSERT (lock_held_by_current_thread(&buffer_cache_lock));
+
+  for (;;) {
+    struct buffer_cache_entry_t *slot = buffer_cache_lookup (sector);
+    if (slot != NULL) {
+      buffer_cache_touch (slot, meta, false);
+      buffer_cache_pin (slot);
+      if (!read && !(slot->valid & sector_bit (sector)))
+        slot->overwriting |= sector_bit (sector);
+      if (!read || (slot->valid & sector_bit (sector)))
+        buffer_cache_hits ++;
+      else {
+        buffer_cache_misses ++;
+        buffer_cache_fill (slot);
+      }
+      return slot;
+    }
+
+    if (buffer_cache_want_shrink ())
+      buffer_cache_shrink ();
+    else if (buffer_cache_want_grow ())
+      buffer_cache_grow (false);
     slot = buffer_cache_evict ();
-    ASSERT (slot != NULL && slot->occupied == false);
+    if (slot == NULL) {
+      /* Have the slots awaiting the journal committed, and wait for
+         them, or for any slot to be unpinned.  A thread the commit
+         would wait for takes a reserve slot instead. */
+      if (journal_slot_cnt > 0) {
+        journal_force ();
+        if (!journal_may_wait () && buffer_cache_grow (true))
+          continue;
+      }
+      cond_wait (&buffer_cache_unpinned, &buffer_cache_lock);
+      continue;
+    }
+
+    if (slot->occupied) {
+      /* Write back a dirty victim, then start over: the victim may
+         have been touched, or SECTOR loaded, while the lock was
+         dropped. */
+      if (slot->dirty) {
+        buffer_cache_pin (slot);
+        buffer_cache_flush (slot, true, false, NULL);
+        buffer_cache_unpin_locked (slot);
+        continue;
+      }
+      hash_delete (&buffer_cache_index, &slot->hash_elem);
+    }
 
+    buffer_cache_misses ++;
+    buffer_cache_dequeue (slot);
+    if (!slot->occupied)
+      buffer_cache_used ++;
     slot->occupied = true;
-    slot->disk_sector = sector;
-    slot->dirty = false;
-    block_read (fs_device, sector, slot->buffer);
+    slot->disk_sector = sector - sector % CLUSTER_SECTORS;
+    slot->valid = slot->dirty = slot->overwriting = 0;
+    slot->jdirty = slot->jcommit = 0;
+    slot->pin_cnt = 1;
+    hash_insert (&buffer_cache_index, &slot->hash_elem);
+    buffer_cache_touch (slot, meta, true);
+
+    if (read)
+      buffer_cache_fill (slot);
+    else {
+      slot->overwriting = sector_bit (sector);
+      slot->io_pending = true;
+    }
+    return slot;
   }
+}
 
-  slot->access = true;
-  memcpy (target, slot->buffer, BLOCK_SECTOR_SIZE);
 
+/* Pins SECTOR in the cache and returns a pointer to its
+   BLOCK_SECTOR_SIZE bytes of data, which the caller may use in
+   place until it calls buffer_cache_release().  Other threads
+   that get any sector of the same cluster wait until then, so a
+   caller must release one sector before getting another.  TYPE
+   tells the replacement policy what the sector holds.
 
+   With BUFFER_CACHE_OVERWRITE, a sector that is not cached is
+   not read from disk, so the caller must replace all of its
+   bytes and release it dirty. */
+void *
+buffer_cache_get (block_sector_t sector, enum buffer_cache_mode mode,
+                  enum buffer_cache_type type)
+{
+  if (mode != BUFFER_CACHE_READ)
+    buffer_cache_throttle ();
+
+  lock_acquire (&buffer_cache_lock);
+  struct buffer_cache_entry_t *slot
+    = buffer_cache_fetch (sector, mode != BUFFER_CACHE_OVERWRITE,
+                          type == BUFFER_CACHE_META);
+  if (slot->io_pending) {
+    /* Fresh slot for an overwrite.  No one else can hold its lock
+       yet, so take it before letting waiters at the stale data. */
+    lock_acquire (&slot->lock);
+    slot->io_pending = false;
+    cond_broadcast (&slot->io_done, &buffer_cache_lock);
+    lock_release (&buffer_cache_lock);
+  }
+  else {
+    lock_release (&buffer_cache_lock);
+    lock_acquire (&slot->lock);
+  }
+
+  /* A sector another thread got to overwrite is not valid until it
+     releases it.  If this thread got the slot's lock first, it
+     reads the sector in itself: no one else can be using the
+     buffer now.  VALID bits are only set while the slot is pinned,
+     so one seen set without buffer_cache_lock is set. */
+  if (mode != BUFFER_CACHE_OVERWRITE
+      && !(slot->valid & sector_bit (sector))) {
+    lock_acquire (&buffer_cache_lock);
+    while (slot->io_pending)
+      cond_wait (&slot->io_done, &buffer_cache_lock);
+    if (!(slot->valid & sector_bit (sector)))
+      buffer_cache_fill_sectors (slot, sector_bit (sector));
+    lock_release (&buffer_cache_lock);
+  }
+  slot->held_meta = type == BUFFER_CACHE_META;
+  return slot->buffer + (sector - slot->disk_sector) * BLOCK_SECTOR_SIZE;
+}
+
+/* Releases SECTOR, previously returned by buffer_cache_get().
+   If DIRTY is true, the caller modified it.  While journaling is
+   on, a modified metadata sector, or any sector with a copy in the
+   journal, then waits for a journal commit. */
+void
+buffer_cache_release (block_sector_t sector, bool dirty)
+{
+  lock_acquire (&buffer_cache_lock);
+  struct buffer_cache_entry_t *slot = buffer_cache_lookup (sector);
+  ASSERT (slot != NULL && lock_held_by_current_thread (&slot->lock));
+
+  /* The holder has filled in a sector it got to overwrite. */
+  uint8_t bit = sector_bit (sector);
+  if (slot->overwriting & bit) {
+    slot->overwriting &= ~bit;
+    slot->valid |= bit;
+  }
+
+  bool meta = slot->held_meta;
+  lock_release (&slot->lock);
+  if (dirty) {
+    if (journaled != NULL && (meta || bitmap_test (journaled, sector))) {
+      if (!journal_held (slot))
+        journal_slot_cnt ++;
+      if (!(slot->jdirty & bit))
+        journal_dirty_cnt ++;
+      slot->jdirty |= bit;
+    }
+    buffer_cache_mark_dirty (slot, bit);
+  }
+  buffer_cache_unpin_locked (slot);
   lock_release (&buffer_cache_lock);
 }
 
+void
+buffer_cache_read (block_sector_t sector, void *target)
+{
+  memcpy (target, buffer_cache_get (sector, BUFFER_CACHE_READ,
+                                    BUFFER_CACHE_DATA),
+          BLOCK_SECTOR_SIZE);
+  buffer_cache_release (sector, false);
+}
+
 void
 buffer_cache_write (block_sector_t sector, const void *source)
 {
+  memcpy (buffer_cache_get (sector, BUFFER_CACHE_OVERWRITE,
+                            BUFFER_CACHE_DATA), source,
+          BLOCK_SECTOR_SIZE);
+  buffer_cache_release (sector, true);
+}
+
+/* Queues SECTOR to be read into the cache by the read-ahead
+   thread.  Does nothing if SECTOR's cluster is already cached or
+   queued, or if the queue is full. */
+void
+buffer_cache_read_ahead (block_sector_t sector)
+{
+  if (sector >= block_size (fs_device))
+    return;
+
   lock_acquire (&buffer_cache_lock);
+  size_t tail = (read_ahead_head + read_ahead_cnt) % READ_AHEAD_QUEUE_SIZE;
+  size_t last = (tail + READ_AHEAD_QUEUE_SIZE - 1) % READ_AHEAD_QUEUE_SIZE;
+  if (buffer_cache_lookup (sector) == NULL
+      && read_ahead_cnt < READ_AHEAD_QUEUE_SIZE
+      && (read_ahead_cnt == 0
+          || (read_ahead_queue[last] / CLUSTER_SECTORS
+              != sector / CLUSTER_SECTORS))) {
+    read_ahead_queue[tail] = sector;
+    read_ahead_cnt ++;
+    cond_signal (&read_ahead_ready, &buffer_cache_lock);
+  }
+  lock_release (&buffer_cache_lock);
+}
 
-  struct buffer_cache_entry_t *slot = buffer_cache_lookup (sector);
-  if (slot == NULL) {
-    slot = buffer_cache_evict ();
-    ASSERT (slot != NULL && slot->occupied == false);
+/* Read-ahead thread: fills the cache with queued sectors so that
+   sequential readers find them there. */
+static void
+buffer_cache_read_ahead_daemon (void *aux UNUSED)
+{
+  lock_acquire (&buffer_cache_lock);
+  for (;;) {
+    while (read_ahead_cnt == 0)
+      cond_wait (&read_ahead_ready, &buffer_cache_lock);
 
-    slot->occupied = true;
-    slot->disk_sector = sector;
-    slot->dirty = false;
-    block_read (fs_device, sector, slot->buffer);
+    block_sector_t sector = read_ahead_queue[read_ahead_head];
+    read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_QUEUE_SIZE;
+    read_ahead_cnt --;
+
+    if (buffer_cache_lookup (sector) == NULL) {
+      struct buffer_cache_entry_t *slot
+        = buffer_cache_fetch (sector, true, false);
+      buffer_cache_read_aheads ++;
+      buffer_cache_unpin_locked (slot);
+    }
   }
+}
+
+/* Prints buffer cache statistics.  Misses include the clusters
+   fetched by read-ahead; the rest stalled a reader or writer. */
+void
+buffer_cache_print_stats (void)
+{
+  printf ("Buffer cache: %zu %d-sector slots, %s, %llu hits, %llu misses, "
+          "%llu read ahead, %llu throttled writes, "
+          "%llu pages grown, %llu reclaimed\n",
+          buffer_cache_size, CLUSTER_SECTORS, buffer_cache_policy_name (),
+          buffer_cache_hits, buffer_cache_misses,
+          buffer_cache_read_aheads, buffer_cache_throttles,
+          buffer_cache_grown, buffer_cache_reclaimed);
+}
 
-  slot->access = true;
-  slot->dirty = true;
-  memcpy (slot->buffer, source, BLOCK_SECTOR_SIZE);
+/* Returns the name of the replacement policy in use. */
+const char *
+buffer_cache_policy_name (void)
+{
+  return policy == POLICY_2Q ? "2q" : "clock";
+}
 
+/* Stores the number of cache hits and misses so far in *HITS and
+   *MISSES. */
+void
+buffer_cache_counts (unsigned long long *hits, unsigned long long *misses)
+{
+  lock_acquire (&buffer_cache_lock);
+  *hits = buffer_cache_hits;
+  *misses = buffer_cache_misses;
   lock_release (&buffer_cache_lock);
 }
+
+/* Number of lookups timed per table size by
+   buffer_cache_benchmark(). */
+#define BENCH_LOOKUPS 200000
+
+/* Times BENCH_LOOKUPS hits against indexes of 64 to 4096 entries,
+   once through the sector index and once by scanning the slots the
+   way the cache used to, and prints the elapsed ticks of each. */
+void
+buffer_cache_benchmark (void)
+{
+  size_t n;
+
+  printf ("Buffer cache lookup benchmark (%d lookups):\n", BENCH_LOOKUPS);
+  for (n = 64; n <= 4096; n *= 4)
+    {
+      struct buffer_cache_entry_t *entries = calloc (n, sizeof *entries);
+      struct hash index;
+      size_t i, found;
+      int64_t start, hashed, linear;
+
+      if (entries == NULL
+          || !hash_init (&index, buffer_cache_hash, buffer_cache_less, NULL))
+        PANIC ("benchmark allocation failed");
+      for (i = 0; i < n; i++)
+        {
+          entries[i].occupied = true;
+          entries[i].disk_sector = i * 37 + 5;
+          hash_insert (&index, &entries[i].hash_elem);
+        }
+
+      found = 0;
+      start = timer_ticks ();
+      for (i = 0; i < BENCH_LOOKUPS; i++)
+        found += buffer_cache_index_find (&index, ((i * 7) % n) * 37 + 5)
+                 != NULL;
+      hashed = timer_elapsed (start);
+      ASSERT (found == BENCH_LOOKUPS);
+
+      found = 0;
+      start = timer_ticks ();
+      for (i = 0; i < BENCH_LOOKUPS; i++)
+        {
+          block_sector_t sector = ((i * 7) % n) * 37 + 5;
+          size_t j;
+          for (j = 0; j < n; j++)
+            if (entries[j].occupied && entries[j].disk_sector == sector)
+              break;
+          found += j < n;
+        }
+      linear = timer_elapsed (start);
+      ASSERT (found == BENCH_LOOKUPS);
+
+      printf ("%5zu entries: hashed %"PRId64" ticks, linear %"PRId64" ticks\n",
+              n, hashed, linear);
+      hash_destroy (&index, NULL);
+      free (entries);
+    }
+}
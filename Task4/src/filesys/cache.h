@@ -1,12 +1,55 @@
 #ifndef FILESYS_CACHE_H
 #define FILESYS_CACHE_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include "devices/block.h"
 
+/* How a caller of buffer_cache_get() will use the data. */
+enum buffer_cache_mode
+  {
+    BUFFER_CACHE_READ,          /* Only read it. */
+    BUFFER_CACHE_WRITE,         /* Modify it. */
+    BUFFER_CACHE_OVERWRITE      /* Replace all of it, unread. */
+  };
 
+/* What a sector holds.  Metadata is kept in preference to data. */
+enum buffer_cache_type
+  {
+    BUFFER_CACHE_DATA,          /* File data. */
+    BUFFER_CACHE_META           /* Inode, indirect block or directory. */
+  };
+
+void buffer_cache_set_size (size_t sectors);
+bool buffer_cache_set_policy (const char *name);
+void buffer_cache_set_flush_interval (unsigned ms);
+unsigned buffer_cache_flush_interval (void);
+void buffer_cache_set_dirty_ratio (unsigned percent);
 void buffer_cache_init (void);
 void buffer_cache_close (void);
+size_t buffer_cache_sync (void);
+size_t buffer_cache_sync_data (void);
+void buffer_cache_write_through (block_sector_t sector);
 void buffer_cache_read (block_sector_t sector, void *target);
 void buffer_cache_write (block_sector_t sector, const void *source);
+void *buffer_cache_get (block_sector_t sector, enum buffer_cache_mode,
+                        enum buffer_cache_type);
+void buffer_cache_release (block_sector_t sector, bool dirty);
+void buffer_cache_read_ahead (block_sector_t sector);
+
+void buffer_cache_journal_start (size_t limit);
+void buffer_cache_journal_stop (void);
+size_t buffer_cache_journal_collect (block_sector_t *sectors, void *data,
+                                     size_t max);
+void buffer_cache_journal_done (void);
+bool buffer_cache_journal_pending (void);
+bool buffer_cache_journal_fits (size_t max);
+void buffer_cache_journal_checkpointed (void);
+
+const char *buffer_cache_policy_name (void);
+void buffer_cache_counts (unsigned long long *hits,
+                          unsigned long long *misses);
+void buffer_cache_print_stats (void);
+void buffer_cache_benchmark (void);
 
 #endif
@@ -0,0 +1,195 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Maximum number of names cached. */
+#define DCACHE_SIZE 512
+
+/* A cached name: the entry for NAME in the directory whose inode
+   is in sector DIR is the inode in sector SECTOR, or there is no
+   such entry if SECTOR is 0.  Sector 0 holds the free map's inode,
+   which no directory names. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in dentries. */
+    struct list_elem lru_elem;          /* Element in lru. */
+    block_sector_t dir;                 /* Directory's inode sector. */
+    char name[NAME_MAX + 1];            /* Name in the directory. */
+    block_sector_t sector;              /* Named inode's sector, or 0. */
+  };
+
+/* Cached names, and the same names from most to least recently
+   used.  Both are protected by dcache_lock.
+
+   The directory layer calls dcache_put() only while it holds the
+   directory's lock, both after reading an entry from disk and
+   after changing one, so a name is never cached with a value the
+   directory has already replaced. */
+static struct hash dentries;
+static struct list lru;
+static struct lock dcache_lock;
+static size_t dentry_cnt;
+
+/* Lookups answered from the cache, and lookups that were not. */
+static unsigned long long hit_cnt;
+static unsigned long long miss_cnt;
+
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->dir);
+}
+
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+  if (a->dir != b->dir)
+    return a->dir < b->dir;
+  return strcmp (a->name, b->name) < 0;
+}
+
+/* Returns the cached entry for NAME in DIR, or a null pointer.
+   The caller must hold dcache_lock. */
+static struct dentry *
+find (block_sector_t dir, const char *name)
+{
+  /* Lookup key.  Static because dcache_lock serializes its use. */
+  static struct dentry key;
+  struct hash_elem *e;
+
+  key.dir = dir;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dentries, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Removes D from the cache and frees it.  The caller must hold
+   dcache_lock. */
+static void
+discard (struct dentry *d)
+{
+  hash_delete (&dentries, &d->hash_elem);
+  list_remove (&d->lru_elem);
+  dentry_cnt--;
+  free (d);
+}
+
+/* Initializes the directory entry cache. */
+void
+dcache_init (void)
+{
+  hash_init (&dentries, dentry_hash, dentry_less, NULL);
+  list_init (&lru);
+  lock_init (&dcache_lock);
+  dentry_cnt = 0;
+}
+
+/* Empties the directory entry cache, since the next file system
+   mounted need not be the same. */
+void
+dcache_done (void)
+{
+  lock_acquire (&dcache_lock);
+  while (!list_empty (&lru))
+    discard (list_entry (list_front (&lru), struct dentry, lru_elem));
+  lock_release (&dcache_lock);
+}
+
+/* Looks up NAME in the directory whose inode is in sector DIR.
+   Returns false if the cache does not know.  Otherwise, sets
+   *SECTORP to the sector of the named inode, or to 0 if DIR has no
+   entry for NAME, and returns true. */
+bool
+dcache_get (block_sector_t dir, const char *name, block_sector_t *sectorp)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    {
+      list_remove (&d->lru_elem);
+      list_push_front (&lru, &d->lru_elem);
+      *sectorp = d->sector;
+      hit_cnt++;
+    }
+  else
+    miss_cnt++;
+  lock_release (&dcache_lock);
+  return d != NULL;
+}
+
+/* Records that NAME in the directory whose inode is in sector DIR
+   names the inode in SECTOR, or nothing if SECTOR is 0.  The
+   caller must hold the directory's lock. */
+void
+dcache_put (block_sector_t dir, const char *name, block_sector_t sector)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d == NULL)
+    {
+      d = malloc (sizeof *d);
+      if (d == NULL)
+        goto done;
+      d->dir = dir;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dentries, &d->hash_elem);
+
+      /* Only now discard the least recently used entry if the
+         cache is full, so that the hash table does not shrink and
+         grow back, rehashing each time. */
+      if (dentry_cnt == DCACHE_SIZE)
+        discard (list_entry (list_back (&lru), struct dentry, lru_elem));
+      dentry_cnt++;
+    }
+  else
+    list_remove (&d->lru_elem);
+  list_push_front (&lru, &d->lru_elem);
+  d->sector = sector;
+
+ done:
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every name cached for the directory whose inode is in
+   sector DIR, which is being removed, so that nothing is found
+   in a directory that later reuses the sector.  The caller must
+   hold the directory's lock. */
+void
+dcache_purge (block_sector_t dir)
+{
+  struct list_elem *e, *next;
+
+  lock_acquire (&dcache_lock);
+  for (e = list_begin (&lru); e != list_end (&lru); e = next)
+    {
+      struct dentry *d = list_entry (e, struct dentry, lru_elem);
+      next = list_next (e);
+      if (d->dir == dir)
+        discard (d);
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Prints how many lookups the directory entry cache answered. */
+void
+dcache_print_stats (void)
+{
+  printf ("Dentry cache: %llu hits, %llu misses\n", hit_cnt, miss_cnt);
+}
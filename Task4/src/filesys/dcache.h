@@ -0,0 +1,16 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+void dcache_init (void);
+void dcache_done (void);
+bool dcache_get (block_sector_t dir, const char *name,
+                 block_sector_t *sectorp);
+void dcache_put (block_sector_t dir, const char *name,
+                 block_sector_t sector);
+void dcache_purge (block_sector_t dir);
+void dcache_print_stats (void);
+
+#endif /* filesys/dcache.h */
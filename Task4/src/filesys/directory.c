@@ -1,7 +1,11 @@
 #include "filesys/directory.h"
+#include <hash.h>
+#include <round.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
@@ -22,14 +26,414 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* Identifies a hashed directory.  A linear directory, as written
+   before hashing, starts with its ".." entry instead, whose sector
+   number is always smaller. */
+#define DIR_MAGIC 0x44495248
+
+/* Buckets a directory gets when it outgrows the compact form. */
+#define DIR_BUCKET_CNT 64
+
+/* Entries in a bucket. */
+#define DIR_BUCKET_ENTRIES 25
+
+/* Entries in a compact directory: as many as fit, with the
+   header, in the data an inode keeps inline. */
+#define DIR_COMPACT_CNT 20
+
+/* Header of a hashed directory, at the start of its first block.
+
+   A directory starts out compact, with BUCKET_CNT 0: its entries
+   follow the header directly, and are searched in order.  That
+   keeps a small directory in its inode, with no data sectors.
+
+   When a compact directory fills up, it gets buckets.  Each name
+   hashes to one of BUCKET_CNT buckets, which take up a block each
+   from block BASE on.  A bucket that fills up is chained to an
+   overflow bucket added at the end of the directory.  Buckets
+   read as empty until an entry is added to them, so they are left
+   as holes until then.  The entries of a compact directory are
+   treated as a bucket at block 0, which otherwise holds only the
+   header.
+
+   A linear directory is converted in place by building its
+   buckets past its entries, so BASE is past those.  The blocks
+   from SPARE up to BASE are reused for overflow buckets
+   afterward; in a directory created hashed, SPARE equals BASE. */
+struct dir_header
+  {
+    uint32_t magic;                     /* DIR_MAGIC. */
+    uint32_t bucket_cnt;                /* Number of buckets. */
+    uint32_t base;                      /* Block of the first bucket. */
+    uint32_t spare;                     /* First unused block below BASE. */
+    struct dir_entry parent;            /* Entry for "..". */
+  };
+
+/* A bucket of a hashed directory.  Exactly BLOCK_SECTOR_SIZE bytes
+   long. */
+struct dir_bucket
+  {
+    struct dir_entry entries[DIR_BUCKET_ENTRIES];
+    uint32_t next;                      /* Next bucket in chain, or 0. */
+    uint32_t unused[2];                 /* Not used. */
+  };
+
+/* Reads the header of directory INODE into *H.  Returns true if
+   INODE is hashed, false if it is linear. */
+static bool
+read_header (struct inode *inode, struct dir_header *h)
+{
+  return (inode_read_at (inode, h, sizeof *h, 0) == sizeof *h
+          && h->magic == DIR_MAGIC);
+}
+
+/* Writes H as the header of directory INODE. */
+static bool
+write_header (struct inode *inode, const struct dir_header *h)
+{
+  return inode_write_at (inode, h, sizeof *h, 0) == sizeof *h;
+}
+
+/* Reads the header of directory INODE into *H and returns true if
+   INODE is hashed.  Otherwise, returns false with INODE's lock
+   held, so that INODE is not converted until the caller is done
+   with its linear entries and releases the lock. */
+static bool
+read_header_or_lock (struct inode *inode, struct dir_header *h)
+{
+  if (read_header (inode, h))
+    return true;
+  inode_lock_dir (inode);
+  if (read_header (inode, h))
+    {
+      inode_unlock_dir (inode);
+      return true;
+    }
+  return false;
+}
+
+/* Returns the byte offset of entry IDX of the bucket at BLOCK. */
+static inline off_t
+entry_ofs (uint32_t block, size_t idx)
+{
+  off_t ofs = (off_t) block * BLOCK_SECTOR_SIZE;
+  if (block == 0)
+    ofs += sizeof (struct dir_header);
+  return ofs + idx * sizeof (struct dir_entry);
+}
+
+/* Returns the block of the bucket that NAME hashes to. */
+static uint32_t
+home_bucket (const struct dir_header *h, const char *name)
+{
+  if (h->bucket_cnt == 0)
+    return 0;
+  return h->base + hash_string (name) % h->bucket_cnt;
+}
+
+/* Returns the block past the last bucket of hashed directory
+   INODE with header H. */
+static uint32_t
+dir_end (struct inode *inode, const struct dir_header *h)
+{
+  uint32_t end = DIV_ROUND_UP (inode_length (inode), BLOCK_SECTOR_SIZE);
+  return end > h->base + h->bucket_cnt ? end : h->base + h->bucket_cnt;
+}
+
+/* Reads the bucket at BLOCK of INODE into *B.  Whatever lies past
+   the end of INODE reads as empty. */
+static void
+read_bucket (struct inode *inode, uint32_t block, struct dir_bucket *b)
+{
+  off_t size = (block == 0
+                ? DIR_COMPACT_CNT * sizeof (struct dir_entry)
+                : sizeof *b);
+  off_t n = inode_read_at (inode, b, size, entry_ofs (block, 0));
+  memset ((uint8_t *) b + n, 0, sizeof *b - n);
+}
+
+/* Advances *BLOCK to the first block from *BLOCK on that holds a
+   bucket of hashed directory INODE, and reads that bucket into *B.
+   Returns false if there are no more buckets. */
+static bool
+next_bucket (struct inode *inode, const struct dir_header *h,
+             uint32_t *block, struct dir_bucket *b)
+{
+  if (h->bucket_cnt == 0)
+    {
+      if (*block != 0)
+        return false;
+      read_bucket (inode, 0, b);
+      return true;
+    }
+  if (*block == 0)
+    *block = 1;
+  if (*block >= h->spare && *block < h->base)
+    *block = h->base;
+  if (*block >= dir_end (inode, h))
+    return false;
+  read_bucket (inode, *block, b);
+  return true;
+}
+
+static bool grow (struct inode *, struct dir_header *);
+
+/* Adds E to hashed directory INODE with header H, which must not
+   already contain its name.  If the chain of buckets for the name
+   is full, a bucket is added to it and linked in last, so that
+   lookups that do not hold the directory's lock never follow a
+   link to a bucket not yet written.  A full compact directory
+   gets buckets first. */
+static bool
+hashed_insert (struct inode *inode, struct dir_header *h,
+               const struct dir_entry *e)
+{
+  struct dir_bucket *b;
+  uint32_t block = home_bucket (h, e->name);
+  size_t entry_cnt = block == 0 ? DIR_COMPACT_CNT : DIR_BUCKET_ENTRIES;
+  uint32_t new_block;
+  bool success = false;
+  size_t i;
+
+  b = malloc (sizeof *b);
+  if (b == NULL)
+    return false;
+
+  /* Use the first free entry in the chain. */
+  for (;;)
+    {
+      read_bucket (inode, block, b);
+      for (i = 0; i < entry_cnt; i++)
+        if (!b->entries[i].in_use)
+          {
+            success = inode_write_at (inode, e, sizeof *e,
+                                      entry_ofs (block, i)) == sizeof *e;
+            goto done;
+          }
+      if (b->next == 0)
+        break;
+      block = b->next;
+      entry_cnt = DIR_BUCKET_ENTRIES;
+    }
+
+  if (block == 0)
+    {
+      free (b);
+      return grow (inode, h) && hashed_insert (inode, h, e);
+    }
+
+  /* Add an overflow bucket. */
+  new_block = h->spare < h->base ? h->spare : dir_end (inode, h);
+  memset (b, 0, sizeof *b);
+  b->entries[0] = *e;
+  if (inode_write_at (inode, b, sizeof *b,
+                      (off_t) new_block * BLOCK_SECTOR_SIZE) != sizeof *b)
+    goto done;
+  if (new_block == h->spare)
+    {
+      h->spare++;
+      if (!write_header (inode, h))
+        goto done;
+    }
+  success = inode_write_at (inode, &new_block, sizeof new_block,
+                            (off_t) block * BLOCK_SECTOR_SIZE
+                            + offsetof (struct dir_bucket, next))
+            == sizeof new_block;
+
+ done:
+  free (b);
+  return success;
+}
+
+/* Searches hashed directory INODE with header H for NAME, like
+   lookup() below. */
+static bool
+hashed_lookup (struct inode *inode, const struct dir_header *h,
+               const char *name, struct dir_entry *ep, off_t *ofsp)
+{
+  struct dir_bucket *b;
+  uint32_t block;
+  bool found = false;
+  size_t i;
+
+  if (!strcmp (name, ".."))
+    {
+      if (!h->parent.in_use)
+        return false;
+      if (ep != NULL)
+        *ep = h->parent;
+      if (ofsp != NULL)
+        *ofsp = offsetof (struct dir_header, parent);
+      return true;
+    }
+
+  b = malloc (sizeof *b);
+  if (b == NULL)
+    return false;
+  block = home_bucket (h, name);
+  for (;;)
+    {
+      read_bucket (inode, block, b);
+      for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+        if (b->entries[i].in_use && !strcmp (name, b->entries[i].name))
+          {
+            if (ep != NULL)
+              *ep = b->entries[i];
+            if (ofsp != NULL)
+              *ofsp = entry_ofs (block, i);
+            found = true;
+            break;
+          }
+      if (found || b->next == 0)
+        break;
+      block = b->next;
+    }
+  free (b);
+  return found;
+}
+
+/* Searches linear directory INODE for NAME, like lookup() below. */
+static bool
+linear_lookup (struct inode *inode, const char *name,
+               struct dir_entry *ep, off_t *ofsp)
+{
+  struct dir_entry e;
+  size_t ofs;
+
+  for (ofs = 0; inode_read_at (inode, &e, sizeof e, ofs) == sizeof e;
+       ofs += sizeof e) 
+    if (e.in_use && !strcmp (name, e.name)) 
+      {
+        if (ep != NULL)
+          *ep = e;
+        if (ofsp != NULL)
+          *ofsp = ofs;
+        return true;
+      }
+  return false;
+}
+
+/* Zeroes the buckets of INODE from H's base on, which a
+   conversion to header H failing partway through has written but
+   the directory's current header does not use.  The buckets are
+   already allocated, so this cannot fail for lack of space. */
+static void
+scrub_buckets (struct inode *inode, const struct dir_header *h)
+{
+  struct dir_bucket *b;
+  uint32_t block;
+  size_t i;
+
+  b = malloc (sizeof *b);
+  if (b == NULL)
+    return;
+  for (block = h->base; block < dir_end (inode, h); block++)
+    {
+      bool used = false;
+
+      read_bucket (inode, block, b);
+      for (i = 0; i < sizeof *b && !used; i++)
+        used = ((uint8_t *) b)[i] != 0;
+      if (used)
+        {
+          memset (b, 0, sizeof *b);
+          inode_write_at (inode, b, sizeof *b,
+                          (off_t) block * BLOCK_SECTOR_SIZE);
+        }
+    }
+  free (b);
+}
+
+/* Converts linear directory INODE, whose lock the caller holds, to
+   a hashed directory, and sets *H to its new header.  The linear
+   entries are left in place until the header overwrites the first
+   of them, so INODE stays a valid linear directory if the disk
+   fills up before that. */
+static bool
+dir_convert (struct inode *inode, struct dir_header *h)
+{
+  off_t length = inode_length (inode);
+  struct dir_entry e;
+  off_t ofs;
+
+  h->magic = DIR_MAGIC;
+  h->bucket_cnt = DIR_BUCKET_CNT;
+  h->base = length > 0 ? DIV_ROUND_UP (length, BLOCK_SECTOR_SIZE) : 1;
+  h->spare = h->base;
+  if (inode_read_at (inode, &h->parent, sizeof h->parent, 0)
+      != sizeof h->parent)
+    memset (&h->parent, 0, sizeof h->parent);
+
+  for (ofs = sizeof e; ofs + (off_t) sizeof e <= length; ofs += sizeof e)
+    if (inode_read_at (inode, &e, sizeof e, ofs) != sizeof e
+        || (e.in_use && !hashed_insert (inode, h, &e)))
+      goto fail;
+  h->spare = 1;
+  if (write_header (inode, h))
+    return true;
+
+ fail:
+  scrub_buckets (inode, h);
+  return false;
+}
+
+/* Gives compact directory INODE, whose lock the caller holds and
+   whose header is *H, buckets for its entries, and updates *H.
+   Leaves INODE and *H as they were on failure. */
+static bool
+grow (struct inode *inode, struct dir_header *h)
+{
+  struct dir_header new = *h;
+  struct dir_bucket *b;
+  bool success = true;
+  size_t i;
+
+  b = malloc (sizeof *b);
+  if (b == NULL)
+    return false;
+  read_bucket (inode, 0, b);
+
+  new.bucket_cnt = DIR_BUCKET_CNT;
+  new.base = new.spare = 1;
+  for (i = 0; i < DIR_COMPACT_CNT && success; i++)
+    if (b->entries[i].in_use)
+      success = hashed_insert (inode, &new, &b->entries[i]);
+  free (b);
+
+  if (success && write_header (inode, &new))
+    {
+      *h = new;
+      return true;
+    }
+  scrub_buckets (inode, &new);
+  return false;
+}
+
 static bool
 dir_is_empty (struct dir *dir)
 {
   struct inode *inode = dir_get_inode (dir);
+  struct dir_header h;
   struct dir_entry e;
   off_t ofs;
   bool is_empty = true;
 
+  if (read_header (inode, &h))
+    {
+      struct dir_bucket *b = malloc (sizeof *b);
+      uint32_t block;
+      size_t i;
+
+      if (b == NULL)
+        return false;
+      for (block = 0; is_empty && next_bucket (inode, &h, &block, b);
+           block++)
+        for (i = 0; i < DIR_BUCKET_ENTRIES; i++)
+          is_empty = is_empty && !b->entries[i].in_use;
+      free (b);
+      return is_empty;
+    }
+
   for (ofs = sizeof e; inode_read_at (inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) {
     is_empty = is_empty && !e.in_use;
@@ -43,25 +447,40 @@ dir_is_empty (struct dir *dir)
 bool
 dir_create (block_sector_t sector, size_t entry_cnt)
 {
-  if (sector == ROOT_DIR_SECTOR) {
-    struct inode *root_dir;
-    struct dir_entry e;
-
-    if (inode_create (sector, entry_cnt * sizeof (struct dir_entry), true) == false)
-      return false;
-    root_dir = inode_open (sector);
+  struct dir_header h;
+  struct inode *inode;
+  bool success;
 
-    e.inode_sector = sector;
-    strlcpy (e.name, "..", 3);
-    e.in_use = true;
-    
-    bool success = inode_write_at (root_dir, &e, sizeof e, 0) == sizeof e;
+  ASSERT (sizeof (struct dir_bucket) == BLOCK_SECTOR_SIZE);
 
-    inode_close (root_dir);
-    return success;
+  h.magic = DIR_MAGIC;
+  h.bucket_cnt = 0;
+  if (entry_cnt > DIR_COMPACT_CNT)
+    {
+      h.bucket_cnt = DIV_ROUND_UP (entry_cnt, DIR_BUCKET_ENTRIES);
+      if (h.bucket_cnt < DIR_BUCKET_CNT)
+        h.bucket_cnt = DIR_BUCKET_CNT;
+    }
+  h.base = h.spare = 1;
+  memset (&h.parent, 0, sizeof h.parent);
+  if (sector == ROOT_DIR_SECTOR) {
+    h.parent.inode_sector = sector;
+    strlcpy (h.parent.name, "..", sizeof h.parent.name);
+    h.parent.in_use = true;
   }
-  else
-    return inode_create (sector, entry_cnt * sizeof (struct dir_entry), true);
+
+  /* The buckets are holes until entries are added.  A compact
+     directory ends with its header, so that it starts out inline,
+     and grows as entries are added. */
+  if (!inode_create (sector, (h.bucket_cnt == 0
+                              ? (off_t) sizeof h
+                              : (off_t) (h.base + h.bucket_cnt)
+                                * BLOCK_SECTOR_SIZE), true))
+    return false;
+  inode = inode_open (sector);
+  success = inode != NULL && write_header (inode, &h);
+  inode_close (inode);
+  return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -122,38 +541,34 @@ dir_get_inode (struct dir *dir)
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
    directory entry if OFSP is non-null.
-   otherwise, returns false and ignores EP and OFSP. */
+   otherwise, returns false and ignores EP and OFSP.
+   If DIR is linear, the caller must hold its lock. */
 static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
-  struct dir_entry e;
-  size_t ofs;
-  
+  struct dir_header h;
+
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (e.in_use && !strcmp (name, e.name)) 
-      {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
-      }
-  return false;
+  if (read_header (dir->inode, &h))
+    return hashed_lookup (dir->inode, &h, name, ep, ofsp);
+  return linear_lookup (dir->inode, name, ep, ofsp);
 }
 
 /* Searches DIR for a file with the given NAME
    and returns true if one exists, false otherwise.
    On success, sets *INODE to an inode for the file, otherwise to
-   a null pointer.  The caller must close *INODE. */
+   a null pointer.  The caller must close *INODE.
+   The answer comes from the directory entry cache if it is
+   there, without reading DIR. */
 bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
+  block_sector_t dir_sector = inode_get_inumber (dir->inode);
+  block_sector_t sector;
   struct dir_entry e;
 
   ASSERT (dir != NULL);
@@ -162,10 +577,19 @@ dir_lookup (const struct dir *dir, const char *name,
   if (!strcmp (name, ".")) {
     *inode = inode_reopen (dir->inode);
   }
-  else if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
-  else
-    *inode = NULL;
+  else if (dcache_get (dir_sector, name, &sector))
+    *inode = sector != 0 ? inode_open (sector) : NULL;
+  else {
+    /* Hold DIR's lock so that the entry cannot change between
+       reading it and caching it.  Nothing is cached for a removed
+       directory, whose sector may be reused. */
+    inode_lock_dir (dir->inode);
+    sector = lookup (dir, name, &e, NULL) ? e.inode_sector : 0;
+    *inode = sector != 0 ? inode_open (sector) : NULL;
+    if (!inode_is_removed (dir->inode))
+      dcache_put (dir_sector, name, sector);
+    inode_unlock_dir (dir->inode);
+  }
 
   return *inode != NULL;
 }
@@ -175,12 +599,13 @@ dir_lookup (const struct dir *dir, const char *name,
    INODE_SECTOR.
    Returns true if successful, false on failure.
    Fails if NAME is invalid (i.e. too long) or a disk or memory
-   error occurs. */
+   error occurs.  A linear DIR is converted to a hashed one
+   first. */
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 {
+  struct dir_header h;
   struct dir_entry e;
-  off_t ofs;
   bool success = false;
 
   ASSERT (dir != NULL);
@@ -190,40 +615,45 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
-  /* Check that NAME is not in use. */
-  if (lookup (dir, name, NULL, NULL))
+  /* Check that NAME is not in use, and that DIR was not removed
+     after it was opened.  Both stay true until the entry is
+     written, since no one else changes DIR meanwhile. */
+  inode_lock_dir (dir->inode);
+  if (inode_is_removed (dir->inode) || lookup (dir, name, NULL, NULL))
+    goto done;
+  if (!read_header (dir->inode, &h) && !dir_convert (dir->inode, &h))
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-    if (!e.in_use)
-      break;
-
-  /* Write slot. */
+  /* Write entry. */
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (!strcmp (name, ".."))
+    {
+      h.parent = e;
+      success = write_header (dir->inode, &h);
+    }
+  else
+    success = hashed_insert (dir->inode, &h, &e);
+  if (success)
+    dcache_put (inode_get_inumber (dir->inode), name, inode_sector);
 
  done:
+  inode_unlock_dir (dir->inode);
   return success;
 }
 
 /* Removes any entry for NAME in DIR.
    Returns true if successful, false on failure,
-   which occurs only if there is no file with the given NAME. */
+   which occurs only if there is no file with the given NAME.
+   A linear DIR is converted to a hashed one first. */
 bool
 dir_remove (struct dir *dir, const char *name) 
 {
+  struct dir_header h;
   struct dir_entry e;
   struct inode *inode = NULL;
+  bool locked = false;
   bool success = false;
   off_t ofs;
 
@@ -231,46 +661,66 @@ dir_remove (struct dir *dir, const char *name)
   ASSERT (name != NULL);
 
   /* Find directory entry. */
-  if (!lookup (dir, name, &e, &ofs)) {
+  inode_lock_dir (dir->inode);
+  if (!read_header (dir->inode, &h) && !dir_convert (dir->inode, &h))
+    goto done;
+  if (!hashed_lookup (dir->inode, &h, name, &e, &ofs)) {
     goto done;
   }
 
   /* Open inode. */
   inode = inode_open (e.inode_sector);
-  bool is_opened = inode_is_opened (inode);
   if (inode == NULL ||
       inode_get_inumber (inode) == ROOT_DIR_SECTOR)
     goto done;
 
 
   if (inode_is_dir (inode)) {
-    if (is_opened) {
+    /* Keep entries from being added to the directory until it is
+       removed.  A parent is always locked before its child. */
+    inode_lock_dir (inode);
+    locked = true;
+    if (inode_is_opened (inode)) {
       goto done;
     }
 
-    struct dir *r_dir = dir_open (inode);
-    if (!dir_is_empty (r_dir)) {
+    struct dir *r_dir = dir_open (inode_reopen (inode));
+    if (r_dir == NULL || !dir_is_empty (r_dir)) {
       dir_close (r_dir);
       goto done;
     }
-    struct inode *cur_inode = dir_get_inode (thread_current ()->cur_dir);
-    if (inode_get_inumber (cur_inode) == inode_get_inumber (inode)) {
+    /* Kernel threads have no working directory. */
+    struct dir *cur_dir = thread_current ()->cur_dir;
+    if (cur_dir != NULL
+        && inode_get_inumber (dir_get_inode (cur_dir))
+           == inode_get_inumber (inode)) {
       dir_close (r_dir);
       goto done;
     }
     dir_close (r_dir);
   }
 
+  /* Remove inode, putting it in the orphan list before its entry
+     is erased, so that a crash in between cannot leak its data. */
+  inode_remove (inode);
+
   /* Erase directory entry. */
   e.in_use = false;
-  if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
+  if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) {
+    inode_unremove (inode);
     goto done;
+  }
 
-  /* Remove inode. */
-  inode_remove (inode);
+  /* Forget the inode and, if it is a directory, its entries. */
+  dcache_put (inode_get_inumber (dir->inode), name, 0);
+  if (locked)
+    dcache_purge (inode_get_inumber (inode));
   success = true;
 
  done:
+  if (locked)
+    inode_unlock_dir (inode);
+  inode_unlock_dir (dir->inode);
   inode_close (inode);
   return success;
 }
@@ -281,57 +731,115 @@ dir_remove (struct dir *dir, const char *name)
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
+  struct dir_header h;
   struct dir_entry e;
 
+  if (read_header_or_lock (dir->inode, &h))
+    {
+      struct dir_bucket *b = malloc (sizeof *b);
+      uint32_t block = dir->pos / BLOCK_SECTOR_SIZE;
+      off_t ofs = dir->pos - entry_ofs (block, 0);
+      size_t i = ofs > 0 ? ofs / sizeof e : 0;
+      bool found = false;
+
+      if (b == NULL)
+        return false;
+      while (!found)
+        {
+          uint32_t start = block;
+
+          if (!next_bucket (dir->inode, &h, &block, b))
+            break;
+          if (block != start)
+            i = 0;
+          for (; i < DIR_BUCKET_ENTRIES && !found; i++)
+            if (b->entries[i].in_use)
+              {
+                strlcpy (name, b->entries[i].name, NAME_MAX + 1);
+                dir->pos = entry_ofs (block, i + 1);
+                found = true;
+              }
+          block++;
+          i = 0;
+        }
+      if (!found)
+        dir->pos = (off_t) block * BLOCK_SECTOR_SIZE;
+      free (b);
+      return found;
+    }
+
   while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
     {
       dir->pos += sizeof e;
       if (e.in_use)
         {
           strlcpy (name, e.name, NAME_MAX + 1);
+          inode_unlock_dir (dir->inode);
           return true;
         } 
     }
+  inode_unlock_dir (dir->inode);
   return false;
 }
 
+/* Copies the next file name component of the path at *SRCP into
+   PART and advances *SRCP past it.  Returns 1 if successful, 0 at
+   the end of the path, or -1 if the component is longer than
+   NAME_MAX. */
+static int
+get_next_part (char part[NAME_MAX + 1], const char **srcp)
+{
+  const char *src = *srcp;
+  char *dst = part;
+
+  /* Skip leading slashes.  If it's all slashes, we're done. */
+  while (*src == '/')
+    src++;
+  if (*src == '\0')
+    return 0;
+
+  /* Copy up to NAME_MAX characters from SRC to DST. */
+  while (*src != '/' && *src != '\0')
+    {
+      if (dst < part + NAME_MAX)
+        *dst++ = *src;
+      else
+        return -1;
+      src++;
+    }
+  *dst = '\0';
+
+  *srcp = src;
+  return 1;
+}
+
+/* Opens the directory at path DIR, relative to the current
+   thread's working directory unless it starts with "/".  Returns
+   a null pointer if a component does not exist or is not a
+   directory. */
 struct dir*
 dir_open_dir (const char *dir)
 {
-  char *dir_cpy;
-  char *save_ptr, *moveTo;
-  const char *slash = "/";
+  char name[NAME_MAX + 1];
   struct dir *cur_dir;
+  int part;
 
-  dir_cpy = (char *)malloc(strlen (dir) + 1);
-  strlcpy (dir_cpy, dir, strlen (dir) + 1);
-
-  if (dir_cpy[0] == '/') {
+  if (dir[0] == '/' || thread_current ()->cur_dir == NULL)
     cur_dir = dir_open_root ();
-  }
-  else {
-    if (thread_current ()->cur_dir == NULL)
-      cur_dir = dir_open_root ();
-    else
-      cur_dir = dir_reopen (thread_current ()->cur_dir);
-  }
+  else
+    cur_dir = dir_reopen (thread_current ()->cur_dir);
 
-  for (moveTo = strtok_r (dir_cpy, slash, &save_ptr);
-       moveTo != NULL; moveTo = strtok_r (NULL, slash, &save_ptr)) {
-    struct dir *next_dir;
-    struct inode *next;
-    bool success = dir_lookup (cur_dir, moveTo, &next);
-    if (success) {
-      next_dir = dir_open (next);
-      dir_close (cur_dir);
-      if (next_dir == NULL)
-	return NULL;
-      cur_dir = next_dir;
-    }
-    else {
+  while (cur_dir != NULL && (part = get_next_part (name, &dir)) != 0) {
+    struct inode *next = NULL;
+
+    if (part < 0 || !dir_lookup (cur_dir, name, &next)
+        || !inode_is_dir (next)) {
+      inode_close (next);
       dir_close (cur_dir);
       return NULL;
     }
+    dir_close (cur_dir);
+    cur_dir = dir_open (next);
   }
 
   return cur_dir;
@@ -346,8 +854,10 @@ dir_sub_create (block_sector_t sector, char *name, struct dir *prev_dir)
   struct dir *dir;
   bool success;
 
-  if (lookup (prev_dir, name, NULL, NULL))
+  if (dir_lookup (prev_dir, name, &dir_inode)) {
+    inode_close (dir_inode);
     return false;
+  }
 
   success = dir_create (sector, 16);
 
@@ -410,16 +920,42 @@ dir_parse (const char *dir, char base[NAME_MAX + 1], char name[NAME_MAX + 1])
 bool
 dir_lookup_by_sector (struct dir *dir, block_sector_t sector, char **name)
 {
+  struct dir_header h;
   struct dir_entry e;
   size_t ofs;
   struct inode *inode = dir_get_inode (dir);
+  bool found = false;
+
+  if (read_header_or_lock (inode, &h)) {
+    struct dir_bucket *b;
+    uint32_t block;
+    size_t i;
+
+    if (h.parent.in_use && h.parent.inode_sector == sector) {
+      strlcpy (*name, h.parent.name, strlen (h.parent.name) + 1);
+      return true;
+    }
+    b = malloc (sizeof *b);
+    if (b == NULL)
+      return false;
+    for (block = 0; !found && next_bucket (inode, &h, &block, b); block++)
+      for (i = 0; i < DIR_BUCKET_ENTRIES && !found; i++)
+        if (b->entries[i].in_use && b->entries[i].inode_sector == sector) {
+          strlcpy (*name, b->entries[i].name, strlen (b->entries[i].name) + 1);
+          found = true;
+        }
+    free (b);
+    return found;
+  }
 
   for (ofs = 0; inode_read_at (inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) {
     if (e.in_use && e.inode_sector == sector) {
       strlcpy (*name, e.name, strlen (e.name) + 1);
-      return true;
+      found = true;
+      break;
     }
   }
-  return false;
+  inode_unlock_dir (inode);
+  return found;
 }
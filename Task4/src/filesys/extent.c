@@ -0,0 +1,532 @@
+#include "filesys/extent.h"
+#include <debug.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+
+/* Entries in a node of an extent tree other than the root. */
+#define EXTENT_NODE_CNT ((BLOCK_SECTOR_SIZE - sizeof (struct extent_header)) \
+                         / sizeof (struct extent))
+
+/* Deepest extent tree supported.  With even a few entries in the
+   root and EXTENT_NODE_CNT in every other node, a tree this deep
+   maps far more extents than any disk has sectors. */
+#define EXTENT_MAX_DEPTH 4
+
+/* A node of an extent tree other than the root, which takes up
+   one sector.  Nodes are only ever read and written whole, through
+   a copy, so that no cached sector is held while the free map is
+   updated. */
+struct extent_node
+  {
+    struct extent_header hdr;
+    struct extent entries[EXTENT_NODE_CNT];
+    uint8_t unused[BLOCK_SECTOR_SIZE - sizeof (struct extent_header)
+                   - EXTENT_NODE_CNT * sizeof (struct extent)];
+  };
+
+/* State for one extent_add() call: sectors allocated beforehand for
+   the nodes it has to create, and node buffers for each level of
+   the tree, including one the root may grow, plus one for the node
+   being split off. */
+struct extent_insert
+  {
+    block_sector_t spares[EXTENT_MAX_DEPTH + 1];
+    size_t spare_cnt;
+    struct extent_node *nodes;
+  };
+
+/* Initializes ROOT as an empty tree. */
+void
+extent_init (struct extent_root *root)
+{
+  ASSERT (sizeof (struct extent_node) == BLOCK_SECTOR_SIZE);
+  memset (root, 0, sizeof *root);
+}
+
+static void
+node_read (block_sector_t sector, struct extent_node *node)
+{
+  memcpy (node, buffer_cache_get (sector, BUFFER_CACHE_READ,
+                                  BUFFER_CACHE_META), sizeof *node);
+  buffer_cache_release (sector, false);
+}
+
+static void
+node_write (block_sector_t sector, const struct extent_node *node)
+{
+  memcpy (buffer_cache_get (sector, BUFFER_CACHE_OVERWRITE,
+                            BUFFER_CACHE_META), node, sizeof *node);
+  buffer_cache_release (sector, true);
+}
+
+/* Returns the index of the last of the CNT entries in E whose
+   LOGICAL is at most BLOCK, or -1 if there is none. */
+static int
+search (const struct extent *e, size_t cnt, uint32_t block)
+{
+  size_t lo = 0, hi = cnt;
+
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (e[mid].logical <= block)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return (int) lo - 1;
+}
+
+/* Returns the index of the child of index entries E that BLOCK
+   belongs in.  Blocks before the first child's go there too. */
+static size_t
+search_index (const struct extent *e, size_t cnt, uint32_t block)
+{
+  int i = search (e, cnt, block);
+  return i >= 0 ? (size_t) i : 0;
+}
+
+/* Returns the sector holding BLOCK of the file mapped by ROOT, or
+   0 if BLOCK is not mapped.  If RUN is not null, stores in *RUN
+   the number of blocks from BLOCK on that follow it contiguously
+   on disk, or, if BLOCK is not mapped, the number of blocks from
+   BLOCK on that are not mapped either (UINT32_MAX if no later
+   block is mapped). */
+block_sector_t
+extent_lookup (const struct extent_root *root, uint32_t block, uint32_t *run)
+{
+  unsigned depth = root->hdr.depth;
+  uint32_t next = UINT32_MAX;
+  struct extent e;
+  int i;
+
+  i = search (root->entries, root->hdr.cnt, block);
+  if (i + 1 < root->hdr.cnt)
+    next = root->entries[i + 1].logical;
+  if (i < 0)
+    goto hole;
+  e = root->entries[i];
+  while (depth-- > 0)
+    {
+      block_sector_t sector = e.start;
+      const struct extent_node *node
+        = buffer_cache_get (sector, BUFFER_CACHE_READ, BUFFER_CACHE_META);
+      i = search (node->entries, node->hdr.cnt, block);
+      if (i >= 0)
+        e = node->entries[i];
+      if (i + 1 < node->hdr.cnt)
+        next = node->entries[i + 1].logical;
+      buffer_cache_release (sector, false);
+      if (i < 0)
+        goto hole;
+    }
+
+  if (block - e.logical >= e.length)
+    goto hole;
+  if (run != NULL)
+    *run = e.length - (block - e.logical);
+  return e.start + (block - e.logical);
+
+ hole:
+  if (run != NULL)
+    *run = next == UINT32_MAX ? UINT32_MAX : next - block;
+  return 0;
+}
+
+/* Returns the number of the block just past the last one mapped
+   by ROOT, or 0 if ROOT maps nothing. */
+uint32_t
+extent_end (const struct extent_root *root)
+{
+  unsigned depth = root->hdr.depth;
+  struct extent e;
+
+  if (root->hdr.cnt == 0)
+    return 0;
+  e = root->entries[root->hdr.cnt - 1];
+  while (depth-- > 0)
+    {
+      block_sector_t sector = e.start;
+      const struct extent_node *node
+        = buffer_cache_get (sector, BUFFER_CACHE_READ, BUFFER_CACHE_META);
+      ASSERT (node->hdr.cnt > 0);
+      e = node->entries[node->hdr.cnt - 1];
+      buffer_cache_release (sector, false);
+    }
+  return e.logical + e.length;
+}
+
+/* Returns true if extent B continues extent A, in the file and on
+   disk alike. */
+static bool
+adjacent (const struct extent *a, const struct extent *b)
+{
+  return (a->logical + a->length == b->logical
+          && a->start + a->length == b->start);
+}
+
+/* Returns true if EXT can be merged into one of the CNT extents in
+   leaf entries E. */
+static bool
+can_merge (const struct extent *e, size_t cnt, const struct extent *ext)
+{
+  int i = search (e, cnt, ext->logical);
+  return ((i >= 0 && adjacent (&e[i], ext))
+          || ((size_t) (i + 1) < cnt && adjacent (ext, &e[i + 1])));
+}
+
+/* Merges EXT into the extent before or after it in leaf node HDR,
+   E, if they are adjacent, and returns true if it did. */
+static bool
+merge (struct extent_header *hdr, struct extent *e, const struct extent *ext)
+{
+  int i = search (e, hdr->cnt, ext->logical);
+
+  if (i >= 0 && adjacent (&e[i], ext))
+    {
+      e[i].length += ext->length;
+      if ((size_t) (i + 1) < hdr->cnt && adjacent (&e[i], &e[i + 1]))
+        {
+          e[i].length += e[i + 1].length;
+          memmove (&e[i + 1], &e[i + 2],
+                   (hdr->cnt - i - 2) * sizeof *e);
+          hdr->cnt--;
+        }
+      return true;
+    }
+  if ((size_t) (i + 1) < hdr->cnt && adjacent (ext, &e[i + 1]))
+    {
+      e[i + 1].logical = ext->logical;
+      e[i + 1].start = ext->start;
+      e[i + 1].length += ext->length;
+      return true;
+    }
+  return false;
+}
+
+/* Inserts EXT as entry POS of node HDR, E, which has room. */
+static void
+insert_at (struct extent_header *hdr, struct extent *e, size_t pos,
+           const struct extent *ext)
+{
+  memmove (&e[pos + 1], &e[pos], (hdr->cnt - pos) * sizeof *e);
+  e[pos] = *ext;
+  hdr->cnt++;
+}
+
+/* Inserts EXT as entry POS of node HDR, E, which holds up to CAP
+   entries.  If the node is full, moves its upper entries to a new
+   node, stores the index entry for the new node in *SPLIT and
+   sets *DID_SPLIT to true.  A node split by an append keeps all
+   of its entries, since files mostly grow at the end. */
+static void
+put (struct extent_insert *ins, unsigned level,
+     struct extent_header *hdr, struct extent *e, size_t cap, size_t pos,
+     const struct extent *ext, struct extent *split, bool *did_split)
+{
+  if (hdr->cnt < cap)
+    {
+      insert_at (hdr, e, pos, ext);
+      return;
+    }
+
+  ASSERT (ins->spare_cnt > 0);
+  block_sector_t sector = ins->spares[--ins->spare_cnt];
+  struct extent_node *right = &ins->nodes[level + 1];
+  size_t keep = pos == hdr->cnt ? hdr->cnt : hdr->cnt / 2;
+
+  memset (right, 0, sizeof *right);
+  right->hdr.depth = hdr->depth;
+  right->hdr.cnt = hdr->cnt - keep;
+  memcpy (right->entries, &e[keep], right->hdr.cnt * sizeof *e);
+  hdr->cnt = keep;
+  if (pos <= keep && keep < cap)
+    insert_at (hdr, e, pos, ext);
+  else
+    insert_at (&right->hdr, right->entries, pos - keep, ext);
+  node_write (sector, right);
+
+  split->logical = right->entries[0].logical;
+  split->start = sector;
+  split->length = 0;
+  *did_split = true;
+}
+
+/* Adds EXT to the subtree rooted at node HDR, E, which holds up to
+   CAP entries and is at LEVEL of the tree.  Returns true if the
+   node itself was modified. */
+static bool
+insert (struct extent_insert *ins, unsigned level,
+        struct extent_header *hdr, struct extent *e, size_t cap,
+        const struct extent *ext, struct extent *split, bool *did_split)
+{
+  struct extent child_split;
+  bool child_did_split = false;
+  bool changed = false;
+
+  *did_split = false;
+  if (hdr->depth == 0)
+    {
+      if (!merge (hdr, e, ext))
+        put (ins, level, hdr, e, cap, search (e, hdr->cnt, ext->logical) + 1,
+             ext, split, did_split);
+      return true;
+    }
+
+  size_t i = search_index (e, hdr->cnt, ext->logical);
+  if (ext->logical < e[i].logical)
+    {
+      e[i].logical = ext->logical;
+      changed = true;
+    }
+
+  block_sector_t sector = e[i].start;
+  struct extent_node *node = &ins->nodes[level];
+  node_read (sector, node);
+  if (insert (ins, level + 1, &node->hdr, node->entries, EXTENT_NODE_CNT,
+              ext, &child_split, &child_did_split))
+    node_write (sector, node);
+  if (child_did_split)
+    {
+      put (ins, level, hdr, e, cap, i + 1, &child_split, split, did_split);
+      changed = true;
+    }
+  return changed;
+}
+
+/* Returns the number of new nodes that adding EXT to ROOT, which
+   holds up to ROOT_CNT entries, will take, counting the node the
+   root's entries move to if the root is full and has to grow a
+   level.  Sets *GROW to whether it has to. */
+static size_t
+nodes_needed (const struct extent_root *root, size_t root_cnt,
+              const struct extent *ext, bool *grow)
+{
+  bool full[EXTENT_MAX_DEPTH];
+  bool merges;
+  size_t n = 0;
+
+  *grow = false;
+  if (root->hdr.depth == 0)
+    merges = can_merge (root->entries, root->hdr.cnt, ext);
+  else
+    {
+      unsigned level;
+      block_sector_t sector
+        = root->entries[search_index (root->entries, root->hdr.cnt,
+                                      ext->logical)].start;
+
+      merges = false;
+      for (level = root->hdr.depth; level > 0; level--)
+        {
+          block_sector_t this = sector;
+          const struct extent_node *node
+            = buffer_cache_get (this, BUFFER_CACHE_READ, BUFFER_CACHE_META);
+          full[n++] = node->hdr.cnt >= EXTENT_NODE_CNT;
+          if (level > 1)
+            sector = node->entries[search_index (node->entries,
+                                                 node->hdr.cnt,
+                                                 ext->logical)].start;
+          else
+            merges = can_merge (node->entries, node->hdr.cnt, ext);
+          buffer_cache_release (this, false);
+        }
+    }
+  if (merges)
+    return 0;
+
+  /* A new entry splits every full node from the leaf up. */
+  size_t needed = 0;
+  while (n > 0 && full[n - 1])
+    {
+      needed++;
+      n--;
+    }
+  if (n == 0 && root->hdr.cnt >= root_cnt)
+    {
+      *grow = true;
+      needed++;
+    }
+  return needed;
+}
+
+/* Maps LENGTH blocks of the file starting at BLOCK, none of which
+   may be mapped yet, to the sectors starting at START, in the tree
+   rooted at ROOT, which has room for ROOT_CNT entries, no more than
+   EXTENT_ROOT_CNT.  Merges the new extent with its neighbors where
+   possible.  Sectors for new tree nodes are taken out of *RESERVE,
+   sectors the caller set aside, first, if RESERVE is not null.
+   Returns false if memory or the sectors for new tree nodes cannot
+   be allocated, in which case ROOT and *RESERVE are unchanged. */
+bool
+extent_add (struct extent_root *root, size_t root_cnt, uint32_t block,
+            block_sector_t start, uint32_t length, size_t *reserve)
+{
+  struct extent ext = { block, start, length };
+  struct extent_insert ins;
+  struct extent split;
+  bool did_split, grow;
+  size_t needed, kept;
+
+  ASSERT (length > 0);
+  ASSERT (root_cnt > 0 && root_cnt <= EXTENT_ROOT_CNT);
+
+  needed = nodes_needed (root, root_cnt, &ext, &grow);
+  if (grow && root->hdr.depth + 1 >= EXTENT_MAX_DEPTH)
+    return false;
+  ins.nodes = malloc ((root->hdr.depth + 3) * sizeof *ins.nodes);
+  if (ins.nodes == NULL)
+    return false;
+  kept = reserve != NULL ? *reserve : 0;
+  for (ins.spare_cnt = 0; ins.spare_cnt < needed; ins.spare_cnt++)
+    if (!free_map_allocate_reserved (start, 1, reserve,
+                                     &ins.spares[ins.spare_cnt]))
+      {
+        /* Give back to *RESERVE what was taken out of it. */
+        kept -= reserve != NULL ? *reserve : 0;
+        while (ins.spare_cnt > 0)
+          {
+            size_t keep = kept > 0 ? 1 : 0;
+            free_map_release_reserved (ins.spares[--ins.spare_cnt], 1,
+                                       reserve, keep);
+            kept -= keep;
+          }
+        free (ins.nodes);
+        return false;
+      }
+
+  if (grow)
+    {
+      /* Move the root's entries down into a new node, leaving the
+         root an index node with that one child. */
+      struct extent_node *node = &ins.nodes[0];
+      block_sector_t sector = ins.spares[--ins.spare_cnt];
+
+      memset (node, 0, sizeof *node);
+      node->hdr = root->hdr;
+      memcpy (node->entries, root->entries,
+              root->hdr.cnt * sizeof *root->entries);
+      node_write (sector, node);
+
+      root->hdr.depth++;
+      root->hdr.cnt = 1;
+      root->entries[0].logical = node->entries[0].logical;
+      root->entries[0].start = sector;
+      root->entries[0].length = 0;
+    }
+
+  insert (&ins, 0, &root->hdr, root->entries, root_cnt, &ext,
+          &split, &did_split);
+  ASSERT (!did_split);
+  ASSERT (ins.spare_cnt == 0);
+  free (ins.nodes);
+  return true;
+}
+
+/* Frees the sectors mapped by entry E of a node at height DEPTH,
+   along with the tree nodes below it. */
+static void
+release_entry (const struct extent *e, unsigned depth)
+{
+  size_t i;
+
+  if (depth == 0)
+    {
+      free_map_release (e->start, e->length);
+      return;
+    }
+
+  for (i = 0; ; i++)
+    {
+      const struct extent_node *node
+        = buffer_cache_get (e->start, BUFFER_CACHE_READ, BUFFER_CACHE_META);
+      bool more = i < node->hdr.cnt;
+      struct extent child;
+      if (more)
+        child = node->entries[i];
+      buffer_cache_release (e->start, false);
+      if (!more)
+        break;
+      release_entry (&child, depth - 1);
+    }
+  free_map_release (e->start, 1);
+}
+
+/* Frees every sector mapped by ROOT and every node of its tree,
+   leaving ROOT empty. */
+void
+extent_release (struct extent_root *root)
+{
+  size_t i;
+
+  for (i = 0; i < root->hdr.cnt; i++)
+    release_entry (&root->entries[i], root->hdr.depth);
+  extent_init (root);
+}
+
+/* Unmaps blocks BLOCK and beyond from the node with header HDR and
+   entries E, freeing their sectors and any nodes below that are
+   left empty.  The caller writes the node back.  Returns false if
+   memory runs out partway, leaving some blocks mapped. */
+static bool
+truncate_entries (struct extent_header *hdr, struct extent *e,
+                  uint32_t block)
+{
+  while (hdr->cnt > 0)
+    {
+      struct extent *last = &e[hdr->cnt - 1];
+      struct extent_node *node;
+      bool success;
+
+      if (last->logical >= block)
+        {
+          release_entry (last, hdr->depth);
+          hdr->cnt--;
+          continue;
+        }
+
+      if (hdr->depth == 0)
+        {
+          /* Blocks before LAST are all below BLOCK. */
+          if (last->logical + last->length > block)
+            {
+              uint32_t keep = block - last->logical;
+              free_map_release (last->start + keep, last->length - keep);
+              last->length = keep;
+            }
+          return true;
+        }
+
+      /* Only the last child that starts below BLOCK can map blocks
+         on both sides of it. */
+      node = malloc (sizeof *node);
+      if (node == NULL)
+        return false;
+      node_read (last->start, node);
+      success = truncate_entries (&node->hdr, node->entries, block);
+      if (node->hdr.cnt == 0)
+        {
+          free_map_release (last->start, 1);
+          hdr->cnt--;
+        }
+      else
+        node_write (last->start, node);
+      free (node);
+      return success;
+    }
+  return true;
+}
+
+/* Unmaps blocks BLOCK and beyond from ROOT, freeing their sectors.
+   Returns false if memory runs out partway, in which case some of
+   those blocks stay mapped. */
+bool
+extent_truncate (struct extent_root *root, uint32_t block)
+{
+  bool success = truncate_entries (&root->hdr, root->entries, block);
+  if (root->hdr.cnt == 0)
+    extent_init (root);
+  return success;
+}
@@ -0,0 +1,48 @@
+#ifndef FILESYS_EXTENT_H
+#define FILESYS_EXTENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "devices/block.h"
+
+/* In a leaf of an extent tree, a run of LENGTH consecutive sectors
+   starting at START that holds a file's blocks LOGICAL through
+   LOGICAL + LENGTH - 1.  In an index node, START is instead the
+   sector of a child node that maps blocks from LOGICAL up to the
+   next entry's LOGICAL, and LENGTH is 0. */
+struct extent
+  {
+    uint32_t logical;           /* First block of the file mapped. */
+    block_sector_t start;       /* First sector, or child node. */
+    uint32_t length;            /* Number of sectors. */
+  };
+
+/* Header of a node of an extent tree. */
+struct extent_header
+  {
+    uint16_t cnt;               /* Number of entries in use. */
+    uint16_t depth;             /* 0: entries are extents, else index. */
+  };
+
+/* Most entries in the root of an extent tree, which is kept in the
+   on-disk inode.  Inodes with less room use fewer. */
+#define EXTENT_ROOT_CNT 36
+
+/* Root of an extent tree. */
+struct extent_root
+  {
+    struct extent_header hdr;
+    struct extent entries[EXTENT_ROOT_CNT];
+  };
+
+void extent_init (struct extent_root *);
+block_sector_t extent_lookup (const struct extent_root *, uint32_t block,
+                              uint32_t *run);
+uint32_t extent_end (const struct extent_root *);
+bool extent_add (struct extent_root *, size_t root_cnt, uint32_t block,
+                 block_sector_t start, uint32_t length, size_t *reserve);
+void extent_release (struct extent_root *);
+bool extent_truncate (struct extent_root *, uint32_t block);
+
+#endif /* filesys/extent.h */
@@ -3,12 +3,22 @@
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 
+/* Read-ahead window bounds, in sectors.  The window starts at
+   READ_AHEAD_MIN on the second sequential read, doubles on each
+   further one up to READ_AHEAD_MAX, and drops to zero on a
+   seek. */
+#define READ_AHEAD_MIN 4
+#define READ_AHEAD_MAX 32
+
 /* An open file. */
 struct file 
   {
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    off_t ra_next;              /* Where the next sequential read starts. */
+    off_t ra_end;               /* End of the range already read ahead. */
+    off_t ra_window;            /* Read-ahead window in sectors. */
   };
 
 /* Opens a file for the given INODE, of which it takes ownership,
@@ -23,6 +33,9 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->ra_next = 0;
+      file->ra_end = 0;
+      file->ra_window = 0;
       return file;
     }
   else
@@ -60,6 +73,38 @@ file_get_inode (struct file *file)
   return file->inode;
 }
 
+/* Updates FILE's read-ahead state after a read of SIZE bytes at
+   OFS and asks the inode layer to prefetch the window that follows
+   a sequential read. */
+static void
+file_read_ahead (struct file *file, off_t ofs, off_t size)
+{
+  off_t end = ofs + size;
+  off_t ra_limit;
+
+  if (size == 0)
+    return;
+  if (ofs != file->ra_next)
+    {
+      file->ra_window = 0;
+      file->ra_end = 0;
+    }
+  else if (file->ra_window == 0)
+    file->ra_window = READ_AHEAD_MIN;
+  else if (file->ra_window < READ_AHEAD_MAX)
+    file->ra_window *= 2;
+  file->ra_next = end;
+
+  ra_limit = end + file->ra_window * BLOCK_SECTOR_SIZE;
+  if (file->ra_end < end)
+    file->ra_end = end;
+  if (file->ra_end < ra_limit)
+    {
+      inode_read_ahead (file->inode, file->ra_end, ra_limit - file->ra_end);
+      file->ra_end = ra_limit;
+    }
+}
+
 /* Reads SIZE bytes from FILE into BUFFER,
    starting at the file's current position.
    Returns the number of bytes actually read,
@@ -69,6 +114,7 @@ off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
   off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  file_read_ahead (file, file->pos, bytes_read);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -8,6 +8,8 @@
 #include "filesys/inode.h"
 #include "filesys/directory.h"
 #include "filesys/cache.h"
+#include "filesys/dcache.h"
+#include "filesys/journal.h"
 /* Partition that contains the file system. */
 struct block *fs_device;
 
@@ -23,12 +25,19 @@ filesys_init (bool format)
     PANIC ("No file system device found, can't initialize file system.");
 
   inode_init ();
+  dcache_init ();
   free_map_init ();
 buffer_cache_init ();
+  journal_init ();
   if (format) 
     do_format ();
 
+  /* Metadata committed to the journal before an unclean shutdown
+     goes home before the free map is read. */
+  journal_replay ();
   free_map_open ();
+  journal_open ();
+  inode_recover ();
 }
 
 /* Shuts down the file system module, writing any unwritten data
@@ -36,8 +45,12 @@ buffer_cache_init ();
 void
 filesys_done (void) 
 {
+  inode_flush_delayed ();
+  inode_reclaim ();
+  journal_close ();
   free_map_close ();
   buffer_cache_close ();
+  dcache_done ();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
@@ -54,19 +67,30 @@ filesys_create (const char *name, off_t initial_size)
 
   base = (char *)calloc (1, strlen (name) + 1);
 
+  journal_begin ();
   is_dir = false;
   success = dir_parse (name, base, target);
   if (success)
     dir = dir_open_dir (base);
   free (base);
 
+  /* The new inode goes into the inode table near the directory,
+     next to the inodes of other files there. */
   success = (dir != NULL
-             && free_map_allocate (1, &inode_sector)
-             && inode_create (inode_sector, initial_size, is_dir)
+             && inode_create_near (inode_get_inumber (dir_get_inode (dir)),
+                                   initial_size, is_dir, &inode_sector)
              && dir_add (dir, target, inode_sector));
-  if (!success && inode_sector != 0) 
-    free_map_release (inode_sector, 1);
+  if (!success && inode_sector != 0)
+    {
+      struct inode *inode = inode_open (inode_sector);
+      if (inode != NULL)
+        {
+          inode_remove (inode);
+          inode_close (inode);
+        }
+    }
   dir_close (dir);
+  journal_end ();
 
   return success;
 }
@@ -122,8 +146,10 @@ filesys_remove (const char *name)
     dir = dir_open_dir (base);
   free (base);
 
+  journal_begin ();
   success = dir != NULL && dir_remove (dir, target);
   dir_close (dir); 
+  journal_end ();
 
   return success;
 }
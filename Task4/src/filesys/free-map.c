@@ -1,12 +1,227 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Bits of the free map held by each sector of the free map file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* Sectors in a block group.  The free sectors of each group are
+   counted, so that searches can pass over full groups without
+   looking at their bits. */
+#define GROUP_SECTORS 512
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *dirty_map;     /* Free map file sectors to write. */
+static size_t *group_free;           /* Free sectors in each group. */
+static size_t group_cnt;             /* Number of groups. */
+static size_t free_cnt;              /* Free sectors in all groups. */
+static size_t reserved_cnt;          /* Free sectors set aside. */
+static size_t next_fit;              /* Where searches without a hint
+                                        start. */
+static struct lock free_map_lock;    /* Protects all of the above. */
+
+/* Notes that the file sectors holding bits START through
+   START + CNT - 1 of the free map have to be written. */
+static void
+mark_dirty (size_t start, size_t cnt)
+{
+  size_t first = start / BITS_PER_SECTOR;
+  size_t last = (start + cnt - 1) / BITS_PER_SECTOR;
+  bitmap_set_multiple (dirty_map, first, last - first + 1, true);
+}
+
+/* Returns the sector just past the end of block group GROUP. */
+static size_t
+group_end (size_t group)
+{
+  size_t end = (group + 1) * GROUP_SECTORS;
+  return end < bitmap_size (free_map) ? end : bitmap_size (free_map);
+}
+
+/* Counts the free sectors of every block group from the bitmap. */
+static void
+count_groups (void)
+{
+  size_t group;
+
+  free_cnt = 0;
+  for (group = 0; group < group_cnt; group++)
+    {
+      group_free[group] = bitmap_count (free_map, group * GROUP_SECTORS,
+                                        group_end (group)
+                                        - group * GROUP_SECTORS, false);
+      free_cnt += group_free[group];
+    }
+}
+
+/* Returns the number of free sectors that have not been set aside
+   by free_map_reserve(), which are all that an allocation may
+   take. */
+static size_t
+available (void)
+{
+  return free_cnt > reserved_cnt ? free_cnt - reserved_cnt : 0;
+}
+
+/* Returns the number of free sectors an allocation may take if it
+   may also draw on *RESERVE, sectors its caller set aside with
+   free_map_reserve(), or on none if RESERVE is null. */
+static size_t
+available_to (const size_t *reserve)
+{
+  return available () + (reserve != NULL ? *reserve : 0);
+}
+
+/* Updates the free counts of the groups that sectors START through
+   START + CNT - 1 belong to, which have just been allocated if
+   ALLOCATED is true or freed otherwise. */
+static void
+count_change (size_t start, size_t cnt, bool allocated)
+{
+  while (cnt > 0)
+    {
+      size_t group = start / GROUP_SECTORS;
+      size_t n = group_end (group) - start;
+      if (n > cnt)
+        n = cnt;
+      if (allocated)
+        {
+          ASSERT (group_free[group] >= n);
+          group_free[group] -= n;
+          free_cnt -= n;
+        }
+      else
+        {
+          group_free[group] += n;
+          free_cnt += n;
+        }
+      start += n;
+      cnt -= n;
+    }
+}
+
+/* Returns the first sector at or after FROM, and in the same block
+   group, that starts a run of CNT free sectors, or the first free
+   sector there if SHORT_OK is true.  The run itself may reach into
+   the next groups.  Returns BITMAP_ERROR if there is no such
+   sector. */
+static size_t
+scan_group (size_t from, size_t cnt, bool short_ok)
+{
+  size_t end = group_end (from / GROUP_SECTORS);
+  size_t size = bitmap_size (free_map);
+
+  while (from < end)
+    {
+      size_t n;
+
+      if (bitmap_test (free_map, from))
+        {
+          from++;
+          continue;
+        }
+      if (short_ok)
+        return from;
+      for (n = 1; n < cnt && from + n < size; n++)
+        if (bitmap_test (free_map, from + n))
+          break;
+      if (n == cnt)
+        return from;
+      from += n + 1;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Returns the first of the free sectors that end block group
+   GROUP, not looking before FROM, or BITMAP_ERROR if the group's
+   last sector is in use. */
+static size_t
+group_tail (size_t group, size_t from)
+{
+  size_t end = group_end (group);
+  size_t start = end;
+
+  while (start > from && !bitmap_test (free_map, start - 1))
+    start--;
+  return start < end ? start : BITMAP_ERROR;
+}
+
+/* Returns true if the CNT sectors starting at START are free. */
+static bool
+run_free (size_t start, size_t cnt)
+{
+  size_t size = bitmap_size (free_map);
+  size_t n;
+
+  for (n = 0; n < cnt && start + n < size; n++)
+    if (bitmap_test (free_map, start + n))
+      return false;
+  return n == cnt;
+}
+
+/* Returns the first sector of a run of CNT free sectors, or of any
+   free sector if SHORT_OK is true, looking first from GOAL to the
+   end of its block group and then in the following groups, wrapping
+   around to the start of GOAL's group.  Full groups are skipped.
+   In a group with fewer free sectors than the run needs, up to a
+   whole group, the run can only start in the free sectors at the
+   group's end and reach into the next, so only they are tried.
+   Returns BITMAP_ERROR if nothing is found. */
+static size_t
+find (size_t goal, size_t cnt, bool short_ok)
+{
+  size_t need = short_ok ? 1 : cnt < GROUP_SECTORS ? cnt : GROUP_SECTORS;
+  size_t first = goal / GROUP_SECTORS;
+  size_t i;
+
+  for (i = 0; i <= group_cnt; i++)
+    {
+      size_t group = (first + i) % group_cnt;
+      size_t from = i == 0 ? goal : group * GROUP_SECTORS;
+      size_t sector;
+
+      if (group_free[group] == 0)
+        continue;
+      if (group_free[group] < need)
+        {
+          sector = group_tail (group, from);
+          if (sector != BITMAP_ERROR && run_free (sector, cnt))
+            return sector;
+          continue;
+        }
+      sector = scan_group (from, cnt, short_ok);
+      if (sector != BITMAP_ERROR)
+        return sector;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Marks the CNT sectors starting at START allocated and moves the
+   next-fit cursor past them.  As many of them as it can are taken
+   out of *RESERVE, if RESERVE is not null. */
+static void
+take (size_t start, size_t cnt, size_t *reserve)
+{
+  bitmap_set_multiple (free_map, start, cnt, true);
+  mark_dirty (start, cnt);
+  count_change (start, cnt, true);
+  next_fit = start + cnt < bitmap_size (free_map) ? start + cnt : 0;
+  if (reserve != NULL)
+    {
+      size_t n = cnt < *reserve ? cnt : *reserve;
+      ASSERT (reserved_cnt >= n);
+      *reserve -= n;
+      reserved_cnt -= n;
+    }
+}
 
 /* Initializes the free map. */
 void
@@ -15,38 +230,225 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  dirty_map = bitmap_create (DIV_ROUND_UP (bitmap_file_size (free_map),
+                                           BLOCK_SECTOR_SIZE));
+  if (dirty_map == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SECTORS);
+  group_free = malloc (group_cnt * sizeof *group_free);
+  if (group_free == NULL)
+    PANIC ("can't allocate block group counts");
+  lock_init (&free_map_lock);
+  reserved_cnt = 0;
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  count_groups ();
+}
+
+/* Allocates CNT consecutive sectors as close after HINT as
+   possible, or after where the last allocation ended if NEXT is
+   true, drawing on *RESERVE as free_map_allocate_reserved() does,
+   and stores the first into *SECTORP.  Returns true if successful,
+   false if not enough consecutive sectors were available. */
+static bool
+allocate (size_t hint, bool next, size_t cnt, size_t *reserve,
+          block_sector_t *sectorp)
+{
+  size_t sector;
+
+  ASSERT (cnt > 0);
+
+  lock_acquire (&free_map_lock);
+  if (next)
+    hint = next_fit;
+  sector = BITMAP_ERROR;
+  if (cnt <= available_to (reserve))
+    sector = find (hint < bitmap_size (free_map) ? hint : 0, cnt, false);
+  if (sector != BITMAP_ERROR)
+    take (sector, cnt, reserve);
+  lock_release (&free_map_lock);
+
+  if (sector != BITMAP_ERROR)
+    *sectorp = sector;
+  return sector != BITMAP_ERROR;
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+   the first into *SECTORP, searching onward from where the last
+   allocation ended.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  return allocate (0, true, cnt, NULL, sectorp);
+}
+
+/* Allocates CNT consecutive sectors from the free map, as close
+   after HINT as possible, and stores the first into *SECTORP.
+   HINT is typically a sector that the new ones will be used
+   together with, such as the inode of the file they belong to or
+   of the directory that will refer to them.
+   Returns true if successful, false if not enough consecutive
+   sectors were available. */
+bool
+free_map_allocate_near (block_sector_t hint, size_t cnt,
+                        block_sector_t *sectorp)
+{
+  return free_map_allocate_reserved (hint, cnt, NULL, sectorp);
+}
+
+/* Like free_map_allocate_near(), but may also take sectors that
+   the caller set aside with free_map_reserve(), whose number is
+   *RESERVE, and takes the sectors it allocates out of *RESERVE
+   first.  RESERVE may be null. */
+bool
+free_map_allocate_reserved (block_sector_t hint, size_t cnt,
+                            size_t *reserve, block_sector_t *sectorp)
+{
+  return allocate (hint, false, cnt, reserve, sectorp);
+}
+
+/* Allocates a run of up to CNT consecutive sectors from the free
+   map, starting at GOAL if it is free and otherwise as close after
+   it as possible, and stores the first into *SECTORP.  A run of the
+   full CNT sectors is preferred over a shorter one nearer GOAL.
+   Sectors are taken out of *RESERVE, sectors the caller set aside
+   with free_map_reserve(), as in free_map_allocate_reserved(), if
+   RESERVE is not null.  Returns the number of sectors allocated,
+   which is 0 if the disk is full. */
+size_t
+free_map_allocate_run (block_sector_t goal, size_t cnt, size_t *reserve,
+                       block_sector_t *sectorp)
+{
+  size_t size = bitmap_size (free_map);
+  size_t start = goal < size ? goal : 0;
+  size_t n;
+
+  ASSERT (cnt > 0);
+
+  lock_acquire (&free_map_lock);
+  if (cnt > available_to (reserve))
+    cnt = available_to (reserve);
+  if (cnt == 0)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      lock_release (&free_map_lock);
+      return 0;
     }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  if (bitmap_test (free_map, start))
+    {
+      size_t found = find (start, cnt, false);
+      if (found == BITMAP_ERROR)
+        found = find (start, 1, true);
+      if (found == BITMAP_ERROR)
+        {
+          lock_release (&free_map_lock);
+          return 0;
+        }
+      start = found;
+    }
+  for (n = 1; n < cnt && start + n < size; n++)
+    if (bitmap_test (free_map, start + n))
+      break;
+  take (start, n, reserve);
+  lock_release (&free_map_lock);
+
+  *sectorp = start;
+  return n;
+}
+
+/* Sets aside CNT free sectors, so that allocations other than
+   those the caller makes after giving them back with
+   free_map_unreserve() cannot take them.  Returns false if fewer
+   than CNT free sectors are left that are not already set aside. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = cnt <= available ();
+  if (success)
+    reserved_cnt += cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Gives back CNT sectors set aside by free_map_reserve(). */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (reserved_cnt >= cnt);
+  reserved_cnt -= cnt;
+  lock_release (&free_map_lock);
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  free_map_release_reserved (sector, cnt, NULL, 0);
+}
+
+/* Like free_map_release(), but sets KEEP of the sectors aside
+   again at once, adding them to *RESERVE, for a caller giving back
+   sectors it took out of its reservation. */
+void
+free_map_release_reserved (block_sector_t sector, size_t cnt,
+                           size_t *reserve, size_t keep)
+{
+  ASSERT (keep <= cnt && (keep == 0 || reserve != NULL));
+
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  mark_dirty (sector, cnt);
+  count_change (sector, cnt, false);
+  if (keep > 0)
+    {
+      reserved_cnt += keep;
+      *reserve += keep;
+    }
+  lock_release (&free_map_lock);
+}
+
+/* Writes the sectors of the free map file whose bits have changed
+   since they were last written, merging neighbours into one
+   write.  The buffer cache calls this before each write-behind
+   pass, so changes reach the disk no later than the inodes that
+   refer to the sectors they allocate, and a journal commit calls
+   it before copying out the metadata to commit. */
+void
+free_map_flush (void)
+{
+  size_t start = 0;
+
+  /* Writing the file can start a write-behind pass of its own. */
+  if (lock_held_by_current_thread (&free_map_lock))
+    return;
+
+  journal_begin ();
+  lock_acquire (&free_map_lock);
+  while (free_map_file != NULL
+         && (start = bitmap_scan (dirty_map, start, 1, true)) != BITMAP_ERROR)
+    {
+      size_t cnt = 1;
+      while (start + cnt < bitmap_size (dirty_map)
+             && bitmap_test (dirty_map, start + cnt))
+        cnt++;
+      bitmap_set_multiple (dirty_map, start, cnt, false);
+      if (!bitmap_write_part (free_map, free_map_file,
+                              start * BLOCK_SECTOR_SIZE,
+                              cnt * BLOCK_SECTOR_SIZE))
+        {
+          bitmap_set_multiple (dirty_map, start, cnt, true);
+          break;
+        }
+      start += cnt;
+    }
+  lock_release (&free_map_lock);
+  journal_end ();
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,13 +460,29 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  count_groups ();
+}
+
+/* Returns the number of sectors in the free map file, all of which
+   free_map_flush() may write. */
+size_t
+free_map_sectors (void)
+{
+  return bitmap_size (dirty_map);
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
-  file_close (free_map_file);
+  struct file *file;
+
+  free_map_flush ();
+  lock_acquire (&free_map_lock);
+  file = free_map_file;
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
+  file_close (file);
 }
 
 /* Creates a new free map file on disk and writes the free map to
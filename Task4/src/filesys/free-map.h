@@ -10,8 +10,20 @@ void free_map_read (void);
 void free_map_create (void);
 void free_map_open (void);
 void free_map_close (void);
+void free_map_flush (void);
+size_t free_map_sectors (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_near (block_sector_t hint, size_t,
+                             block_sector_t *);
+bool free_map_allocate_reserved (block_sector_t hint, size_t,
+                                 size_t *reserve, block_sector_t *);
+size_t free_map_allocate_run (block_sector_t goal, size_t cnt,
+                              size_t *reserve, block_sector_t *);
 void free_map_release (block_sector_t, size_t);
+void free_map_release_reserved (block_sector_t, size_t, size_t *reserve,
+                                size_t keep);
+bool free_map_reserve (size_t);
+void free_map_unreserve (size_t);
 
 #endif /* filesys/free-map.h */
@@ -1,15 +1,22 @@
 #include "filesys/fsutil.h"
 #include <debug.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ustar.h>
+#include "filesys/cache.h"
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
 #include "threads/malloc.h"
 #include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 #include "threads/vaddr.h"
+#include "devices/timer.h"
 
 /* List files in the root directory. */
 void
@@ -221,3 +228,327 @@ fsutil_append (char **argv)
   file_close (src);
   free (buffer);
 }
+
+/* Times buffer cache lookups for a range of cache sizes. */
+void
+fsutil_cache_bench (char **argv UNUSED)
+{
+  buffer_cache_benchmark ();
+}
+
+/* Shape of the fsutil_cache_mix() workload. */
+#define MIX_SMALL_FILES 16              /* Small files to look up. */
+#define MIX_BIG_SIZE (512 * 1024)       /* Bytes in the scanned file. */
+#define MIX_CHUNK 4096                  /* Bytes read per scan step. */
+#define MIX_OPENS 2                     /* Small files read per step. */
+#define MIX_ROUNDS 4                    /* Passes over the big file. */
+
+/* Returns the percentage, to one decimal place, of HITS out of
+   HITS + MISSES, times 10. */
+static unsigned
+hit_rate (unsigned long long hits, unsigned long long misses)
+{
+  return hits + misses > 0 ? hits * 1000 / (hits + misses) : 0;
+}
+
+/* Runs a mixed workload through the buffer cache and prints its
+   hit rate under the replacement policy selected at boot: a
+   large file is read sequentially while small files in the root
+   directory are opened and read by name in between.  Rerun with
+   a different -cache-policy to compare policies. */
+void
+fsutil_cache_mix (char **argv UNUSED)
+{
+  unsigned long long hits0, misses0, hits1, misses1, hits, misses;
+  unsigned long long small_hits = 0, small_misses = 0;
+  char name[NAME_MAX + 1];
+  struct file *big;
+  char *buffer;
+  int i, j, round;
+  off_t ofs;
+
+  buffer = palloc_get_page (PAL_ASSERT | PAL_ZERO);
+  for (i = 0; i < MIX_SMALL_FILES; i++)
+    {
+      struct file *file;
+
+      snprintf (name, sizeof name, "mix%d", i);
+      if (!filesys_create (name, 0) || (file = filesys_open (name)) == NULL)
+        PANIC ("%s: create failed", name);
+      file_write (file, buffer, 100);
+      file_close (file);
+    }
+  if (!filesys_create ("mixbig", 0) || (big = filesys_open ("mixbig")) == NULL)
+    PANIC ("mixbig: create failed");
+  for (ofs = 0; ofs < MIX_BIG_SIZE; ofs += PGSIZE)
+    file_write (big, buffer, PGSIZE);
+
+  buffer_cache_counts (&hits0, &misses0);
+  i = 0;
+  for (round = 0; round < MIX_ROUNDS; round++)
+    for (ofs = 0; ofs < MIX_BIG_SIZE; ofs += MIX_CHUNK)
+      {
+        struct file *file;
+
+        file_read_at (big, buffer, MIX_CHUNK, ofs);
+
+        buffer_cache_counts (&hits, &misses);
+        for (j = 0; j < MIX_OPENS; j++)
+          {
+            snprintf (name, sizeof name, "mix%d", i++ % MIX_SMALL_FILES);
+            file = filesys_open (name);
+            if (file == NULL)
+              PANIC ("%s: open failed", name);
+            file_read (file, buffer, 100);
+            file_close (file);
+          }
+        buffer_cache_counts (&hits1, &misses1);
+        small_hits += hits1 - hits;
+        small_misses += misses1 - misses;
+      }
+  buffer_cache_counts (&hits1, &misses1);
+  hits = hits1 - hits0;
+  misses = misses1 - misses0;
+
+  printf ("Cache policy %s: %llu hits, %llu misses, hit rate %u.%u%%; "
+          "small file opens: hit rate %u.%u%%\n",
+          buffer_cache_policy_name (), hits, misses,
+          hit_rate (hits, misses) / 10, hit_rate (hits, misses) % 10,
+          hit_rate (small_hits, small_misses) / 10,
+          hit_rate (small_hits, small_misses) % 10);
+
+  file_close (big);
+  filesys_remove ("mixbig");
+  for (i = 0; i < MIX_SMALL_FILES; i++)
+    {
+      snprintf (name, sizeof name, "mix%d", i);
+      filesys_remove (name);
+    }
+  palloc_free_page (buffer);
+}
+
+/* Shape of the fsutil_open_bench() workload. */
+#define OPEN_BENCH_DIRS 8               /* Directories under the root. */
+#define OPEN_BENCH_FILES 256            /* Files in each directory. */
+#define OPEN_BENCH_STEP 512             /* Files held open per step. */
+#define OPEN_BENCH_OPENS 4096           /* Opens timed per step. */
+
+/* Creates directory NAME in the root directory. */
+static void
+open_bench_mkdir (char *name)
+{
+  struct dir *root = dir_open_root ();
+  block_sector_t sector;
+
+  if (root == NULL
+      || !free_map_allocate_near (ROOT_DIR_SECTOR, 1, &sector)
+      || !dir_sub_create (sector, name, root))
+    PANIC ("%s: mkdir failed", name);
+  dir_close (root);
+}
+
+/* Times opening and closing files by path name across a tree of
+   OPEN_BENCH_DIRS * OPEN_BENCH_FILES files, while more and more of
+   them are held open, and prints the ticks taken at each step.
+   With the open inodes kept in a hash table, the time should not
+   grow with the number held open. */
+void
+fsutil_open_bench (char **argv UNUSED)
+{
+  const int total = OPEN_BENCH_DIRS * OPEN_BENCH_FILES;
+  struct file **held;
+  char name[32];
+  int i, held_cnt;
+
+  held = malloc (total * sizeof *held);
+  if (held == NULL)
+    PANIC ("open-bench: out of memory");
+  for (i = 0; i < OPEN_BENCH_DIRS; i++)
+    {
+      snprintf (name, sizeof name, "ob%d", i);
+      open_bench_mkdir (name);
+    }
+  for (i = 0; i < total; i++)
+    {
+      snprintf (name, sizeof name, "/ob%d/f%d",
+                i % OPEN_BENCH_DIRS, i / OPEN_BENCH_DIRS);
+      if (!filesys_create (name, 0))
+        PANIC ("%s: create failed", name);
+    }
+
+  printf ("Open benchmark (%d opens per step, %d files):\n",
+          OPEN_BENCH_OPENS, total);
+  for (held_cnt = 0; ; held_cnt += OPEN_BENCH_STEP)
+    {
+      int64_t start = timer_ticks ();
+      for (i = 0; i < OPEN_BENCH_OPENS; i++)
+        {
+          int n = (i * 7919) % total;
+          struct file *file;
+
+          snprintf (name, sizeof name, "/ob%d/f%d",
+                    n % OPEN_BENCH_DIRS, n / OPEN_BENCH_DIRS);
+          file = filesys_open (name);
+          if (file == NULL)
+            PANIC ("%s: open failed", name);
+          file_close (file);
+        }
+      printf ("%5d files open: %"PRId64" ticks\n",
+              held_cnt, timer_elapsed (start));
+      if (held_cnt == total)
+        break;
+
+      for (i = held_cnt; i < held_cnt + OPEN_BENCH_STEP; i++)
+        {
+          snprintf (name, sizeof name, "/ob%d/f%d",
+                    i % OPEN_BENCH_DIRS, i / OPEN_BENCH_DIRS);
+          held[i] = filesys_open (name);
+          if (held[i] == NULL)
+            PANIC ("%s: open failed", name);
+        }
+    }
+
+  for (i = 0; i < total; i++)
+    {
+      file_close (held[i]);
+      snprintf (name, sizeof name, "/ob%d/f%d",
+                i % OPEN_BENCH_DIRS, i / OPEN_BENCH_DIRS);
+      filesys_remove (name);
+    }
+  for (i = 0; i < OPEN_BENCH_DIRS; i++)
+    {
+      snprintf (name, sizeof name, "ob%d", i);
+      filesys_remove (name);
+    }
+  free (held);
+}
+
+/* Shape of the fsutil_frag_bench() workload. */
+#define FRAG_BENCH_FILES 4              /* Files appended to at once. */
+#define FRAG_BENCH_SIZE (256 * 1024)    /* Bytes in each file. */
+#define FRAG_BENCH_CHUNK 512            /* Bytes per write. */
+#define FRAG_BENCH_WRT_CNT 10           /* Writers of the shared file. */
+
+/* File that, as in the syn-write test, FRAG_BENCH_WRT_CNT writers
+   fill in, each writing one chunk into its own part. */
+static const char frag_bench_shared[] = "fragw";
+
+/* Raised by each writer thread as it finishes. */
+static struct semaphore frag_bench_done;
+
+/* Appends FRAG_BENCH_SIZE bytes to the file named NAME_, one small
+   write at a time, yielding after each so that the writers take
+   turns. */
+static void
+frag_bench_writer (void *name_)
+{
+  const char *name = name_;
+  uint8_t chunk[FRAG_BENCH_CHUNK];
+  struct file *file;
+  int ofs;
+
+  file = filesys_open (name);
+  if (file == NULL)
+    PANIC ("%s: open failed", name);
+  for (ofs = 0; ofs < FRAG_BENCH_SIZE; ofs += FRAG_BENCH_CHUNK)
+    {
+      memset (chunk, ofs / FRAG_BENCH_CHUNK, sizeof chunk);
+      if (file_write (file, chunk, sizeof chunk) != sizeof chunk)
+        PANIC ("%s: write failed", name);
+      thread_yield ();
+    }
+  file_close (file);
+  sema_up (&frag_bench_done);
+}
+
+/* Writes chunk IDX_ of the shared file, like child-syn-wrt: opens
+   the file, writes its one chunk, and closes it again. */
+static void
+frag_bench_shared_writer (void *idx_)
+{
+  int idx = (int) idx_;
+  uint8_t chunk[FRAG_BENCH_CHUNK];
+  struct file *file;
+
+  memset (chunk, idx, sizeof chunk);
+  file = filesys_open (frag_bench_shared);
+  if (file == NULL)
+    PANIC ("%s: open failed", frag_bench_shared);
+  if (file_write_at (file, chunk, sizeof chunk, idx * FRAG_BENCH_CHUNK)
+      != sizeof chunk)
+    PANIC ("%s: write failed", frag_bench_shared);
+  file_close (file);
+  sema_up (&frag_bench_done);
+}
+
+/* Prints how many extents the file named NAME is in, then removes
+   it. */
+static void
+frag_bench_report (const char *name)
+{
+  struct file *file = filesys_open (name);
+  if (file == NULL)
+    PANIC ("%s: open failed", name);
+  printf ("  %s: %zu extents\n", name,
+          inode_extent_cnt (file_get_inode (file)));
+  file_close (file);
+  filesys_remove (name);
+}
+
+/* Runs the fsutil_frag_bench() workload once, with block
+   allocation delayed if DELAYED, and prints the results. */
+static void
+frag_bench_run (bool delayed)
+{
+  char names[FRAG_BENCH_FILES][16];
+  char wrt_name[16];
+  int i;
+
+  inode_set_delayed (delayed);
+  if (!filesys_create (frag_bench_shared,
+                       FRAG_BENCH_WRT_CNT * FRAG_BENCH_CHUNK))
+    PANIC ("%s: create failed", frag_bench_shared);
+  for (i = 0; i < FRAG_BENCH_FILES; i++)
+    {
+      snprintf (names[i], sizeof names[i], "frag%d", i);
+      if (!filesys_create (names[i], 0))
+        PANIC ("%s: create failed", names[i]);
+    }
+  for (i = 0; i < FRAG_BENCH_FILES; i++)
+    thread_create (names[i], PRI_DEFAULT, frag_bench_writer, names[i]);
+  for (i = 0; i < FRAG_BENCH_WRT_CNT; i++)
+    {
+      snprintf (wrt_name, sizeof wrt_name, "fragw%d", i);
+      thread_create (wrt_name, PRI_DEFAULT, frag_bench_shared_writer,
+                     (void *) i);
+      thread_yield ();
+    }
+  for (i = 0; i < FRAG_BENCH_FILES + FRAG_BENCH_WRT_CNT; i++)
+    sema_down (&frag_bench_done);
+  inode_flush_delayed ();
+
+  printf ("With block allocation %s:\n",
+          delayed ? "delayed" : "at write time");
+  for (i = 0; i < FRAG_BENCH_FILES; i++)
+    frag_bench_report (names[i]);
+  frag_bench_report (frag_bench_shared);
+}
+
+/* Writes FRAG_BENCH_FILES files at once from as many threads, while
+   FRAG_BENCH_WRT_CNT more threads fill in a shared file as the
+   syn-write test does, and prints how many extents, that is runs
+   of consecutive sectors, each file ends up in.  The fewer, the
+   less the allocator has let the writers interleave their blocks.
+   Runs the workload first with blocks given sectors as they are
+   written, as before allocation was delayed, then with delaying,
+   to compare. */
+void
+fsutil_frag_bench (char **argv UNUSED)
+{
+  printf ("Fragmentation benchmark (%d files of %d bytes appended and "
+          "%d writers of a %d-byte file, at once):\n",
+          FRAG_BENCH_FILES, FRAG_BENCH_SIZE, FRAG_BENCH_WRT_CNT,
+          FRAG_BENCH_WRT_CNT * FRAG_BENCH_CHUNK);
+  frag_bench_run (false);
+  frag_bench_run (true);
+}
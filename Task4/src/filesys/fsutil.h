@@ -6,5 +6,9 @@ void fsutil_cat (char **argv);
 void fsutil_rm (char **argv);
 void fsutil_extract (char **argv);
 void fsutil_append (char **argv);
+void fsutil_cache_bench (char **argv);
+void fsutil_cache_mix (char **argv);
+void fsutil_open_bench (char **argv);
+void fsutil_frag_bench (char **argv);
 
 #endif /* filesys/fsutil.h */
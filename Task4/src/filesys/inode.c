@@ -1,21 +1,70 @@
 #include "filesys/inode.h"
-#include <list.h>
+#include <bitmap.h>
+#include <hash.h>
 #include <debug.h>
+#include <list.h>
 #include <round.h>
+#include <stdio.h>
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 #include "filesys/cache.h"  
+#include "filesys/extent.h"
+#include "filesys/journal.h"
+#include "devices/timer.h"
 
-/* Identifies an inode. */
+/* Identifies an inode that maps its data through direct and
+   indirect blocks, or through an extent tree. */
 #define INODE_MAGIC 0x494e4f44
+#define INODE_EXTENT_MAGIC 0x494e4f45
+
+/* Identifies an inode that keeps its data in the inode itself. */
+#define INODE_INLINE_MAGIC 0x494e4f46
+
+/* Most bytes of data kept in an inode. */
+#define INODE_INLINE_MAX 444
+
+/* Inode numbers with this bit set name an inode packed with others
+   into a sector of the inode table: the rest of the number is that
+   sector times INODES_PER_SECTOR plus the inode's slot in it.
+   Other inode numbers are the sector that holds a whole inode. */
+#define INODE_PACKED 0x40000000
+
+/* Packed inodes in an inode table sector. */
+#define INODES_PER_SECTOR 4
+
+/* Most bytes of data kept in a packed inode, and most entries in
+   the root of its extent tree. */
+#define INODE_PACKED_INLINE_MAX 116
+#define INODE_PACKED_EXTENTS 9
+
+/* How far past the hint given for a new packed inode an inode table
+   sector with a free slot is used, before a new one is started. */
+#define ITABLE_REACH 512
 #define DIRECT_BLOCKS 12
 #define INDIRECT_SIZE 128
 #define DOUBLY_INDIRECT_SIZE (1 << 14)
 
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.
+
+   New inodes map their data with the extent tree rooted in
+   EXTENTS.  Inodes written before extents existed have
+   INODE_MAGIC and use DIRECT through DOUBLY_INDIRECT instead; the
+   other fields are where they always were, so those inodes can
+   still be read and written.
+
+   Inodes with INODE_INLINE_MAGIC keep up to INODE_INLINE_MAX bytes
+   of data in DATA, where the extent tree would be, and need no
+   data sectors.  They move their data to a block and become
+   extent inodes when they grow past that.
+
+   The free map's inode also records in ORPHANS the sector of the
+   orphan list, and in JOURNAL the first sector of the metadata
+   journal, which no other inode uses. */
 struct inode_disk
   {
     off_t length;                       /* File size in bytes.  */
@@ -24,9 +73,70 @@ struct inode_disk
     block_sector_t doubly_indirect;     /* Doubly indirect blocks. */
     uint32_t is_dir;                    /* 1: directory; 0: file */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[111];               /* Not used. */
+    union
+      {
+        struct
+          {
+            struct extent_root extents; /* Extent tree. */
+            block_sector_t orphans;     /* Free map: orphan list. */
+            block_sector_t journal;     /* Free map: journal. */
+          };
+        uint8_t data[INODE_INLINE_MAX]; /* Inline data. */
+      };
+  };
+
+/* On-disk inode of a regular file, packed INODES_PER_SECTOR to a
+   sector of the inode table.  It has the fields of struct
+   inode_disk that extent and inline inodes use, but room for only
+   the first INODE_PACKED_INLINE_MAX bytes of the union: that much
+   inline data, or an extent root of up to INODE_PACKED_EXTENTS
+   entries.  A slot with MAGIC 0 is free. */
+struct inode_packed
+  {
+    off_t length;                       /* File size in bytes. */
+    uint32_t is_dir;                    /* 1: directory; 0: file */
+    unsigned magic;                     /* Magic number. */
+    uint8_t data[INODE_PACKED_INLINE_MAX]; /* Start of the union. */
   };
 
+/* Returns true if inode number INUMBER names a packed inode. */
+static inline bool
+inumber_is_packed (block_sector_t inumber)
+{
+  return (inumber & INODE_PACKED) != 0;
+}
+
+/* Returns the sector that holds inode INUMBER. */
+static inline block_sector_t
+inumber_sector (block_sector_t inumber)
+{
+  if (!inumber_is_packed (inumber))
+    return inumber;
+  return (inumber & ~INODE_PACKED) / INODES_PER_SECTOR;
+}
+
+/* Returns packed inode INUMBER within TABLE, the contents of the
+   sector that holds it. */
+static inline struct inode_packed *
+inumber_slot (block_sector_t inumber, void *table)
+{
+  return (struct inode_packed *) table + inumber % INODES_PER_SECTOR;
+}
+
+/* Returns true if DISK_INODE maps its data with an extent tree. */
+static inline bool
+inode_has_extents (const struct inode_disk *disk_inode)
+{
+  return disk_inode->magic == INODE_EXTENT_MAGIC;
+}
+
+/* Returns true if DISK_INODE keeps its data inline. */
+static inline bool
+inode_is_inline (const struct inode_disk *disk_inode)
+{
+  return disk_inode->magic == INODE_INLINE_MAGIC;
+}
+
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
 static inline size_t
@@ -35,19 +145,86 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
-/* In-memory inode. */
+/* Blocks BLOCK through BLOCK + LENGTH - 1 of an inode, which lie
+   in consecutive sectors starting at SECTOR, or which are a hole if
+   SECTOR is 0. */
+struct inode_run
+  {
+    uint32_t block;                     /* First block. */
+    block_sector_t sector;              /* Sector holding BLOCK. */
+    uint32_t length;                    /* Number of blocks, 0 if none. */
+  };
+
+/* Number of runs each open inode remembers. */
+#define INODE_RUN_CNT 8
+
+/* In-memory inode.
+
+   OPEN_CNT, REMOVED, ORPHANED, CLOSING and DELAYED_ELEM are
+   protected by open_inodes_lock.  DATA, DENY_WRITE_CNT and the delayed blocks
+   are protected by RWLOCK: reads hold it shared, while writes,
+   which may extend the file or fill its holes, hold it
+   exclusively.  Readers share RUNS, so RUNS_LOCK
+   protects it.  DIR_LOCK serializes changes to the entries of a
+   directory, so that two threads cannot add the same name or
+   remove the same entry. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
-    block_sector_t sector;              /* Sector number of disk location. */
+    struct hash_elem elem;              /* Element in open_inodes. */
+    block_sector_t inumber;             /* Inode number. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
+    bool orphaned;                      /* True if in the orphan list. */
+    bool closing;                       /* Last opener tearing it down? */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     struct inode_disk data;             /* Inode content. */
     bool is_dir;
+    struct rwlock rwlock;               /* Guards DATA, DENY_WRITE_CNT. */
+    struct lock runs_lock;              /* Guards RUNS, RUN_HAND. */
+    struct inode_run runs[INODE_RUN_CNT]; /* Recently mapped blocks. */
+    size_t run_hand;                    /* Entry of RUNS to replace next. */
+    struct lock dir_lock;               /* Serializes directory changes. */
+    struct list delayed;                /* Delayed blocks, by block. */
+    struct hash delayed_index;          /* Delayed blocks, by block. */
+    size_t delayed_cnt;                 /* Number of delayed blocks. */
+    size_t delayed_runs;                /* Runs of consecutive ones. */
+    size_t reserved_cnt;                /* Sectors set aside for them. */
+    struct list_elem delayed_elem;      /* Element in delayed_inodes. */
+    struct list_elem reclaim_elem;      /* Element in reclaim_queue. */
   };
 
+/* Returns the most bytes of data INODE can keep inline. */
+static inline off_t
+inode_inline_max (const struct inode *inode)
+{
+  return (inumber_is_packed (inode->inumber)
+          ? INODE_PACKED_INLINE_MAX : INODE_INLINE_MAX);
+}
+
+/* Returns the most entries the root of INODE's extent tree holds. */
+static inline size_t
+inode_root_cnt (const struct inode *inode)
+{
+  return (inumber_is_packed (inode->inumber)
+          ? INODE_PACKED_EXTENTS : EXTENT_ROOT_CNT);
+}
+
+/* Sectors of block map read to find data sectors, and data sectors
+   read or written, to show how well the runs above work. */
+static unsigned long long map_read_cnt;
+static unsigned long long data_sector_cnt;
+
 static bool inode_release (struct inode *inode);
+static void inode_write_back (struct inode *inode);
+
+/* Returns how the buffer cache should treat INODE's data:
+   directory contents and the free map are metadata. */
+static inline enum buffer_cache_type
+inode_cache_type (const struct inode *inode)
+{
+  return (inode->is_dir || inode->inumber == FREE_MAP_SECTOR
+          ? BUFFER_CACHE_META : BUFFER_CACHE_DATA);
+}
 
 
 static block_sector_t
@@ -55,128 +232,1368 @@ inode_single_indirect (block_sector_t indirect, off_t index)
 {
   ASSERT (0 <= index && index < 128);
 
-  block_sector_t buf[128];
+  block_sector_t *buf = buffer_cache_get (indirect, BUFFER_CACHE_READ,
+                                          BUFFER_CACHE_META);
+  block_sector_t sector = buf[index];
+  buffer_cache_release (indirect, false);
+  return sector;
+}
 
-  buffer_cache_read (indirect, buf);
-  return buf[index];
+/* Stores SECTOR as entry INDEX of the indirect block at
+   INDIRECT. */
+static void
+inode_set_indirect (block_sector_t indirect, off_t index,
+                    block_sector_t sector)
+{
+  ASSERT (0 <= index && index < 128);
+
+  block_sector_t *buf = buffer_cache_get (indirect, BUFFER_CACHE_WRITE,
+                                          BUFFER_CACHE_META);
+  buf[index] = sector;
+  buffer_cache_release (indirect, true);
+}
+
+/* Sets *RUN to the blocks from BLOCK on that follow it on disk,
+   starting at index INDEX of the indirect block at INDIRECT, and
+   returns the number of them.  The indirect block is read once. */
+static uint32_t
+inode_indirect_run (block_sector_t indirect, off_t index,
+                    struct inode_run *run)
+{
+  const block_sector_t *buf;
+
+  ASSERT (0 <= index && index < INDIRECT_SIZE);
+
+  buf = buffer_cache_get (indirect, BUFFER_CACHE_READ, BUFFER_CACHE_META);
+  run->sector = buf[index];
+  run->length = 0;
+  if (run->sector != 0)
+    for (run->length = 1; index + run->length < INDIRECT_SIZE; run->length++)
+      if (buf[index + run->length] != run->sector + run->length)
+        break;
+  buffer_cache_release (indirect, false);
+  map_read_cnt++;
+  return run->length;
 }
 
+/* Looks BLOCK of INODE up in its block map and sets *RUN to the
+   blocks from BLOCK on that follow it on disk, or to the hole that
+   starts at BLOCK if it is not mapped.  Each level of the map is
+   read at most once. */
+static void
+inode_translate (struct inode *inode, uint32_t block, struct inode_run *run)
+{
+  const struct inode_disk *disk_inode = &inode->data;
+
+  run->block = block;
+  if (inode_has_extents (disk_inode))
+    {
+      run->sector = extent_lookup (&disk_inode->extents, block,
+                                   &run->length);
+      map_read_cnt += disk_inode->extents.hdr.depth;
+    }
+  else if (block < DIRECT_BLOCKS)
+    {
+      run->sector = disk_inode->direct[block];
+      run->length = 0;
+      if (run->sector != 0)
+        for (run->length = 1; block + run->length < DIRECT_BLOCKS;
+             run->length++)
+          if (disk_inode->direct[block + run->length]
+              != run->sector + run->length)
+            break;
+    }
+  else if (block < DIRECT_BLOCKS + INDIRECT_SIZE)
+    inode_indirect_run (disk_inode->indirect, block - DIRECT_BLOCKS, run);
+  else
+    {
+      off_t index = block - DIRECT_BLOCKS - INDIRECT_SIZE;
+      block_sector_t indirect
+        = inode_single_indirect (disk_inode->doubly_indirect,
+                                 index / INDIRECT_SIZE);
+      map_read_cnt++;
+      run->length = 0;
+      if (indirect != 0)
+        inode_indirect_run (indirect, index % INDIRECT_SIZE, run);
+    }
+}
+
+/* Sets *RUN to the blocks of INODE from BLOCK on that follow it on
+   disk, or to the hole starting at BLOCK, using the runs INODE
+   remembers if one covers BLOCK and the block map otherwise.
+   Returns the sector holding BLOCK, or -1 if BLOCK is not mapped.
+   Holes are not remembered, since writes fill them.
+   The caller must hold INODE's rwlock. */
 static block_sector_t
-inode_doubly_indirect (block_sector_t doubly_indirect, off_t index)
+inode_map (struct inode *inode, uint32_t block, struct inode_run *run)
 {
-  ASSERT (0 <= index && index < (1 << 14));
+  size_t i;
 
-  block_sector_t buf[128];
+  lock_acquire (&inode->runs_lock);
+  for (i = 0; i < INODE_RUN_CNT; i++)
+    {
+      const struct inode_run *r = &inode->runs[i];
+      if (block - r->block < r->length)
+        {
+          run->block = block;
+          run->sector = r->sector + (block - r->block);
+          run->length = r->length - (block - r->block);
+          lock_release (&inode->runs_lock);
+          return run->sector;
+        }
+    }
+  lock_release (&inode->runs_lock);
 
-  buffer_cache_read (doubly_indirect, buf);
-  return inode_single_indirect (buf[index / 128], index % 128); 
+  inode_translate (inode, block, run);
+  if (run->sector == 0)
+    return -1;
+  lock_acquire (&inode->runs_lock);
+  inode->runs[inode->run_hand] = *run;
+  inode->run_hand = (inode->run_hand + 1) % INODE_RUN_CNT;
+  lock_release (&inode->runs_lock);
+  return run->sector;
 }
 
 /* Returns the block device sector that contains byte offset POS
-   within INODE.
+   within INODE.  RUN is the run the caller last looked at, which
+   is used if it covers POS and replaced otherwise, so that walking
+   through a file looks up each run or hole only once.
    Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   POS, either because POS is past the end of INODE or because it
+   is in a hole. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+inode_next_sector (struct inode *inode, off_t pos, struct inode_run *run)
 {
-  ASSERT (inode != NULL);
-  if (pos < inode->data.length) {
-    off_t index = pos / BLOCK_SECTOR_SIZE;
-    if (index < DIRECT_BLOCKS) {
-      return inode->data.direct[index];
-    }
-    if (index < DIRECT_BLOCKS + INDIRECT_SIZE) {
-      return inode_single_indirect (inode->data.indirect, index - DIRECT_BLOCKS);
+  uint32_t block = pos / BLOCK_SECTOR_SIZE;
+
+  if (pos >= inode->data.length)
+    return -1;
+  if (block - run->block < run->length)
+    return run->sector != 0 ? run->sector + (block - run->block)
+                            : (block_sector_t) -1;
+  return inode_map (inode, block, run);
+}
+
+/* If *SECTORP is 0, allocates a sector to hold TYPE, zeroes it
+   in the cache and stores its number in *SECTORP.  Returns false
+   if the disk is full. */
+static bool
+inode_allocate_sector (block_sector_t *sectorp, enum buffer_cache_type type)
+{
+  if (*sectorp != 0)
+    return true;
+  if (!free_map_allocate (1, sectorp))
+    return false;
+  memset (buffer_cache_get (*sectorp, BUFFER_CACHE_OVERWRITE, type), 0,
+          BLOCK_SECTOR_SIZE);
+  buffer_cache_release (*sectorp, true);
+  return true;
+}
+
+/* Makes sure the first CNT entries of the indirect block at
+   *SECTORP, which is allocated if needed, point to allocated
+   sectors.  The indirect block is read and updated one entry at a
+   time, since the cache lets us hold only one sector at once. */
+static bool
+inode_extend_indirect (block_sector_t *sectorp, size_t cnt)
+{
+  if (!inode_allocate_sector (sectorp, BUFFER_CACHE_META))
+    return false;
+
+  for (size_t i = 0; i < cnt; i++) {
+    block_sector_t sector = inode_single_indirect (*sectorp, i);
+    if (sector == 0) {
+      if (!inode_allocate_sector (&sector, BUFFER_CACHE_DATA))
+        return false;
+      inode_set_indirect (*sectorp, i, sector);
     }
-    return inode_doubly_indirect (inode->data.doubly_indirect,
-                                  index - DIRECT_BLOCKS - INDIRECT_SIZE);
   }
-  else
-    return -1;
+  return true;
 }
 
+/* Makes sure the first SECTORS blocks of block-map DISK_INODE are
+   allocated. */
 static bool
-inode_extend (struct inode_disk *disk_inode, size_t sectors)
+inode_extend_map (struct inode_disk *disk_inode, size_t sectors)
 {
-  static char zeros[BLOCK_SECTOR_SIZE];
-  
   size_t num_sectors = sectors < DIRECT_BLOCKS ? sectors : DIRECT_BLOCKS;
   for (size_t i = 0; i < num_sectors; i++) {
-    if (disk_inode->direct[i] == 0) {
-      free_map_allocate (1, &disk_inode->direct[i]);
-      buffer_cache_write (disk_inode->direct[i], zeros);
-    }
+    if (!inode_allocate_sector (&disk_inode->direct[i], BUFFER_CACHE_DATA))
+      return false;
   }
   sectors -= num_sectors;
   if (!sectors) return true;
 
   num_sectors = sectors < INDIRECT_SIZE ? sectors : INDIRECT_SIZE;
-  if (disk_inode->indirect == 0) {
-    free_map_allocate (1, &disk_inode->indirect);
-    buffer_cache_write (disk_inode->indirect, zeros);
-  }
-
-  block_sector_t indirect_block[128];
-  buffer_cache_read (disk_inode->indirect, indirect_block);
-
-  for (size_t i = 0; i < num_sectors; i++) {
-    if (indirect_block[i] == 0) {
-      free_map_allocate (1, &indirect_block[i]);
-      buffer_cache_write (indirect_block[i], zeros);
-    }
-  }
-  buffer_cache_write (disk_inode->indirect, indirect_block);
+  if (!inode_extend_indirect (&disk_inode->indirect, num_sectors))
+    return false;
   sectors -= num_sectors;
   if (!sectors) return true;
 
   num_sectors = sectors < DOUBLY_INDIRECT_SIZE ? sectors : DOUBLY_INDIRECT_SIZE;
-  if (disk_inode->doubly_indirect == 0) {
-    free_map_allocate (1, &disk_inode->doubly_indirect);
-    buffer_cache_write (disk_inode->doubly_indirect, zeros);
+  if (!inode_allocate_sector (&disk_inode->doubly_indirect,
+                              BUFFER_CACHE_META))
+    return false;
+
+  for (size_t i = 0; i < DIV_ROUND_UP (num_sectors, INDIRECT_SIZE); i++) {
+    size_t rot = num_sectors - i * INDIRECT_SIZE;
+    if (rot > INDIRECT_SIZE)
+      rot = INDIRECT_SIZE;
+    block_sector_t old = inode_single_indirect (disk_inode->doubly_indirect,
+                                                i);
+    block_sector_t indirect = old;
+    bool success = inode_extend_indirect (&indirect, rot);
+    if (indirect != old)
+      inode_set_indirect (disk_inode->doubly_indirect, i, indirect);
+    if (!success) return false;
   }
-  
-  block_sector_t doubly_indirect_block[128];
-  buffer_cache_read (disk_inode->doubly_indirect, doubly_indirect_block);
-  
-  for (size_t i = 0; i < num_sectors / INDIRECT_SIZE + 1; i++) {
-    if (doubly_indirect_block[i] == 0) {
-      free_map_allocate (1, &doubly_indirect_block[i]);
-      buffer_cache_write (doubly_indirect_block[i], zeros);
-    }
-    buffer_cache_read (doubly_indirect_block[i], indirect_block);
-    size_t rot = (i == num_sectors / INDIRECT_SIZE) ? 
-               (num_sectors % INDIRECT_SIZE) : INDIRECT_SIZE;
-    for (size_t j = 0; j < rot; j++) {
-      if (indirect_block[j] == 0) {
-        free_map_allocate (1, &indirect_block[j]);
-        buffer_cache_write (indirect_block[j], zeros);
-      }
-    }
-    buffer_cache_write (doubly_indirect_block[i], indirect_block);
-  }
-  buffer_cache_write (disk_inode->doubly_indirect, doubly_indirect_block);
   sectors -= num_sectors;
   if (!sectors) return true;
 
   return false;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same struct inode. */
-static struct list open_inodes;
+/* Sectors a regular file is given past the block a write needs
+   when the write makes it grow, so that further appends find their
+   blocks already allocated next to the ones before.  The unused
+   part of this window is given back when the file is last
+   closed. */
+#define INODE_PREALLOC_SECTORS 64
+
+/* Allocates sectors for the hole in extent INODE that starts at
+   BLOCK, in runs of consecutive sectors each as close as possible
+   after the block before it (or after the inode itself).  The hole
+   is filled up to block END, or to its own end if that comes
+   first; if it goes on past the end of the file, up to EXTRA more
+   blocks are allocated there.  The new blocks are not zeroed.
+   If RESERVE is not null, the blocks before END, and the extent
+   tree nodes, are taken out of *RESERVE, sectors the caller set
+   aside for them, first; blocks past END never are.
+
+   Returns the number of blocks filled from BLOCK on, which is 0
+   only if the disk is full. */
+static uint32_t
+inode_fill (struct inode *inode, uint32_t block, uint32_t end,
+            uint32_t extra, size_t *reserve)
+{
+  struct extent_root *root = &inode->data.extents;
+  uint32_t hole, want, cur;
+  block_sector_t goal;
+
+  extent_lookup (root, block, &hole);
+  ASSERT (hole > 0);
+  want = end - block < hole ? end - block : hole;
+  if (end >= bytes_to_sectors (inode->data.length))
+    want += hole - want < extra ? hole - want : extra;
+
+  goal = block > 0 ? extent_lookup (root, block - 1, NULL) : 0;
+  goal = goal != 0 ? goal + 1 : inumber_sector (inode->inumber) + 1;
+  for (cur = block; cur < block + want; ) {
+    bool reserved = reserve != NULL && cur < end;
+    uint32_t stop = reserved && end < block + want ? end : block + want;
+    size_t before = reserved ? *reserve : 0;
+    block_sector_t start;
+    size_t cnt = free_map_allocate_run (goal, stop - cur,
+                                        reserved ? reserve : NULL, &start);
+    if (cnt == 0)
+      break;
+    if (!extent_add (root, inode_root_cnt (inode), cur, start, cnt,
+                     reserve)) {
+      free_map_release_reserved (start, cnt, reserve,
+                                 reserved ? before - *reserve : 0);
+      break;
+    }
+    cur += cnt;
+    goal = start + cnt;
+  }
+  return cur - block;
+}
+
+/* Moves the inline data of INODE to a new block and makes INODE
+   an extent inode, so that it can grow past what it can keep
+   inline.  Returns false, leaving INODE as it was, if the disk is
+   full or memory runs out. */
+static bool
+inode_uninline (struct inode *inode)
+{
+  struct inode_disk *disk_inode = &inode->data;
+  off_t length = disk_inode->length;
+  uint8_t *data = NULL;
+
+  if (length > 0)
+    {
+      data = malloc (length);
+      if (data == NULL)
+        return false;
+      memcpy (data, disk_inode->data, length);
+    }
+
+  disk_inode->magic = INODE_EXTENT_MAGIC;
+  extent_init (&disk_inode->extents);
+  if (length > 0)
+    {
+      block_sector_t sector;
+      uint8_t *cached;
+
+      if (inode_fill (inode, 0, 1, 0, NULL) == 0)
+        {
+          disk_inode->magic = INODE_INLINE_MAGIC;
+          memset (disk_inode->data, 0, sizeof disk_inode->data);
+          memcpy (disk_inode->data, data, length);
+          free (data);
+          return false;
+        }
+      sector = extent_lookup (&disk_inode->extents, 0, NULL);
+      cached = buffer_cache_get (sector, BUFFER_CACHE_OVERWRITE,
+                                 inode_cache_type (inode));
+      memset (cached, 0, BLOCK_SECTOR_SIZE);
+      memcpy (cached, data, length);
+      buffer_cache_release (sector, true);
+      free (data);
+    }
+  return true;
+}
+
+/* Zeroes the blocks of extent DISK_INODE from FIRST up to LAST
+   that are mapped, in the cache as TYPE, except for those wholly
+   within the SKIP_SIZE bytes starting at byte SKIP_OFS, which the
+   caller is about to overwrite.  Blocks past the end of a file are
+   mapped only if they were preallocated, so this is how they are
+   cleared as the file grows over them. */
+static void
+inode_zero_blocks (const struct inode_disk *disk_inode, size_t first,
+                   size_t last, off_t skip_ofs, off_t skip_size,
+                   enum buffer_cache_type type)
+{
+  size_t end = extent_end (&disk_inode->extents);
+
+  for (size_t block = first; block < last && block < end; block++) {
+    off_t pos = (off_t) block * BLOCK_SECTOR_SIZE;
+    block_sector_t sector;
+
+    if (pos >= skip_ofs && pos + BLOCK_SECTOR_SIZE <= skip_ofs + skip_size)
+      continue;
+    sector = extent_lookup (&disk_inode->extents, block, NULL);
+    if (sector == 0)
+      continue;
+    memset (buffer_cache_get (sector, BUFFER_CACHE_OVERWRITE, type), 0,
+            BLOCK_SECTOR_SIZE);
+    buffer_cache_release (sector, true);
+  }
+}
+
+/* Open inodes, keyed by inode number, so that opening a single inode
+   twice returns the same struct inode. */
+static struct hash open_inodes;
+
+/* Protects open_inodes and the open counts of the inodes in it.
+   An inode stays in open_inodes while its last opener tears it
+   down without the lock, and inode_closed is signaled when it
+   leaves, so that a thread opening it again waits and reads it
+   back as it is left. */
+static struct lock open_inodes_lock;
+static struct condition inode_closed;
+
+/* Inodes with delayed blocks, and the number of delayed blocks
+   they have between them.  Protected by open_inodes_lock. */
+static struct list delayed_inodes;
+static size_t delayed_total;
+
+/* The data of a removed inode is freed by the reclaim thread, a
+   batch of inodes at a time, instead of by whoever closes the
+   inode last, who for a large file would wait a long time.  Until
+   then the inode number stays in use, and is kept in the orphan
+   list, a sector that the free map's inode points to, so that the
+   data is still freed at the next mount if the system goes down
+   first.  The list is a chain of sectors, each naming the next,
+   and grows by a sector whenever those it has are full.  A removal
+   is added to the list on disk before its directory entry is
+   erased.  A batch is dropped from the list on disk before any of
+   its sectors are freed, so that they cannot be given to another
+   file while the list names an inode that maps them.  A crash in
+   between only leaks them.
+
+   The list is metadata like the rest, so while the journal is on,
+   buffer_cache_write_through() leaves it to the journal, and the
+   ordering comes from commits instead: a removal's list entry is
+   committed with its directory change, in the same operation, and
+   a batch's removal from the list with the free map changes that
+   free its sectors, so each pair reaches the disk together or not
+   at all.  Without a journal, the list is written through.
+
+   A removed inode that cannot be added to the list, because the
+   disk has none or is too full to extend it, is freed by its last
+   closer instead of the reclaim thread, to keep the time in which
+   a crash leaks it short. */
+#define ORPHAN_MAGIC 0x4f525032
+
+/* Inode numbers in one sector of the orphan list. */
+#define ORPHAN_CNT 125
+
+/* Sector of the on-disk orphan list.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct orphan_list
+  {
+    unsigned magic;                     /* Magic number. */
+    uint32_t cnt;                       /* Inode numbers in use. */
+    block_sector_t next;                /* Next sector, or 0. */
+    block_sector_t inumbers[ORPHAN_CNT]; /* Removed inodes. */
+  };
+
+/* Sectors of the orphan list, in order, ORPHAN_SECTOR_CNT of
+   them, none if the disk has no list.  The first is recorded in
+   the free map's inode.  Protected by orphan_lock. */
+static block_sector_t *orphan_sectors;
+static size_t orphan_sector_cnt;
+static struct lock orphan_lock;
+
+/* Most removed inodes freed in one batch. */
+#define RECLAIM_BATCH 16
+
+/* Removed inodes closed by their last opener, waiting for the
+   reclaim thread, which reclaim_ready wakes.  Protected by
+   reclaim_lock.  reclaim_run_lock is held while a batch is freed,
+   so that the thread and inode_reclaim() take turns. */
+static struct list reclaim_queue;
+static struct lock reclaim_lock;
+static struct condition reclaim_ready;
+static struct lock reclaim_run_lock;
+static bool reclaim_started;
+
+static thread_func inode_reclaim_daemon NO_RETURN;
+static thread_func inode_place_daemon NO_RETURN;
+
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct inode, elem)->inumber);
+}
+
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return hash_entry (a, struct inode, elem)->inumber
+         < hash_entry (b, struct inode, elem)->inumber;
+}
+
+/* Sectors of the inode table known to have a free slot, so that
+   new packed inodes fill them before new table sectors are taken
+   from the free map.  A sector is added when a slot in it is
+   freed, or when an inode in it is opened and a free slot is seen,
+   and removed when it fills up or is freed, so that only table
+   sectors are ever in it.  Protected by itable_lock, which also
+   serializes changes to which slots are in use. */
+static struct bitmap *itable_free;
+static struct lock itable_lock;
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("can't allocate open inode table");
+  lock_init (&open_inodes_lock);
+  cond_init (&inode_closed);
+
+  /* What was known of another disk's inode table is no use. */
+  bitmap_destroy (itable_free);
+  itable_free = bitmap_create (block_size (fs_device));
+  if (itable_free == NULL)
+    PANIC ("can't allocate inode table map");
+  lock_init (&itable_lock);
+  list_init (&delayed_inodes);
+  delayed_total = 0;
+  lock_init (&orphan_lock);
+  free (orphan_sectors);
+  orphan_sectors = NULL;
+  orphan_sector_cnt = 0;
+
+  if (!reclaim_started)
+    {
+      list_init (&reclaim_queue);
+      lock_init (&reclaim_lock);
+      cond_init (&reclaim_ready);
+      lock_init (&reclaim_run_lock);
+      thread_create ("reclaim", PRI_DEFAULT, inode_reclaim_daemon, NULL);
+      if (buffer_cache_flush_interval () > 0)
+        thread_create ("place", PRI_DEFAULT, inode_place_daemon, NULL);
+      reclaim_started = true;
+    }
+}
+
+/* Returns the first free slot of inode table TABLE, or
+   INODES_PER_SECTOR if all are in use. */
+static size_t
+itable_free_slot (const struct inode_packed *table)
+{
+  size_t slot;
+
+  for (slot = 0; slot < INODES_PER_SECTOR; slot++)
+    if (table[slot].magic == 0)
+      break;
+  return slot;
+}
+
+/* Packs DISK_INODE, which must be an extent or inline inode that
+   fits, into P. */
+static void
+inode_pack (struct inode_packed *p, const struct inode_disk *disk_inode)
+{
+  ASSERT (!inode_has_extents (disk_inode)
+          || disk_inode->extents.hdr.cnt <= INODE_PACKED_EXTENTS);
+  ASSERT (inode_has_extents (disk_inode) || inode_is_inline (disk_inode));
+
+  p->length = disk_inode->length;
+  p->is_dir = disk_inode->is_dir;
+  p->magic = disk_inode->magic;
+  memcpy (p->data, disk_inode->data, sizeof p->data);
+}
+
+/* Unpacks P into DISK_INODE. */
+static void
+inode_unpack (struct inode_disk *disk_inode, const struct inode_packed *p)
+{
+  memset (disk_inode, 0, sizeof *disk_inode);
+  disk_inode->length = p->length;
+  disk_inode->is_dir = p->is_dir;
+  disk_inode->magic = p->magic;
+  memcpy (disk_inode->data, p->data, sizeof p->data);
+}
+
+/* Sets up DISK_INODE, which must be zeroed, as a new inode with
+   LENGTH bytes of data that read as zeros: inline if that is no
+   more than INLINE_MAX bytes, and otherwise as a hole. */
+static void
+inode_format (struct inode_disk *disk_inode, off_t length, bool is_dir,
+              off_t inline_max)
+{
+  if (length <= inline_max)
+    disk_inode->magic = INODE_INLINE_MAGIC;
+  else
+    {
+      disk_inode->magic = INODE_EXTENT_MAGIC;
+      extent_init (&disk_inode->extents);
+    }
+  disk_inode->length = length;
+  disk_inode->is_dir = is_dir ? 1 : 0;
+}
+
+/* Frees inode number INUMBER, whose data has been released. */
+static void
+inode_free_inumber (block_sector_t inumber)
+{
+  block_sector_t sector = inumber_sector (inumber);
+  struct inode_packed *table;
+  bool empty;
+
+  if (!inumber_is_packed (inumber))
+    {
+      free_map_release (sector, 1);
+      return;
+    }
+
+  lock_acquire (&itable_lock);
+  table = buffer_cache_get (sector, BUFFER_CACHE_WRITE, BUFFER_CACHE_META);
+  memset (inumber_slot (inumber, table), 0, sizeof *table);
+  empty = true;
+  for (size_t slot = 0; slot < INODES_PER_SECTOR; slot++)
+    empty = empty && table[slot].magic == 0;
+  buffer_cache_release (sector, true);
+  if (empty)
+    {
+      bitmap_reset (itable_free, sector);
+      free_map_release (sector, 1);
+    }
+  else
+    bitmap_mark (itable_free, sector);
+  lock_release (&itable_lock);
+}
+
+/* Writes a new orphan list sector at SECTOR holding only INUMBER,
+   or none if INUMBER is 0, and returns it on disk. */
+static void
+orphan_write_new (block_sector_t sector, block_sector_t inumber)
+{
+  struct orphan_list *list;
+
+  list = buffer_cache_get (sector, BUFFER_CACHE_OVERWRITE,
+                           BUFFER_CACHE_META);
+  memset (list, 0, BLOCK_SECTOR_SIZE);
+  list->magic = ORPHAN_MAGIC;
+  if (inumber != 0)
+    list->inumbers[list->cnt++] = inumber;
+  buffer_cache_release (sector, true);
+  buffer_cache_write_through (sector);
+}
+
+/* Adds INUMBER to the orphan list, and writes it to disk before
+   returning, extending the list by a sector if it is full.
+   Returns false if the disk has no orphan list, or it is full and
+   there is no free sector to extend it. */
+static bool
+orphan_add (block_sector_t inumber)
+{
+  struct orphan_list *list;
+  block_sector_t *sectors, sector, last;
+  bool success = false;
+  size_t i;
+
+  lock_acquire (&orphan_lock);
+  for (i = 0; i < orphan_sector_cnt && !success; i++)
+    {
+      sector = orphan_sectors[i];
+      list = buffer_cache_get (sector, BUFFER_CACHE_WRITE,
+                               BUFFER_CACHE_META);
+      success = list->cnt < ORPHAN_CNT;
+      if (success)
+        list->inumbers[list->cnt++] = inumber;
+      buffer_cache_release (sector, success);
+      if (success)
+        buffer_cache_write_through (sector);
+    }
+  if (!success && orphan_sector_cnt > 0)
+    {
+      /* The new sector, and the free map marking it in use, must
+         be on disk before the list points to it. */
+      last = orphan_sectors[orphan_sector_cnt - 1];
+      sectors = realloc (orphan_sectors,
+                         (orphan_sector_cnt + 1) * sizeof *sectors);
+      if (sectors != NULL)
+        orphan_sectors = sectors;
+      if (sectors != NULL && free_map_allocate_near (last, 1, &sector))
+        {
+          orphan_write_new (sector, inumber);
+          free_map_flush ();
+          buffer_cache_sync ();
+          list = buffer_cache_get (last, BUFFER_CACHE_WRITE,
+                                   BUFFER_CACHE_META);
+          list->next = sector;
+          buffer_cache_release (last, true);
+          buffer_cache_write_through (last);
+          orphan_sectors[orphan_sector_cnt++] = sector;
+          success = true;
+        }
+    }
+  lock_release (&orphan_lock);
+  return success;
+}
+
+/* Removes the CNT inode numbers in INUMBERS from the orphan list.
+   Without a journal, writes the list to disk before returning;
+   with one, it is committed with the caller's operation.  Sectors
+   left empty stay in the list, for later removals. */
+static void
+orphan_forget (const block_sector_t *inumbers, size_t cnt)
+{
+  struct orphan_list *list;
+  size_t i, j, k;
+
+  if (cnt == 0)
+    return;
+  ASSERT (orphan_sector_cnt > 0);
+
+  lock_acquire (&orphan_lock);
+  for (k = 0; k < orphan_sector_cnt; k++)
+    {
+      block_sector_t sector = orphan_sectors[k];
+      bool changed = false;
+
+      list = buffer_cache_get (sector, BUFFER_CACHE_WRITE,
+                               BUFFER_CACHE_META);
+      for (i = 0; i < cnt; i++)
+        for (j = 0; j < list->cnt; j++)
+          if (list->inumbers[j] == inumbers[i])
+            {
+              list->inumbers[j] = list->inumbers[--list->cnt];
+              changed = true;
+              break;
+            }
+      buffer_cache_release (sector, changed);
+      if (changed)
+        buffer_cache_write_through (sector);
+    }
+  lock_release (&orphan_lock);
+}
+
+/* Queues INODE, which has been removed and closed by its last
+   opener, for the reclaim thread. */
+static void
+reclaim_push (struct inode *inode)
+{
+  lock_acquire (&reclaim_lock);
+  list_push_back (&reclaim_queue, &inode->reclaim_elem);
+  cond_signal (&reclaim_ready, &reclaim_lock);
+  lock_release (&reclaim_lock);
+}
+
+/* Frees the data and inode numbers of up to RECLAIM_BATCH queued
+   inodes, and returns false if there were none.  The caller must
+   hold reclaim_run_lock. */
+static bool
+reclaim_batch (void)
+{
+  struct inode *batch[RECLAIM_BATCH];
+  block_sector_t orphans[RECLAIM_BATCH];
+  size_t cnt = 0, orphan_cnt = 0, i;
+
+  ASSERT (lock_held_by_current_thread (&reclaim_run_lock));
+
+  lock_acquire (&reclaim_lock);
+  while (cnt < RECLAIM_BATCH && !list_empty (&reclaim_queue))
+    batch[cnt++] = list_entry (list_pop_front (&reclaim_queue),
+                               struct inode, reclaim_elem);
+  lock_release (&reclaim_lock);
+  if (cnt == 0)
+    return false;
+
+  journal_begin ();
+  for (i = 0; i < cnt; i++)
+    if (batch[i]->orphaned)
+      orphans[orphan_cnt++] = batch[i]->inumber;
+  orphan_forget (orphans, orphan_cnt);
+
+  for (i = 0; i < cnt; i++)
+    {
+      inode_release (batch[i]);
+      inode_free_inumber (batch[i]->inumber);
+      free (batch[i]);
+    }
+
+  /* Copy the batch's changes to the free map file at once. */
+  free_map_flush ();
+  journal_end ();
+  return true;
+}
+
+/* Reclaim thread: frees the data of removed inodes as their last
+   openers close them. */
+static void
+inode_reclaim_daemon (void *aux UNUSED)
+{
+  for (;;)
+    {
+      lock_acquire (&reclaim_lock);
+      while (list_empty (&reclaim_queue))
+        cond_wait (&reclaim_ready, &reclaim_lock);
+      lock_release (&reclaim_lock);
+
+      lock_acquire (&reclaim_run_lock);
+      reclaim_batch ();
+      lock_release (&reclaim_run_lock);
+    }
+}
+
+/* Frees the data of every removed inode waiting for the reclaim
+   thread, after waiting for the batch the thread is freeing, if
+   any.  Called when the disk fills up, and before the file system
+   is shut down. */
+void
+inode_reclaim (void)
+{
+  lock_acquire (&reclaim_run_lock);
+  while (reclaim_batch ())
+    continue;
+  lock_release (&reclaim_run_lock);
+}
+
+/* Returns true if DISK_INODE holds an inode in use. */
+static bool
+inode_is_valid (const struct inode_disk *disk_inode)
+{
+  return (disk_inode->magic == INODE_MAGIC
+          || inode_has_extents (disk_inode)
+          || inode_is_inline (disk_inode));
+}
+
+/* Returns true if SECTOR may be the next sector of the orphan
+   list, after the CNT sectors in orphan_sectors. */
+static bool
+orphan_sector_ok (block_sector_t sector, size_t cnt)
+{
+  size_t i;
+
+  if (sector == 0 || sector >= block_size (fs_device))
+    return false;
+  for (i = 0; i < cnt; i++)
+    if (orphan_sectors[i] == sector)
+      return false;
+  return true;
+}
+
+/* Reads the sectors of the orphan list that starts at HEAD into
+   orphan_sectors, and returns true if there is at least one.  The
+   list ends at the first sector that looks wrong, and the sector
+   before it is changed to say so. */
+static bool
+orphan_load (block_sector_t head)
+{
+  struct orphan_list *list;
+  block_sector_t sector = head, prev = 0;
+  size_t cnt = 0;
+
+  while (sector != 0)
+    {
+      block_sector_t *sectors, next = 0;
+      bool ok = orphan_sector_ok (sector, cnt);
+
+      if (ok)
+        {
+          list = buffer_cache_get (sector, BUFFER_CACHE_READ,
+                                   BUFFER_CACHE_META);
+          ok = list->magic == ORPHAN_MAGIC && list->cnt <= ORPHAN_CNT;
+          next = list->next;
+          buffer_cache_release (sector, false);
+        }
+      if (!ok)
+        {
+          if (prev != 0)
+            {
+              list = buffer_cache_get (prev, BUFFER_CACHE_WRITE,
+                                       BUFFER_CACHE_META);
+              list->next = 0;
+              buffer_cache_release (prev, true);
+              buffer_cache_write_through (prev);
+            }
+          break;
+        }
+
+      sectors = realloc (orphan_sectors, (cnt + 1) * sizeof *sectors);
+      if (sectors == NULL)
+        PANIC ("can't allocate orphan list");
+      orphan_sectors = sectors;
+      orphan_sectors[cnt++] = sector;
+      prev = sector;
+      sector = next;
+    }
+  orphan_sector_cnt = cnt;
+  return cnt > 0;
+}
+
+/* Finds the orphan list of the disk just mounted, starting one if
+   the disk has none, and queues the inodes in it for the reclaim
+   thread: they were removed, but their data not freed, before the
+   disk was last unmounted.  The free map must be open. */
+void
+inode_recover (void)
+{
+  struct inode *free_map_inode = inode_open (FREE_MAP_SECTOR);
+  struct orphan_list *list;
+  block_sector_t *inumbers = NULL;
+  bool fresh = false;
+  size_t cnt = 0, bad_cnt, i, k;
+
+  if (free_map_inode == NULL)
+    PANIC ("can't open free map inode");
+
+  /* The list's first sector is recorded only once the list is on
+     disk, and a list that looks wrong is left alone rather than
+     reused, since after a crash its sector may not be marked in
+     use.  A free map inode that keeps its data inline has no room
+     to record a list, and its disk goes without. */
+  rwlock_acquire_write (&free_map_inode->rwlock);
+  if (!inode_is_inline (&free_map_inode->data)
+      && !orphan_load (free_map_inode->data.orphans))
+    {
+      block_sector_t sector;
+
+      orphan_sectors = malloc (sizeof *orphan_sectors);
+      if (orphan_sectors != NULL
+          && free_map_allocate_near (FREE_MAP_SECTOR, 1, &sector))
+        {
+          orphan_write_new (sector, 0);
+          free_map_inode->data.orphans = orphan_sectors[0] = sector;
+          orphan_sector_cnt = 1;
+          inode_write_back (free_map_inode);
+          fresh = true;
+        }
+    }
+  rwlock_release_write (&free_map_inode->rwlock);
+  inode_close (free_map_inode);
+  if (fresh)
+    buffer_cache_sync ();
+
+  for (k = 0; k < orphan_sector_cnt; k++)
+    {
+      block_sector_t *more;
+
+      list = buffer_cache_get (orphan_sectors[k], BUFFER_CACHE_READ,
+                               BUFFER_CACHE_META);
+      more = realloc (inumbers, (cnt + list->cnt) * sizeof *inumbers);
+      if (more != NULL)
+        {
+          inumbers = more;
+          memcpy (inumbers + cnt, list->inumbers,
+                  list->cnt * sizeof *inumbers);
+          cnt += list->cnt;
+        }
+      buffer_cache_release (orphan_sectors[k], false);
+    }
+  if (cnt == 0)
+    {
+      free (inumbers);
+      return;
+    }
+
+  /* Entries that do not name an inode are dropped. */
+  bad_cnt = 0;
+  for (i = 0; i < cnt; i++)
+    {
+      block_sector_t sector = inumber_sector (inumbers[i]);
+      struct inode *inode = NULL;
+
+      if (sector != FREE_MAP_SECTOR && sector != ROOT_DIR_SECTOR
+          && sector < block_size (fs_device))
+        inode = inode_open (inumbers[i]);
+      if (inode != NULL && inode_is_valid (&inode->data))
+        {
+          lock_acquire (&open_inodes_lock);
+          inode->removed = inode->orphaned = true;
+          lock_release (&open_inodes_lock);
+        }
+      else
+        inumbers[bad_cnt++] = inumbers[i];
+      inode_close (inode);
+    }
+  orphan_forget (inumbers, bad_cnt);
+  free (inumbers);
+}
+
+/* Returns the first sector of the metadata journal recorded in
+   the free map's inode, or 0 if there is none.  The inode is read
+   from the cache without opening it, since this is called before
+   the journal is replayed. */
+block_sector_t
+inode_journal_sector (void)
+{
+  const struct inode_disk *disk_inode;
+  block_sector_t sector = 0;
+
+  disk_inode = buffer_cache_get (FREE_MAP_SECTOR, BUFFER_CACHE_READ,
+                                 BUFFER_CACHE_META);
+  if (!inode_is_inline (disk_inode))
+    sector = disk_inode->journal;
+  buffer_cache_release (FREE_MAP_SECTOR, false);
+  return sector;
+}
+
+/* Records SECTOR in the free map's inode as the first sector of
+   the metadata journal.  Returns false if the inode has no room
+   for it. */
+bool
+inode_set_journal_sector (block_sector_t sector)
+{
+  struct inode *free_map_inode = inode_open (FREE_MAP_SECTOR);
+  bool success;
+
+  if (free_map_inode == NULL)
+    return false;
+  rwlock_acquire_write (&free_map_inode->rwlock);
+  success = !inode_is_inline (&free_map_inode->data);
+  if (success)
+    {
+      free_map_inode->data.journal = sector;
+      inode_write_back (free_map_inode);
+    }
+  rwlock_release_write (&free_map_inode->rwlock);
+  inode_close (free_map_inode);
+  return success;
+}
+
+/* Blocks written into holes of regular files are not given
+   sectors right away.  They are kept in memory as delayed blocks,
+   with a free sector set aside for each, until the write-behind
+   thread, the file's last close, or too many delayed blocks,
+   place all of a file's delayed blocks at once.  The allocator
+   then sees how much of the file there is to place, and can give
+   it consecutive sectors even while other files are written at
+   the same time. */
+struct delayed_block
+  {
+    struct list_elem elem;              /* Element in inode's DELAYED. */
+    struct hash_elem hash_elem;         /* Element in DELAYED_INDEX. */
+    uint32_t block;                     /* Block of the file. */
+    uint8_t *data;                      /* BLOCK_SECTOR_SIZE bytes. */
+  };
+
+/* Most delayed blocks kept in memory at once. */
+#define DELAY_MAX_BLOCKS 256
+
+/* False while blocks are given sectors as they are written, as
+   they were before allocation was delayed.  Only the
+   fragmentation benchmark turns delaying off, to compare. */
+static bool delay_enabled = true;
+
+/* Returns true if blocks written into holes of INODE are delayed.
+   Directories are not, so that their entries are always found in
+   the cache, and neither is the free map, which placing the
+   blocks writes to. */
+static bool
+inode_delays (const struct inode *inode)
+{
+  return (delay_enabled
+          && !inode->is_dir && inode->inumber != FREE_MAP_SECTOR
+          && inode_has_extents (&inode->data));
+}
+
+/* Returns the number of sectors to set aside for CNT delayed
+   blocks of INODE that form RUNS runs of consecutive blocks: one
+   for each block, and for each run, since each becomes at least
+   one extent, as many extent tree nodes as adding an extent can
+   create.  That is one split at each level of the tree, the root
+   growing a level, and a level more in case an earlier run made it
+   grow. */
+static size_t
+inode_delay_need_for (const struct inode *inode, size_t cnt, size_t runs)
+{
+  return cnt + runs * (inode->data.extents.hdr.depth + 2);
+}
+
+/* Returns the number of sectors to set aside for the delayed
+   blocks of INODE. */
+static size_t
+inode_delay_need (const struct inode *inode)
+{
+  return inode_delay_need_for (inode, inode->delayed_cnt,
+                               inode->delayed_runs);
+}
+
+static unsigned
+delayed_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct delayed_block, hash_elem)->block);
+}
+
+static bool
+delayed_hash_less (const struct hash_elem *a, const struct hash_elem *b,
+                   void *aux UNUSED)
+{
+  return (hash_entry (a, struct delayed_block, hash_elem)->block
+          < hash_entry (b, struct delayed_block, hash_elem)->block);
+}
+
+/* Returns delayed block BLOCK of INODE, or a null pointer if it
+   has none. */
+static struct delayed_block *
+inode_find_delayed (struct inode *inode, uint32_t block)
+{
+  struct delayed_block key;
+  struct hash_elem *e;
+
+  if (inode->delayed_cnt == 0)
+    return NULL;
+  key.block = block;
+  e = hash_find (&inode->delayed_index, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct delayed_block, hash_elem) : NULL;
+}
+
+static bool
+delayed_less (const struct list_elem *a, const struct list_elem *b,
+              void *aux UNUSED)
+{
+  return (list_entry (a, struct delayed_block, elem)->block
+          < list_entry (b, struct delayed_block, elem)->block);
+}
+
+/* Returns the data of delayed block BLOCK of INODE, which must be a
+   hole, adding the block, zeroed, if it is not there yet.  Returns
+   a null pointer if no more blocks may be delayed, the disk has no
+   room to set aside for it, or memory runs out.  The caller must
+   hold INODE's rwlock for writing. */
+static uint8_t *
+inode_delay_block (struct inode *inode, uint32_t block)
+{
+  struct delayed_block *d = inode_find_delayed (inode, block);
+  struct delayed_block *prev, *next;
+  size_t runs, need, want;
+  bool full;
+
+  if (d != NULL)
+    return d->data;
+
+  /* The new block joins the runs it borders. */
+  prev = block > 0 ? inode_find_delayed (inode, block - 1) : NULL;
+  next = inode_find_delayed (inode, block + 1);
+  runs = (inode->delayed_runs + (prev == NULL && next == NULL)
+          - (prev != NULL && next != NULL));
+  need = inode_delay_need_for (inode, inode->delayed_cnt + 1, runs);
+  want = need > inode->reserved_cnt ? need - inode->reserved_cnt : 0;
+
+  d = malloc (sizeof *d);
+  if (d == NULL)
+    return NULL;
+  d->data = calloc (1, BLOCK_SECTOR_SIZE);
+  if (d->data == NULL
+      || (inode->delayed_cnt == 0
+          && !hash_init (&inode->delayed_index, delayed_hash,
+                         delayed_hash_less, NULL)))
+    {
+      free (d->data);
+      free (d);
+      return NULL;
+    }
+  if (want > 0 && !free_map_reserve (want))
+    full = true;
+  else
+    {
+      lock_acquire (&open_inodes_lock);
+      full = delayed_total >= DELAY_MAX_BLOCKS;
+      if (!full)
+        {
+          delayed_total++;
+          if (inode->delayed_cnt == 0)
+            list_push_back (&delayed_inodes, &inode->delayed_elem);
+        }
+      lock_release (&open_inodes_lock);
+      if (full && want > 0)
+        free_map_unreserve (want);
+    }
+  if (full)
+    {
+      if (inode->delayed_cnt == 0)
+        hash_destroy (&inode->delayed_index, NULL);
+      free (d->data);
+      free (d);
+      return NULL;
+    }
+
+  /* Keep DELAYED sorted, finding the place from a neighbor where
+     there is one. */
+  d->block = block;
+  if (prev != NULL)
+    list_insert (list_next (&prev->elem), &d->elem);
+  else if (next != NULL)
+    list_insert (&next->elem, &d->elem);
+  else if (list_empty (&inode->delayed)
+           || delayed_less (list_back (&inode->delayed), &d->elem, NULL))
+    list_push_back (&inode->delayed, &d->elem);
+  else
+    list_insert_ordered (&inode->delayed, &d->elem, delayed_less, NULL);
+  hash_insert (&inode->delayed_index, &d->hash_elem);
+  inode->delayed_cnt++;
+  inode->delayed_runs = runs;
+  inode->reserved_cnt += want;
+  return d->data;
+}
+
+/* Removes delayed block D from INODE and frees it. */
+static void
+inode_drop_delayed (struct inode *inode, struct delayed_block *d)
+{
+  bool prev = d->block > 0 && inode_find_delayed (inode, d->block - 1);
+  bool next = inode_find_delayed (inode, d->block + 1) != NULL;
+
+  inode->delayed_runs += (prev && next) - (!prev && !next);
+  list_remove (&d->elem);
+  hash_delete (&inode->delayed_index, &d->hash_elem);
+  if (--inode->delayed_cnt == 0)
+    hash_destroy (&inode->delayed_index, NULL);
+  free (d->data);
+  free (d);
+}
+
+/* Notes that CNT of INODE's delayed blocks have been placed or
+   dropped.  The caller must hold open_inodes_lock. */
+static void
+delay_forget (struct inode *inode, size_t cnt)
+{
+  ASSERT (delayed_total >= cnt);
+  delayed_total -= cnt;
+  if (cnt > 0 && inode->delayed_cnt == 0)
+    list_remove (&inode->delayed_elem);
+}
+
+/* Gives sectors to the delayed blocks of INODE, a run of
+   consecutive sectors for each run of consecutive blocks where
+   the disk allows, and writes them to the cache.  The sectors are
+   taken out of those set aside for the blocks, a run at a time,
+   so that other allocations cannot take them in between.  Up to
+   EXTRA more blocks are allocated past the end of the file, as in
+   inode_fill().  Blocks the disk has no room for stay delayed.
+   The caller must hold INODE's rwlock for writing, or hold the
+   last reference to INODE, and account for the blocks placed with
+   delay_forget(). */
+static void
+inode_place_delayed (struct inode *inode, uint32_t extra)
+{
+  struct extent_root *root = &inode->data.extents;
+  size_t placed = 0, need;
+
+  if (inode->delayed_cnt == 0)
+    return;
+
+  while (!list_empty (&inode->delayed))
+    {
+      struct list_elem *e = list_front (&inode->delayed);
+      uint32_t first = list_entry (e, struct delayed_block, elem)->block;
+      uint32_t cnt, filled, done;
+
+      /* Find the run of consecutive blocks starting at FIRST. */
+      for (cnt = 1; list_next (e) != list_end (&inode->delayed); cnt++)
+        {
+          e = list_next (e);
+          if (list_entry (e, struct delayed_block, elem)->block
+              != first + cnt)
+            break;
+        }
+
+      /* Blocks filled past the run were preallocated. */
+      filled = inode_fill (inode, first, first + cnt, extra,
+                           &inode->reserved_cnt);
+      if (filled == 0)
+        break;
+      if (filled < cnt)
+        cnt = filled;
+      for (done = 0; done < cnt; )
+        {
+          uint32_t n;
+          block_sector_t sector = extent_lookup (root, first + done, &n);
+
+          for (; n > 0 && done < cnt; n--, done++, sector++)
+            {
+              struct delayed_block *d
+                = list_entry (list_front (&inode->delayed),
+                              struct delayed_block, elem);
+              memcpy (buffer_cache_get (sector, BUFFER_CACHE_OVERWRITE,
+                                        BUFFER_CACHE_DATA),
+                      d->data, BLOCK_SECTOR_SIZE);
+              buffer_cache_release (sector, true);
+              inode_drop_delayed (inode, d);
+            }
+        }
+      placed += cnt;
+    }
+
+  if (placed > 0)
+    inode_write_back (inode);
+
+  /* Keep set aside only what the blocks left still need, topping
+     it up if placing the others used some of their spare. */
+  need = inode_delay_need (inode);
+  if (inode->reserved_cnt > need)
+    {
+      free_map_unreserve (inode->reserved_cnt - need);
+      inode->reserved_cnt = need;
+    }
+  else if (inode->reserved_cnt < need
+           && free_map_reserve (need - inode->reserved_cnt))
+    inode->reserved_cnt = need;
+}
+
+/* Places the delayed blocks of INODE, whose rwlock the caller
+   holds for writing. */
+static void
+inode_flush_delayed_blocks (struct inode *inode)
+{
+  size_t before = inode->delayed_cnt;
+
+  inode_place_delayed (inode, INODE_PREALLOC_SECTORS);
+  lock_acquire (&open_inodes_lock);
+  delay_forget (inode, before - inode->delayed_cnt);
+  lock_release (&open_inodes_lock);
+}
+
+/* Drops the delayed blocks of INODE, which the caller has taken
+   out of open_inodes, along with the sectors set aside for them.
+   Data written to a file is never dropped this way: INODE must
+   have been removed, or have no delayed blocks left.  Takes
+   open_inodes_lock only to account for the blocks dropped, so the
+   caller must not hold it. */
+static void
+inode_discard_delayed (struct inode *inode)
+{
+  size_t cnt = inode->delayed_cnt;
+
+  ASSERT (inode->removed || cnt == 0);
+  while (!list_empty (&inode->delayed))
+    inode_drop_delayed (inode,
+                        list_entry (list_front (&inode->delayed),
+                                    struct delayed_block, elem));
+  if (inode->reserved_cnt > 0)
+    free_map_unreserve (inode->reserved_cnt);
+  inode->reserved_cnt = 0;
+  if (cnt > 0)
+    {
+      lock_acquire (&open_inodes_lock);
+      delay_forget (inode, cnt);
+      lock_release (&open_inodes_lock);
+    }
+}
+
+/* Sets whether blocks written into holes of regular files from now
+   on are delayed, or given sectors as they are written.  Blocks
+   already delayed are placed as usual either way. */
+void
+inode_set_delayed (bool on)
+{
+  delay_enabled = on;
+}
+
+/* Places the delayed blocks of every inode.  The placement thread
+   calls this every write-behind interval, so that the blocks reach
+   the disk along with other dirty sectors. */
+void
+inode_flush_delayed (void)
+{
+  struct inode **inodes;
+  struct list_elem *e;
+  size_t cnt, i;
+
+  lock_acquire (&open_inodes_lock);
+  inodes = malloc (list_size (&delayed_inodes) * sizeof *inodes);
+  if (inodes == NULL)
+    {
+      lock_release (&open_inodes_lock);
+      return;
+    }
+  cnt = 0;
+  for (e = list_begin (&delayed_inodes); e != list_end (&delayed_inodes);
+       e = list_next (e))
+    {
+      /* An inode being closed places its own blocks. */
+      struct inode *inode = list_entry (e, struct inode, delayed_elem);
+      if (!inode->closing)
+        {
+          inode->open_cnt++;
+          inodes[cnt++] = inode;
+        }
+    }
+  lock_release (&open_inodes_lock);
+
+  for (i = 0; i < cnt; i++)
+    {
+      journal_begin ();
+      rwlock_acquire_write (&inodes[i]->rwlock);
+      inode_flush_delayed_blocks (inodes[i]);
+      rwlock_release_write (&inodes[i]->rwlock);
+      inode_close (inodes[i]);
+      journal_end ();
+    }
+  free (inodes);
+}
+
+/* Placement thread: every write-behind interval, places the
+   blocks whose allocation file writes have delayed, then commits
+   the metadata changed since the last pass, placements included,
+   to the journal as one group. */
+static void
+inode_place_daemon (void *aux UNUSED)
+{
+  for (;;)
+    {
+      timer_msleep (buffer_cache_flush_interval ());
+      inode_flush_delayed ();
+      journal_commit ();
+    }
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device.  The data reads as zeros.  It is kept inline if it
+   fits, and otherwise disk space for it is only allocated as it
+   is written.
    Returns true if successful.
-   Returns false if memory or disk allocation fails. */
+   Returns false if memory allocation fails. */
 bool
 inode_create (block_sector_t sector, off_t length, bool is_dir)
 {
@@ -191,54 +1608,170 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
 
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL) {
-    size_t sectors = bytes_to_sectors (length);
-    disk_inode->magic = INODE_MAGIC;
-
-    success = inode_extend (disk_inode, sectors);
-    if (success) { 
-      disk_inode->length = length;
-      disk_inode->is_dir = is_dir ? 1 : 0;
-      buffer_cache_write (sector, disk_inode);
-    }
+    inode_format (disk_inode, length, is_dir, INODE_INLINE_MAX);
+    memcpy (buffer_cache_get (sector, BUFFER_CACHE_OVERWRITE,
+                              BUFFER_CACHE_META),
+            disk_inode, BLOCK_SECTOR_SIZE);
+    buffer_cache_release (sector, true);
     free (disk_inode);
+    success = true;
   }
   return success;
 }
 
-/* Reads an inode from SECTOR
-   and returns a struct inode that contains it.
+/* Creates a packed inode with LENGTH bytes of data, which read as
+   zeros, and stores its inode number in *INUMBERP.  The inode goes
+   into the first free slot of an inode table sector from NEAR on,
+   typically the sector of the directory that will refer to it, so
+   that the inodes of a directory's files share sectors.  If there
+   is none close by, a new table sector is taken near NEAR.
+   Returns true if successful, false if the disk is full or memory
+   allocation fails. */
+bool
+inode_create_near (block_sector_t near, off_t length, bool is_dir,
+                   block_sector_t *inumberp)
+{
+  struct inode_disk *disk_inode;
+  struct inode_packed *table;
+  block_sector_t sector;
+  size_t slot;
+
+  ASSERT (length >= 0);
+  ASSERT (sizeof *table * INODES_PER_SECTOR == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct extent_header)
+          + INODE_PACKED_EXTENTS * sizeof (struct extent)
+          <= INODE_PACKED_INLINE_MAX);
+
+  disk_inode = calloc (1, sizeof *disk_inode);
+  if (disk_inode == NULL)
+    return false;
+  inode_format (disk_inode, length, is_dir, INODE_PACKED_INLINE_MAX);
+
+  lock_acquire (&itable_lock);
+  if (near >= bitmap_size (itable_free))
+    near = 0;
+  for (;;)
+    {
+      sector = bitmap_scan (itable_free, near, 1, true);
+      if (sector == BITMAP_ERROR || sector - near >= ITABLE_REACH)
+        {
+          /* Start a new table sector. */
+          if (!free_map_allocate_near (near, 1, &sector))
+            {
+              lock_release (&itable_lock);
+              free (disk_inode);
+              return false;
+            }
+          ASSERT (sector < INODE_PACKED / INODES_PER_SECTOR);
+          table = buffer_cache_get (sector, BUFFER_CACHE_OVERWRITE,
+                                    BUFFER_CACHE_META);
+          memset (table, 0, BLOCK_SECTOR_SIZE);
+          slot = 0;
+          break;
+        }
+
+      table = buffer_cache_get (sector, BUFFER_CACHE_WRITE,
+                                BUFFER_CACHE_META);
+      slot = itable_free_slot (table);
+      if (slot < INODES_PER_SECTOR)
+        break;
+      buffer_cache_release (sector, false);
+      bitmap_reset (itable_free, sector);
+    }
+  inode_pack (&table[slot], disk_inode);
+  bitmap_set (itable_free, sector,
+              itable_free_slot (table) < INODES_PER_SECTOR);
+  buffer_cache_release (sector, true);
+  lock_release (&itable_lock);
+  free (disk_inode);
+
+  *inumberp = INODE_PACKED | (sector * INODES_PER_SECTOR + slot);
+  return true;
+}
+
+/* Reads inode INUMBER and returns a struct inode that contains it.
    Returns a null pointer if memory allocation fails. */
 struct inode *
-inode_open (block_sector_t sector)
+inode_open (block_sector_t inumber)
 {
-  struct list_elem *e;
+  /* Lookup key.  Static because struct inode is too big for the
+     stack; open_inodes_lock serializes its use. */
+  static struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  /* Check whether this inode is already open, waiting for its
+     last opener to finish closing it if need be. */
+  lock_acquire (&open_inodes_lock);
+  for (;;)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
+      key.inumber = inumber;
+      e = hash_find (&open_inodes, &key.elem);
+      if (e == NULL)
+        break;
+      inode = hash_entry (e, struct inode, elem);
+      if (!inode->closing)
         {
-          inode_reopen (inode);
-          return inode; 
+          inode->open_cnt++;
+          lock_release (&open_inodes_lock);
+          return inode;
         }
+      cond_wait (&inode_closed, &open_inodes_lock);
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
-  inode->sector = sector;
+  /* Initialize.  The inode is read before the lock is released, so
+     that nobody else can find it half set up. */
+  inode->inumber = inumber;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  buffer_cache_read (inode->sector, &inode->data);
+  inode->orphaned = false;
+  inode->closing = false;
+  rwlock_init (&inode->rwlock);
+  lock_init (&inode->runs_lock);
+  memset (inode->runs, 0, sizeof inode->runs);
+  inode->run_hand = 0;
+  lock_init (&inode->dir_lock);
+  list_init (&inode->delayed);
+  inode->delayed_cnt = 0;
+  inode->delayed_runs = 0;
+  inode->reserved_cnt = 0;
+  if (inumber_is_packed (inumber))
+    {
+      block_sector_t sector = inumber_sector (inumber);
+      struct inode_packed *table;
+
+      /* Note a free slot in the table sector while it is at hand,
+         so that slots freed before the file system was last
+         mounted get used again. */
+      lock_acquire (&itable_lock);
+      table = buffer_cache_get (sector, BUFFER_CACHE_READ,
+                                BUFFER_CACHE_META);
+      inode_unpack (&inode->data, inumber_slot (inumber, table));
+      if (itable_free_slot (table) < INODES_PER_SECTOR)
+        bitmap_mark (itable_free, sector);
+      buffer_cache_release (sector, false);
+      lock_release (&itable_lock);
+    }
+  else
+    {
+      memcpy (&inode->data,
+              buffer_cache_get (inumber, BUFFER_CACHE_READ,
+                                BUFFER_CACHE_META),
+              BLOCK_SECTOR_SIZE);
+      buffer_cache_release (inumber, false);
+    }
   inode->is_dir = inode->data.is_dir == 1 ? true : false;
+  hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
   return inode;
 }
 
@@ -247,7 +1780,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -255,12 +1792,47 @@ inode_reopen (struct inode *inode)
 block_sector_t
 inode_get_inumber (const struct inode *inode)
 {
-  return inode->sector;
+  return inode->inumber;
+}
+
+/* Writes INODE's on-disk inode to the cache. */
+static void
+inode_write_back (struct inode *inode)
+{
+  block_sector_t sector = inumber_sector (inode->inumber);
+
+  if (inumber_is_packed (inode->inumber))
+    {
+      void *table = buffer_cache_get (sector, BUFFER_CACHE_WRITE,
+                                      BUFFER_CACHE_META);
+      inode_pack (inumber_slot (inode->inumber, table), &inode->data);
+      buffer_cache_release (sector, true);
+      return;
+    }
+  memcpy (buffer_cache_get (sector, BUFFER_CACHE_OVERWRITE,
+                            BUFFER_CACHE_META),
+          &inode->data, BLOCK_SECTOR_SIZE);
+  buffer_cache_release (sector, true);
+}
+
+/* Gives back the blocks preallocated past the end of INODE. */
+static void
+inode_trim (struct inode *inode)
+{
+  struct inode_disk *disk_inode = &inode->data;
+  size_t sectors = bytes_to_sectors (disk_inode->length);
+
+  if (!inode_has_extents (disk_inode)
+      || extent_end (&disk_inode->extents) <= sectors)
+    return;
+  extent_truncate (&disk_inode->extents, sectors);
+  inode_write_back (inode);
 }
 
 /* Closes INODE and writes it to disk.
    If this was the last reference to INODE, frees its memory.
-   If INODE was also a removed inode, frees its blocks. */
+   If INODE was also a removed inode, queues it for the reclaim
+   thread to free its blocks and then its memory. */
 void
 inode_close (struct inode *inode) 
 {
@@ -268,29 +1840,111 @@ inode_close (struct inode *inode)
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  /* Release resources if this was the last opener.  INODE stays
+     in open_inodes, marked CLOSING, while its delayed blocks are
+     placed and it is trimmed, so that anyone opening it again
+     waits and reads it back as it is left.  It is then only taken
+     out of open_inodes under open_inodes_lock; dropping what is
+     left of it, and queuing or freeing its data, is done after the
+     lock is released.  With no other reference left, REMOVED and
+     ORPHANED can no longer change, so they are read without the
+     lock. */
+  journal_begin ();
+  lock_acquire (&open_inodes_lock);
+  if (--inode->open_cnt > 0)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
+      lock_release (&open_inodes_lock);
+      journal_end ();
+      return;
+    }
+  inode->closing = true;
+  lock_release (&open_inodes_lock);
 
-      /* Deallocate blocks if removed. */
-      if (inode->removed) 
+  if (!inode->removed)
+    {
+      size_t delayed_cnt = inode->delayed_cnt;
+
+      /* Write() has accepted the delayed blocks, so they must be
+         placed.  Their sectors are set aside, so this fails only
+         if the extent tree needs more nodes than expected and the
+         disk is full, unless removed files have yet to be freed. */
+      inode_place_delayed (inode, 0);
+      if (inode->delayed_cnt > 0)
         {
-          free_map_release (inode->sector, 1);
-          inode_release (inode);
+          inode_reclaim ();
+          inode_place_delayed (inode, 0);
         }
-      free (inode); 
+      if (inode->delayed_cnt > 0)
+        PANIC ("can't place %zu delayed blocks of inode %"PRDSNu,
+               inode->delayed_cnt, inode->inumber);
+      lock_acquire (&open_inodes_lock);
+      delay_forget (inode, delayed_cnt - inode->delayed_cnt);
+      lock_release (&open_inodes_lock);
+      inode_trim (inode);
+    }
+
+  lock_acquire (&open_inodes_lock);
+  hash_delete (&open_inodes, &inode->elem);
+  cond_broadcast (&inode_closed, &open_inodes_lock);
+  lock_release (&open_inodes_lock);
+
+  /* Deallocate blocks if removed. */
+  inode_discard_delayed (inode);
+  if (inode->removed && !inode->orphaned)
+    {
+      /* Nothing would free an inode missing from the orphan list
+         after a crash, so free it now rather than later. */
+      inode_release (inode);
+      inode_free_inumber (inode->inumber);
+      free_map_flush ();
+      free (inode);
     }
+  else if (inode->removed)
+    reclaim_push (inode);
+  else
+    free (inode);
+  journal_end ();
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
-   has it open. */
+   has it open, and adds it to the orphan list on disk until then.
+   A caller removing INODE's directory entry calls this first, so
+   that the list names INODE before the entry is gone. */
 void
 inode_remove (struct inode *inode) 
 {
+  bool was_removed;
+
   ASSERT (inode != NULL);
+  lock_acquire (&open_inodes_lock);
+  was_removed = inode->removed;
   inode->removed = true;
+  lock_release (&open_inodes_lock);
+
+  /* The caller's reference keeps the last close from seeing
+     ORPHANED before it is set. */
+  if (!was_removed && orphan_add (inode->inumber))
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->orphaned = true;
+      lock_release (&open_inodes_lock);
+    }
+}
+
+/* Undoes inode_remove(), for a caller that then failed to remove
+   INODE's directory entry. */
+void
+inode_unremove (struct inode *inode)
+{
+  bool orphaned;
+
+  ASSERT (inode != NULL);
+  lock_acquire (&open_inodes_lock);
+  orphaned = inode->orphaned;
+  inode->removed = inode->orphaned = false;
+  lock_release (&open_inodes_lock);
+  if (orphaned)
+    orphan_forget (&inode->inumber, 1);
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -301,16 +1955,28 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
+  struct inode_run run = { 0, 0, 0 };
 
+  rwlock_acquire_read (&inode->rwlock);
+  if (inode_is_inline (&inode->data))
+    {
+      /* The data is in the inode, already in memory. */
+      off_t length = inode->data.length;
+      if (offset < length)
+        {
+          bytes_read = size < length - offset ? size : length - offset;
+          memcpy (buffer, inode->data.data + offset, bytes_read);
+        }
+      size = 0;
+    }
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      block_sector_t sector_idx = inode_next_sector (inode, offset, &run);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      off_t inode_left = inode->data.length - offset;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
@@ -319,21 +1985,25 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      if (sector_idx == -1u)
         {
-          /* Read full sector directly into caller's buffer. */
-          buffer_cache_read (sector_idx, buffer + bytes_read);
+          /* A hole reads as zeros, unless it has been written and
+             the block is delayed. */
+          struct delayed_block *d
+            = inode_find_delayed (inode, offset / BLOCK_SECTOR_SIZE);
+          if (d != NULL)
+            memcpy (buffer + bytes_read, d->data + sector_ofs, chunk_size);
+          else
+            memset (buffer + bytes_read, 0, chunk_size);
         }
-      else 
+      else
         {
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          buffer_cache_read (sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
+          /* Copy straight out of the cached sector. */
+          uint8_t *cached = buffer_cache_get (sector_idx, BUFFER_CACHE_READ,
+                                              inode_cache_type (inode));
+          memcpy (buffer + bytes_read, cached + sector_ofs, chunk_size);
+          buffer_cache_release (sector_idx, false);
+          data_sector_cnt++;
         }
 
       /* Advance. */
@@ -341,44 +2011,124 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       offset += chunk_size;
       bytes_read += chunk_size;
     }
+  rwlock_release_read (&inode->rwlock);
 
-  free (bounce);
   return bytes_read;
 }
 
+/* Queues the sectors holding SIZE bytes of INODE starting at
+   OFFSET for asynchronous reading into the buffer cache.  Bytes
+   past the end of INODE are ignored. */
+void
+inode_read_ahead (struct inode *inode, off_t offset, off_t size)
+{
+  off_t end = offset + size;
+  off_t pos;
+  struct inode_run run = { 0, 0, 0 };
+
+  rwlock_acquire_read (&inode->rwlock);
+  if (end > inode->data.length)
+    end = inode->data.length;
+  if (inode_is_inline (&inode->data))
+    end = 0;
+  for (pos = ROUND_DOWN (offset, BLOCK_SECTOR_SIZE); pos < end;
+       pos += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector = inode_next_sector (inode, pos, &run);
+      if (sector != -1u)
+        buffer_cache_read_ahead (sector);
+    }
+  rwlock_release_read (&inode->rwlock);
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
+   A write past the end of INODE extends it, leaving a hole between
+   the old end and OFFSET.  Blocks written that were in holes are
+   delayed, for regular files, or else given sectors.
 
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if the disk fills up or an error occurs. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
   const uint8_t *buffer = buffer_;
+  struct inode_disk *disk_inode = &inode->data;
+  off_t old_length, end;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  struct inode_run run = { 0, 0, 0 };
+  uint32_t fresh_start = 0, fresh_end = 0;
+  uint32_t extra = 0;
+  bool dirty = false;
 
+  journal_begin ();
+  rwlock_acquire_write (&inode->rwlock);
   if (inode->deny_write_cnt)
-    return 0;
-
-  if (byte_to_sector (inode, offset + size - 1) == -1u) {
-    static char zeros[BLOCK_SECTOR_SIZE];
-    struct inode_disk *disk_inode = &inode->data;
-    disk_inode->length = offset + size;
-    inode_extend (disk_inode, bytes_to_sectors (disk_inode->length));
-    buffer_cache_write (inode->sector, disk_inode);
+    {
+      rwlock_release_write (&inode->rwlock);
+      journal_end ();
+      return 0;
+    }
+
+  old_length = disk_inode->length;
+  if (inode_is_inline (disk_inode))
+    {
+      if (offset + size <= inode_inline_max (inode))
+        {
+          /* Bytes past the end of inline data are always zero, so
+             a gap before OFFSET needs no clearing. */
+          memcpy (disk_inode->data + offset, buffer, size);
+          if (offset + size > old_length)
+            disk_inode->length = offset + size;
+          inode_write_back (inode);
+          rwlock_release_write (&inode->rwlock);
+          journal_end ();
+          return size;
+        }
+      if (!inode_uninline (inode))
+        {
+          rwlock_release_write (&inode->rwlock);
+          journal_end ();
+          return 0;
+        }
+      dirty = true;
+    }
+
+  /* The file grows to END, but only a chunk at a time, as each is
+     given a sector, so that the length never takes in a block the
+     write could not allocate. */
+  end = offset + size > old_length ? offset + size : old_length;
+  if (offset + size > old_length) {
+    size_t old_sectors = bytes_to_sectors (old_length);
+    size_t new_sectors = bytes_to_sectors (offset + size);
+
+    /* Blocks preallocated past the old end have to read as zeros
+       once the length takes them in.  Inodes from before extents
+       cannot have holes, so they get all their blocks now. */
+    if (inode_has_extents (disk_inode))
+      inode_zero_blocks (disk_inode, old_sectors, new_sectors,
+                         offset, size, inode_cache_type (inode));
+    else if (!inode_extend_map (disk_inode, new_sectors)) {
+      /* Write the inode back even though the disk filled up,
+         since the blocks mapped before that are kept. */
+      inode_write_back (inode);
+      rwlock_release_write (&inode->rwlock);
+      journal_end ();
+      return 0;
+    }
+    dirty = true;
+    if (!inode->is_dir)
+      extra = INODE_PREALLOC_SECTORS;
   }
 
   while (size > 0) 
     {
-      /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      /* Block to write, starting byte offset within sector. */
+      uint32_t block = offset / BLOCK_SECTOR_SIZE;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      off_t inode_left = end - offset;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
@@ -387,30 +2137,72 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      /* Take the chunk into the file, so that its block maps, then
+         find its sector. */
+      if (offset + chunk_size > disk_inode->length)
+        disk_inode->length = offset + chunk_size;
+      block_sector_t sector_idx = inode_next_sector (inode, offset, &run);
+
+      uint8_t *delayed = NULL;
+      if (sector_idx == -1u && inode_delays (inode))
         {
-          /* Write full sector directly to disk. */
-          buffer_cache_write (sector_idx, buffer + bytes_written);
+          delayed = inode_delay_block (inode, block);
+          if (delayed == NULL)
+            {
+              /* Too many blocks are delayed.  Place this file's
+                 now, which may preallocate this block too. */
+              inode_flush_delayed_blocks (inode);
+              run.length = 0;
+              sector_idx = inode_next_sector (inode, offset, &run);
+            }
         }
-      else 
+      if (sector_idx == -1u && delayed == NULL)
         {
-          if (bounce == NULL) 
+          /* Give the hole sectors, for the rest of this write at
+             least. */
+          uint32_t cnt = inode_fill (inode, block,
+                                     DIV_ROUND_UP (offset + size,
+                                                   BLOCK_SECTOR_SIZE),
+                                     extra, NULL);
+          if (cnt == 0)
             {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
+              /* The disk is full, unless removed files have yet to
+                 be freed. */
+              inode_reclaim ();
+              cnt = inode_fill (inode, block,
+                                DIV_ROUND_UP (offset + size,
+                                              BLOCK_SECTOR_SIZE),
+                                extra, NULL);
             }
+          if (cnt == 0)
+            break;
+          fresh_start = block;
+          fresh_end = block + cnt;
+          dirty = true;
+          run.length = 0;
+          sector_idx = inode_next_sector (inode, offset, &run);
+        }
 
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            buffer_cache_read (sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          buffer_cache_write (sector_idx, bounce);
+      if (delayed != NULL)
+        memcpy (delayed + sector_ofs, buffer + bytes_written, chunk_size);
+      else
+        {
+          /* Copy straight into the cached sector, which need not be
+             read first if the chunk covers all of it, or if the
+             sector was just allocated, in which case the rest is
+             zeroed. */
+          bool fresh = block - fresh_start < fresh_end - fresh_start;
+          enum buffer_cache_mode mode
+            = (chunk_size == BLOCK_SECTOR_SIZE || fresh
+               ? BUFFER_CACHE_OVERWRITE : BUFFER_CACHE_WRITE);
+          uint8_t *cached = buffer_cache_get (sector_idx, mode,
+                                              inode_cache_type (inode));
+          if (fresh && chunk_size < BLOCK_SECTOR_SIZE)
+            memset (cached, 0, BLOCK_SECTOR_SIZE);
+          memcpy (cached + sector_ofs, buffer + bytes_written, chunk_size);
+          buffer_cache_release (sector_idx, true);
         }
+      data_sector_cnt++;
 
       /* Advance. */
       size -= chunk_size;
@@ -418,7 +2210,16 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       bytes_written += chunk_size;
     }
 
-  free (bounce);
+  /* If the disk filled up, the file ends where the data does, or
+     where it did if none was written past that, so the length
+     never reaches over a hole that the write failed to fill. */
+  if (size > 0)
+    disk_inode->length = (bytes_written > 0 && offset > old_length
+                          ? offset : old_length);
+  if (dirty)
+    inode_write_back (inode);
+  rwlock_release_write (&inode->rwlock);
+  journal_end ();
   return bytes_written;
 }
 
@@ -427,8 +2228,10 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 void
 inode_deny_write (struct inode *inode) 
 {
+  rwlock_acquire_write (&inode->rwlock);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  rwlock_release_write (&inode->rwlock);
 }
 
 /* Re-enables writes to INODE.
@@ -437,16 +2240,41 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  rwlock_acquire_write (&inode->rwlock);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  rwlock_release_write (&inode->rwlock);
 }
 
-/* Returns the length, in bytes, of INODE's data. */
+/* Returns the length, in bytes, of INODE's data.  Writes that
+   extend the file change the length under INODE's rwlock, so this
+   takes it to see a length that a write has finished with.  The
+   caller must not hold it; code in this file that does reads
+   DATA.LENGTH directly. */
 off_t
-inode_length (const struct inode *inode)
+inode_length (struct inode *inode)
 {
-  return inode->data.length;
+  off_t length;
+
+  rwlock_acquire_read (&inode->rwlock);
+  length = inode->data.length;
+  rwlock_release_read (&inode->rwlock);
+  return length;
+}
+
+/* Frees every data sector listed in the indirect block at
+   SECTOR, then the indirect block itself. */
+static void
+inode_release_indirect (block_sector_t sector)
+{
+  for (size_t i = 0; i < INDIRECT_SIZE; i++) {
+    block_sector_t data = inode_single_indirect (sector, i);
+    if (data != 0) {
+      free_map_release (data, 1);
+    }
+  }
+  free_map_release (sector, 1);
 }
 
 static bool
@@ -454,40 +2282,28 @@ inode_release (struct inode *inode)
 {
   struct inode_disk *disk_inode = &inode->data;
 
+  if (inode_is_inline (disk_inode))
+    return true;
+  if (inode_has_extents (disk_inode)) {
+    extent_release (&disk_inode->extents);
+    return true;
+  }
+
   for (size_t i = 0; i < DIRECT_BLOCKS; i++) {
     if (disk_inode->direct[i] != 0) {
       free_map_release (disk_inode->direct[i], 1);
     }
   }
 
-  if (disk_inode->indirect != 0) {
-    block_sector_t indirect_block[128];
-    buffer_cache_read (disk_inode->indirect, indirect_block);
-
-    for (size_t i = 0; i < 128; i++) {
-      if (indirect_block[i] != 0) {
-        free_map_release (indirect_block[i], 1);
-      }
-    }
-    free_map_release (disk_inode->indirect, 1);
-  }
+  if (disk_inode->indirect != 0)
+    inode_release_indirect (disk_inode->indirect);
 
   if (disk_inode->doubly_indirect != 0) {
-    block_sector_t doubly_indirect_block[128];
-    buffer_cache_read (disk_inode->doubly_indirect, doubly_indirect_block);
-
-    for (size_t i = 0; i < 128; i++) {
-      if (doubly_indirect_block[i] != 0) {
-        block_sector_t indirect_block[128];
-        buffer_cache_read (doubly_indirect_block[i], indirect_block);
-        
-        for (size_t j = 0; j < 128; j++) {
-          if (indirect_block[j] != 0) {
-            free_map_release (indirect_block[j], 1);
-          }
-        }
-        free_map_release (doubly_indirect_block[i], 1);
-      }
+    for (size_t i = 0; i < INDIRECT_SIZE; i++) {
+      block_sector_t indirect
+        = inode_single_indirect (disk_inode->doubly_indirect, i);
+      if (indirect != 0)
+        inode_release_indirect (indirect);
     }
     free_map_release (disk_inode->doubly_indirect, 1);
   }
@@ -500,8 +2316,85 @@ inode_is_dir (struct inode *inode)
   return inode->is_dir;
 }
 
+/* Returns true if anyone other than the caller has INODE open.
+   Another thread may open INODE as soon as this returns, so the
+   answer is only a hint: dir_remove() uses it to refuse to remove
+   a directory in use, and a directory opened just afterward is
+   removed while open, which the file system already allows. */
 bool
 inode_is_opened (struct inode *inode)
 {
-  return inode->open_cnt > 1;
+  bool opened;
+
+  lock_acquire (&open_inodes_lock);
+  opened = inode->open_cnt > 1;
+  lock_release (&open_inodes_lock);
+  return opened;
+}
+
+/* Returns true if INODE has been removed.  For a directory, the
+   answer holds while the caller holds INODE's directory lock, under
+   which dir_remove() both removes it and, if it then fails to erase
+   the entry, takes that back. */
+bool
+inode_is_removed (struct inode *inode)
+{
+  bool removed;
+
+  lock_acquire (&open_inodes_lock);
+  removed = inode->removed;
+  lock_release (&open_inodes_lock);
+  return removed;
+}
+
+/* Acquires the lock that serializes changes to the entries of
+   directory INODE. */
+void
+inode_lock_dir (struct inode *inode)
+{
+  ASSERT (inode->is_dir);
+  lock_acquire (&inode->dir_lock);
+}
+
+/* Releases the lock acquired by inode_lock_dir(). */
+void
+inode_unlock_dir (struct inode *inode)
+{
+  lock_release (&inode->dir_lock);
+}
+
+/* Returns the number of runs of consecutive sectors that hold the
+   data of INODE, not counting holes or blocks not yet placed. */
+size_t
+inode_extent_cnt (struct inode *inode)
+{
+  struct inode_run run;
+  block_sector_t next = 0;
+  uint32_t block, end;
+  size_t cnt = 0;
+
+  rwlock_acquire_read (&inode->rwlock);
+  end = (inode_is_inline (&inode->data)
+         ? 0 : bytes_to_sectors (inode->data.length));
+  for (block = 0; block < end; block += run.length > 0 ? run.length : 1)
+    {
+      inode_translate (inode, block, &run);
+      if (run.sector != 0)
+        {
+          if (run.sector != next)
+            cnt++;
+          next = run.sector + run.length;
+        }
+    }
+  rwlock_release_read (&inode->rwlock);
+  return cnt;
+}
+
+/* Prints how many block map sectors were read to find the data
+   sectors read and written. */
+void
+inode_print_stats (void)
+{
+  printf ("Block map: %llu map reads for %llu data sectors\n",
+          map_read_cnt, data_sector_cnt);
 }
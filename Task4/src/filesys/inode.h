@@ -2,6 +2,7 @@
 #define FILESYS_INODE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include "filesys/off_t.h"
 #include "devices/block.h"
 
@@ -9,17 +10,32 @@ struct bitmap;
 
 void inode_init (void);
 bool inode_create (block_sector_t, off_t, bool);
+bool inode_create_near (block_sector_t near, off_t, bool,
+                        block_sector_t *inumberp);
 struct inode *inode_open (block_sector_t);
 struct inode *inode_reopen (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
+void inode_unremove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+void inode_read_ahead (struct inode *, off_t offset, off_t size);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
-off_t inode_length (const struct inode *);
+off_t inode_length (struct inode *);
 bool inode_is_dir (struct inode *);
 bool inode_is_opened (struct inode *);
+bool inode_is_removed (struct inode *);
+void inode_lock_dir (struct inode *);
+void inode_unlock_dir (struct inode *);
+void inode_flush_delayed (void);
+void inode_set_delayed (bool);
+void inode_reclaim (void);
+void inode_recover (void);
+block_sector_t inode_journal_sector (void);
+bool inode_set_journal_sector (block_sector_t);
+size_t inode_extent_cnt (struct inode *);
+void inode_print_stats (void);
 
 #endif /* filesys/inode.h */
@@ -0,0 +1,783 @@
+#include "filesys/journal.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <round.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* The journal is a run of consecutive sectors set aside on the
+   file system device, whose first sector is recorded in the free
+   map's inode.  Its first sector holds a header; the rest hold
+   records, one after another, each a copy of metadata sectors that
+   changed together.  A record is one or more descriptor sectors,
+   which say where the sectors copied belong, the copies themselves,
+   and a commit sector with a checksum of the rest, all written with
+   one disk command.
+
+   Records are written in order of SEQ, starting with the one the
+   header names, just after the header.  A record whose commit
+   sector is missing, or does not match, ends the journal.  Once
+   the journal is full, the sectors in its records are written
+   home, and the header is rewritten to start over. */
+
+/* Identify the sectors of the journal. */
+#define JOURNAL_MAGIC 0x4a524e4c        /* Header. */
+#define DESC_MAGIC 0x4a444553           /* Descriptor. */
+#define COMMIT_MAGIC 0x4a434d54         /* Commit. */
+
+/* The journal takes 1/JOURNAL_SHARE of the disk, but no more than
+   JOURNAL_SECTORS sectors.  A disk too small for JOURNAL_MIN_SECTORS
+   goes without. */
+#define JOURNAL_SECTORS 256
+#define JOURNAL_SHARE 16
+#define JOURNAL_MIN_SECTORS 16
+
+/* Most metadata sectors one operation is expected to change: a
+   directory growing buckets, with the inodes it names, stays
+   within this.  An operation starts only if the group it joins has
+   room for this many more, along with every other operation
+   running. */
+#define JOURNAL_CREDITS 48
+
+/* Sectors named by one descriptor, and most descriptors in a
+   record. */
+#define DESC_CNT 125
+#define DESC_MAX DIV_ROUND_UP (JOURNAL_SECTORS, DESC_CNT)
+
+/* Journal header.  Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct journal_header
+  {
+    unsigned magic;                     /* JOURNAL_MAGIC. */
+    uint32_t size;                      /* Sectors in the journal. */
+    uint32_t seq;                       /* SEQ of the first record. */
+    uint8_t unused[500];                /* Not used. */
+  };
+
+/* Descriptor.  A record with CNT sectors starts with
+   DIV_ROUND_UP (CNT, DESC_CNT) of these, naming the sectors in the
+   order their copies follow.  Must be exactly BLOCK_SECTOR_SIZE
+   bytes long. */
+struct journal_desc
+  {
+    unsigned magic;                     /* DESC_MAGIC. */
+    uint32_t seq;                       /* Record's sequence number. */
+    uint32_t cnt;                       /* Sectors in the record. */
+    block_sector_t sectors[DESC_CNT];   /* Where the copies belong. */
+  };
+
+/* Commit sector, which ends a record.  Must be exactly
+   BLOCK_SECTOR_SIZE bytes long. */
+struct journal_commit
+  {
+    unsigned magic;                     /* COMMIT_MAGIC. */
+    uint32_t seq;                       /* Record's sequence number. */
+    uint32_t cnt;                       /* Sectors in the record. */
+    unsigned checksum;                  /* hash_bytes() of the rest. */
+    uint8_t unused[496];                /* Not used. */
+  };
+
+/* A record written since the last checkpoint, kept in memory so
+   that the checkpoint need not read the journal back. */
+struct journal_record
+  {
+    struct list_elem elem;              /* Element in records. */
+    size_t cnt;                         /* Sectors in the record. */
+    block_sector_t *sectors;            /* Where they belong. */
+    uint8_t *data;                      /* CNT sectors of data. */
+  };
+
+/* The journal in use.  Only the committer, the thread that has
+   claimed it under journal_lock, writes or changes it, and it does
+   so without holding the lock, which is never held across disk
+   I/O.  JOURNAL_START is 0 if there is none. */
+static block_sector_t journal_start;
+static size_t journal_size;             /* Sectors in the journal. */
+static size_t record_max;               /* Most sectors in a record. */
+static size_t group_max;                /* Most changed by operations. */
+static size_t credits;                  /* Set aside for each one. */
+static uint32_t journal_seq;            /* SEQ of the next record. */
+static size_t journal_head;             /* Where the next record goes. */
+static struct list records;             /* Records, oldest first. */
+static struct journal_header *header;   /* Header buffer. */
+static block_sector_t *scratch_sectors; /* Sectors of the record being
+                                           built or replayed. */
+static uint8_t *scratch;                /* Its descriptors, data and
+                                           commit sector. */
+static struct lock journal_lock;
+static struct thread *committer;        /* Thread committing, or null. */
+static struct condition commit_done;    /* Signaled when it is done. */
+
+/* A commit asked for with journal_force(), which the journal
+   thread makes.  Protected by journal_lock. */
+static bool commit_wanted;
+static struct condition commit_asked;   /* Signaled by journal_force(). */
+static bool journal_thread_started;
+static thread_func journal_daemon NO_RETURN;
+
+/* Operations that change metadata run between journal_begin() and
+   journal_end(), and a group commit copies the metadata out only
+   while none is running, so that it records whole operations.  New
+   operations wait while it copies, which takes no disk I/O, except
+   in the thread copying, whose free map flush is itself one.
+   Protected by handle_lock. */
+static struct lock handle_lock;
+static struct condition handles_done;   /* Signaled when none run. */
+static struct condition copy_done;      /* Signaled when copying ends. */
+static int handle_cnt;                  /* Operations running. */
+static struct thread *copier;           /* Thread copying, or null. */
+static bool journal_started;
+
+/* Statistics. */
+static unsigned long long commit_cnt;
+static unsigned long long forced_cnt;
+static unsigned long long stalled_cnt;
+static unsigned long long split_cnt;
+static unsigned long long logged_cnt;
+static unsigned long long checkpoint_cnt;
+static unsigned long long replay_cnt;
+
+/* Initializes the journal module. */
+void
+journal_init (void)
+{
+  if (!journal_started)
+    {
+      lock_init (&journal_lock);
+      cond_init (&commit_done);
+      cond_init (&commit_asked);
+      lock_init (&handle_lock);
+      cond_init (&handles_done);
+      cond_init (&copy_done);
+      journal_started = true;
+    }
+  journal_start = 0;
+}
+
+/* Uses the SIZE sectors starting at START as the journal, and
+   allocates the buffers needed to write and replay it. */
+static void
+journal_setup (block_sector_t start, size_t size)
+{
+  journal_start = start;
+  journal_size = size;
+  record_max = (size - 2) - DIV_ROUND_UP (size - 2, DESC_CNT);
+  journal_head = 1;
+  list_init (&records);
+
+  header = malloc (BLOCK_SECTOR_SIZE);
+  scratch_sectors = malloc (record_max * sizeof *scratch_sectors);
+  scratch = malloc ((DESC_MAX + record_max + 1) * BLOCK_SECTOR_SIZE);
+  if (header == NULL || scratch_sectors == NULL || scratch == NULL)
+    PANIC ("can't allocate journal buffers");
+}
+
+/* Frees the buffers allocated by journal_setup(), and forgets the
+   journal. */
+static void
+journal_teardown (void)
+{
+  journal_start = 0;
+  free (scratch);
+  free (scratch_sectors);
+  free (header);
+}
+
+/* Returns a pointer to the data of the record being built or
+   replayed in scratch. */
+static uint8_t *
+scratch_data (void)
+{
+  return scratch + DESC_MAX * BLOCK_SECTOR_SIZE;
+}
+
+/* Writes the header, which makes the journal start over with the
+   record numbered journal_seq. */
+static void
+journal_write_header (void)
+{
+  memset (header, 0, BLOCK_SECTOR_SIZE);
+  header->magic = JOURNAL_MAGIC;
+  header->size = journal_size;
+  header->seq = journal_seq;
+  block_write (fs_device, journal_start, header);
+  journal_head = 1;
+}
+
+/* Returns true if a record may copy SECTOR home. */
+static bool
+journal_sector_ok (block_sector_t sector)
+{
+  return (sector < block_size (fs_device)
+          && (sector < journal_start
+              || sector >= journal_start + journal_size));
+}
+
+/* Reads the record numbered journal_seq at journal_head into
+   scratch, and returns the number of sectors in it, or 0 if there
+   is no such record, only part of one, or one that looks wrong. */
+static size_t
+journal_read_record (void)
+{
+  const struct journal_desc *desc;
+  const struct journal_commit *commit;
+  size_t cnt, desc_cnt, len, i;
+  uint8_t *record;
+
+  if (journal_head >= journal_size)
+    return 0;
+  block_read (fs_device, journal_start + journal_head, header);
+  desc = (const struct journal_desc *) header;
+  if (desc->magic != DESC_MAGIC || desc->seq != journal_seq
+      || desc->cnt == 0 || desc->cnt > record_max)
+    return 0;
+  cnt = desc->cnt;
+  desc_cnt = DIV_ROUND_UP (cnt, DESC_CNT);
+  len = desc_cnt + cnt + 1;
+  if (journal_head + len > journal_size)
+    return 0;
+
+  record = scratch + (DESC_MAX - desc_cnt) * BLOCK_SECTOR_SIZE;
+  block_read_multiple (fs_device, journal_start + journal_head, len, record);
+  for (i = 0; i < desc_cnt; i++)
+    {
+      size_t first = i * DESC_CNT;
+      size_t n = cnt - first < DESC_CNT ? cnt - first : DESC_CNT;
+
+      desc = (const struct journal_desc *) (record + i * BLOCK_SECTOR_SIZE);
+      if (desc->magic != DESC_MAGIC || desc->seq != journal_seq
+          || desc->cnt != cnt)
+        return 0;
+      memcpy (scratch_sectors + first, desc->sectors,
+              n * sizeof *scratch_sectors);
+    }
+  commit = (const struct journal_commit *)
+    (scratch_data () + cnt * BLOCK_SECTOR_SIZE);
+  if (commit->magic != COMMIT_MAGIC || commit->seq != journal_seq
+      || commit->cnt != cnt
+      || commit->checksum != hash_bytes (record, (len - 1)
+                                                 * BLOCK_SECTOR_SIZE))
+    return 0;
+  for (i = 0; i < cnt; i++)
+    if (!journal_sector_ok (scratch_sectors[i]))
+      return 0;
+
+  journal_head += len;
+  return cnt;
+}
+
+/* Replays the journal of the disk just mounted: copies home the
+   sectors of every record committed to it, in order, and empties
+   it.  This takes time in proportion to the journal, not the disk.
+   Must be called before anything else reads the disk's metadata. */
+void
+journal_replay (void)
+{
+  block_sector_t start = inode_journal_sector ();
+  size_t replayed = 0;
+  size_t size, cnt, i;
+
+  journal_start = 0;
+  if (start == 0 || start >= block_size (fs_device))
+    return;
+
+  /* A journal that looks wrong is not used, and a new one is set
+     aside by journal_open(). */
+  header = malloc (BLOCK_SECTOR_SIZE);
+  if (header == NULL)
+    PANIC ("can't allocate journal buffers");
+  block_read (fs_device, start, header);
+  if (header->magic != JOURNAL_MAGIC
+      || header->size < JOURNAL_MIN_SECTORS
+      || header->size > JOURNAL_SECTORS
+      || start + header->size > block_size (fs_device))
+    {
+      free (header);
+      return;
+    }
+  journal_seq = header->seq;
+  size = header->size;
+  free (header);
+  journal_setup (start, size);
+
+  while ((cnt = journal_read_record ()) > 0)
+    {
+      for (i = 0; i < cnt; i++)
+        buffer_cache_write (scratch_sectors[i],
+                            scratch_data () + i * BLOCK_SECTOR_SIZE);
+      journal_seq++;
+      replayed++;
+    }
+  if (replayed > 0)
+    buffer_cache_sync ();
+  replay_cnt += replayed;
+  journal_write_header ();
+}
+
+/* Sets aside a journal for the disk just mounted, if it has none
+   yet, and starts journaling its metadata.  The free map must be
+   open. */
+void
+journal_open (void)
+{
+  if (journal_start == 0)
+    {
+      size_t size = block_size (fs_device) / JOURNAL_SHARE;
+      block_sector_t start;
+
+      if (size > JOURNAL_SECTORS)
+        size = JOURNAL_SECTORS;
+      if (size < JOURNAL_MIN_SECTORS
+          || !free_map_allocate_near (FREE_MAP_SECTOR, size, &start))
+        return;
+
+      /* The journal is written without the buffer cache, so write
+         back anything the cache holds for its sectors from before
+         they were freed, and the free map, before the header. */
+      journal_setup (start, size);
+      journal_seq = 1;
+      buffer_cache_sync ();
+      journal_write_header ();
+      if (!inode_set_journal_sector (start))
+        {
+          journal_teardown ();
+          free_map_release (start, size);
+          return;
+        }
+      buffer_cache_sync ();
+    }
+  /* A commit adds the free map's sectors to what the operations
+     in its group changed. */
+  group_max = record_max - free_map_sectors ();
+  credits = JOURNAL_CREDITS < group_max ? JOURNAL_CREDITS : group_max;
+  buffer_cache_journal_start (record_max / 4);
+  if (!journal_thread_started)
+    {
+      journal_thread_started = true;
+      thread_create ("journal", PRI_DEFAULT, journal_daemon, NULL);
+    }
+}
+
+/* A sector written home by a checkpoint. */
+struct journal_home
+  {
+    block_sector_t sector;              /* Where it belongs. */
+    const uint8_t *data;                /* Newest copy. */
+  };
+
+/* qsort() comparison function for struct journal_home. */
+static int
+compare_home (const void *a_, const void *b_)
+{
+  const struct journal_home *a = a_;
+  const struct journal_home *b = b_;
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Writes home the newest copy of each sector in the journal's
+   records, and of the first CNT sectors in scratch, which are newer
+   still, then empties the journal.  Returns the number of disk
+   commands this took. */
+static size_t
+journal_checkpoint (size_t cnt)
+{
+  struct journal_home *homes;
+  struct bitmap *seen;
+  struct list_elem *e;
+  size_t total = cnt, home_cnt = 0, i;
+
+  ASSERT (committer == thread_current ());
+
+  for (e = list_begin (&records); e != list_end (&records); e = list_next (e))
+    total += list_entry (e, struct journal_record, elem)->cnt;
+
+  homes = malloc (total * sizeof *homes);
+  seen = bitmap_create (block_size (fs_device));
+  if (homes == NULL || seen == NULL)
+    {
+      /* Write every copy, oldest first, instead. */
+      for (e = list_begin (&records); e != list_end (&records);
+           e = list_next (e))
+        {
+          struct journal_record *r = list_entry (e, struct journal_record,
+                                                 elem);
+          for (i = 0; i < r->cnt; i++)
+            block_write (fs_device, r->sectors[i],
+                         r->data + i * BLOCK_SECTOR_SIZE);
+        }
+      for (i = 0; i < cnt; i++)
+        block_write (fs_device, scratch_sectors[i],
+                     scratch_data () + i * BLOCK_SECTOR_SIZE);
+      home_cnt = total;
+    }
+  else
+    {
+      for (i = 0; i < cnt; i++)
+        {
+          bitmap_mark (seen, scratch_sectors[i]);
+          homes[home_cnt].sector = scratch_sectors[i];
+          homes[home_cnt++].data = scratch_data () + i * BLOCK_SECTOR_SIZE;
+        }
+      for (e = list_rbegin (&records); e != list_rend (&records);
+           e = list_prev (e))
+        {
+          struct journal_record *r = list_entry (e, struct journal_record,
+                                                 elem);
+          for (i = 0; i < r->cnt; i++)
+            if (!bitmap_test (seen, r->sectors[i]))
+              {
+                bitmap_mark (seen, r->sectors[i]);
+                homes[home_cnt].sector = r->sectors[i];
+                homes[home_cnt++].data = r->data + i * BLOCK_SECTOR_SIZE;
+              }
+        }
+      qsort (homes, home_cnt, sizeof *homes, compare_home);
+      for (i = 0; i < home_cnt; i++)
+        block_write (fs_device, homes[i].sector, homes[i].data);
+    }
+  free (homes);
+  bitmap_destroy (seen);
+
+  while (!list_empty (&records))
+    {
+      struct journal_record *r = list_entry (list_pop_front (&records),
+                                             struct journal_record, elem);
+      free (r->data);
+      free (r);
+    }
+  journal_write_header ();
+  buffer_cache_journal_checkpointed ();
+  checkpoint_cnt++;
+  return home_cnt + 1;
+}
+
+/* Writes the CNT sectors collected in scratch to the journal as one
+   record, checkpointing first if they do not fit, and returns the
+   number of disk commands this took. */
+static size_t
+journal_write (size_t cnt)
+{
+  size_t desc_cnt = DIV_ROUND_UP (cnt, DESC_CNT);
+  size_t len = desc_cnt + cnt + 1;
+  uint8_t *record = scratch + (DESC_MAX - desc_cnt) * BLOCK_SECTOR_SIZE;
+  struct journal_commit *commit = (struct journal_commit *)
+    (scratch_data () + cnt * BLOCK_SECTOR_SIZE);
+  struct journal_record *r;
+  size_t cmds = 1, i;
+
+  ASSERT (cnt > 0 && cnt <= record_max);
+
+  if (journal_head + len > journal_size)
+    cmds += journal_checkpoint (0);
+
+  for (i = 0; i < desc_cnt; i++)
+    {
+      struct journal_desc *desc
+        = (struct journal_desc *) (record + i * BLOCK_SECTOR_SIZE);
+      size_t first = i * DESC_CNT;
+      size_t n = cnt - first < DESC_CNT ? cnt - first : DESC_CNT;
+
+      memset (desc, 0, BLOCK_SECTOR_SIZE);
+      desc->magic = DESC_MAGIC;
+      desc->seq = journal_seq;
+      desc->cnt = cnt;
+      memcpy (desc->sectors, scratch_sectors + first,
+              n * sizeof *scratch_sectors);
+    }
+  memset (commit, 0, BLOCK_SECTOR_SIZE);
+  commit->magic = COMMIT_MAGIC;
+  commit->seq = journal_seq;
+  commit->cnt = cnt;
+  commit->checksum = hash_bytes (record, (len - 1) * BLOCK_SECTOR_SIZE);
+  block_write_multiple (fs_device, journal_start + journal_head, len, record);
+  journal_head += len;
+  journal_seq++;
+  commit_cnt++;
+  logged_cnt += cnt;
+
+  /* Keep a copy for the checkpoint, or checkpoint now if there is
+     no memory for one. */
+  r = malloc (sizeof *r + cnt * sizeof *r->sectors);
+  if (r != NULL)
+    {
+      r->cnt = cnt;
+      r->sectors = (block_sector_t *) (r + 1);
+      r->data = malloc (cnt * BLOCK_SECTOR_SIZE);
+    }
+  if (r == NULL || r->data == NULL)
+    {
+      free (r);
+      return cmds + journal_checkpoint (cnt);
+    }
+  memcpy (r->sectors, scratch_sectors, cnt * sizeof *r->sectors);
+  memcpy (r->data, scratch_data (), cnt * BLOCK_SECTOR_SIZE);
+  list_push_back (&records, &r->elem);
+  return cmds;
+}
+
+/* Commits to the journal the metadata sectors changed since the
+   last commit, as one record, and returns the number of disk
+   commands this took.  First waits until no operation is running,
+   and holds new ones off while copying the sectors out, so that
+   the record holds only whole operations.  journal_begin() keeps
+   the sectors within a record; should an operation change more
+   than its credits, the rest follow in further records, with new
+   operations held off until they are all collected.  The caller
+   must be the committer. */
+static size_t
+journal_flush (void)
+{
+  struct thread *cur = thread_current ();
+  size_t cmds = 0, cnt;
+
+  ASSERT (committer == cur);
+
+  lock_acquire (&handle_lock);
+  while (handle_cnt > 0 || copier != NULL)
+    cond_wait (&handles_done, &handle_lock);
+  copier = cur;
+  lock_release (&handle_lock);
+
+  free_map_flush ();
+  for (;;)
+    {
+      cnt = buffer_cache_journal_collect (scratch_sectors, scratch_data (),
+                                          record_max);
+      if (!buffer_cache_journal_pending ())
+        break;
+
+      /* An operation changed more sectors than its credits, so the
+         group takes more than one record.  Write this one now and
+         collect the rest before letting new operations in. */
+      split_cnt++;
+      cmds += journal_write (cnt);
+      buffer_cache_journal_done ();
+    }
+
+  lock_acquire (&handle_lock);
+  copier = NULL;
+  cond_broadcast (&copy_done, &handle_lock);
+  cond_broadcast (&handles_done, &handle_lock);
+  lock_release (&handle_lock);
+
+  if (cnt > 0)
+    {
+      cmds += journal_write (cnt);
+      buffer_cache_journal_done ();
+    }
+  return cmds;
+}
+
+/* Makes the current thread the committer, waiting for any other
+   to finish first.  Returns false, without doing so, if there is no
+   journal. */
+static bool
+journal_claim (void)
+{
+  bool claimed;
+
+  lock_acquire (&journal_lock);
+  while (committer != NULL)
+    cond_wait (&commit_done, &journal_lock);
+  claimed = journal_start != 0;
+  if (claimed)
+    committer = thread_current ();
+  lock_release (&journal_lock);
+  return claimed;
+}
+
+/* Ends the current thread's turn as committer. */
+static void
+journal_unclaim (void)
+{
+  lock_acquire (&journal_lock);
+  committer = NULL;
+  cond_broadcast (&commit_done, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Commits the metadata changed since the last commit, and with it
+   every operation finished since then, as one group.  Returns the
+   number of disk commands this took.  Inside an operation, which
+   the commit would wait for, only asks the journal thread for one,
+   and returns 0. */
+size_t
+journal_commit (void)
+{
+  struct thread *cur = thread_current ();
+  size_t cmds;
+
+  if (journal_start == 0 || committer == cur)
+    return 0;
+  if (cur->journal_depth > 0)
+    {
+      journal_force ();
+      return 0;
+    }
+  if (!journal_claim ())
+    return 0;
+  cmds = journal_flush ();
+  journal_unclaim ();
+  return cmds;
+}
+
+/* Asks the journal thread for a commit, for the buffer cache when
+   too much of it awaits one, and returns without waiting for it.
+   The commit, like any other, waits for the operations in progress
+   to finish.  A caller that needs the slots it frees waits for
+   them in the buffer cache. */
+void
+journal_force (void)
+{
+  if (journal_start == 0)
+    return;
+  lock_acquire (&journal_lock);
+  if (!commit_wanted)
+    {
+      commit_wanted = true;
+      forced_cnt++;
+      cond_signal (&commit_asked, &journal_lock);
+    }
+  lock_release (&journal_lock);
+}
+
+/* Returns true if the current thread may wait for a journal
+   commit: it is neither committing nor inside an operation that
+   the commit would wait for. */
+bool
+journal_may_wait (void)
+{
+  struct thread *cur = thread_current ();
+  return cur->journal_depth == 0 && committer != cur;
+}
+
+/* Journal thread: makes the commits asked for with
+   journal_force(). */
+static void
+journal_daemon (void *aux UNUSED)
+{
+  for (;;)
+    {
+      lock_acquire (&journal_lock);
+      while (!commit_wanted)
+        cond_wait (&commit_asked, &journal_lock);
+      commit_wanted = false;
+      lock_release (&journal_lock);
+      journal_commit ();
+    }
+}
+
+/* Makes everything written so far durable: places blocks whose
+   allocation writes have delayed, writes back file data, then
+   commits metadata to the journal.  Metadata is not written home,
+   so after creating a file, this takes only the one journal write.
+   Returns the number of disk commands issued. */
+size_t
+journal_sync (void)
+{
+  inode_flush_delayed ();
+  if (journal_start == 0)
+    return buffer_cache_sync ();
+  return buffer_cache_sync_data () + journal_commit ();
+}
+
+/* Commits and checkpoints what is left in the journal, then stops
+   journaling, before the file system is unmounted. */
+void
+journal_close (void)
+{
+  if (journal_start == 0)
+    return;
+
+  journal_commit ();
+  if (!journal_claim ())
+    return;
+  journal_checkpoint (0);
+  buffer_cache_journal_stop ();
+  journal_teardown ();
+  journal_unclaim ();
+}
+
+/* Returns true if the group being built has room for one more
+   operation: for its credits, on top of those of the operations
+   running and the sectors already awaiting a commit.  Called with
+   handle_lock held. */
+static bool
+journal_has_room (void)
+{
+  size_t reserved = (handle_cnt + 1) * credits;
+
+  return (journal_start == 0
+          || (reserved <= group_max
+              && buffer_cache_journal_fits (group_max - reserved)));
+}
+
+/* Starts an operation that changes metadata.  Operations may nest;
+   only the outermost counts.  The outermost waits until the group
+   has room for it, committing the group itself to make room, so
+   that a group never outgrows a journal record and the operations
+   already running always find buffer cache slots not held for the
+   journal. */
+void
+journal_begin (void)
+{
+  struct thread *cur = thread_current ();
+
+  if (cur->journal_depth > 0)
+    {
+      cur->journal_depth++;
+      return;
+    }
+  lock_acquire (&handle_lock);
+  for (;;)
+    {
+      while (copier != NULL && copier != cur)
+        cond_wait (&copy_done, &handle_lock);
+      if (committer == cur || copier == cur || journal_has_room ())
+        break;
+
+      /* The commit waits for the operations running to end. */
+      lock_release (&handle_lock);
+      stalled_cnt++;
+      journal_commit ();
+      lock_acquire (&handle_lock);
+    }
+  cur->journal_depth = 1;
+  handle_cnt++;
+  lock_release (&handle_lock);
+}
+
+/* Ends an operation started with journal_begin(). */
+void
+journal_end (void)
+{
+  struct thread *cur = thread_current ();
+
+  ASSERT (cur->journal_depth > 0);
+  if (--cur->journal_depth > 0)
+    return;
+  lock_acquire (&handle_lock);
+  if (--handle_cnt == 0)
+    cond_broadcast (&handles_done, &handle_lock);
+  lock_release (&handle_lock);
+}
+
+/* Prints journal statistics. */
+void
+journal_print_stats (void)
+{
+  printf ("Journal: %llu records of %llu sectors committed, %llu forced, "
+          "%llu stalled, %llu split, %llu checkpoints, "
+          "%llu records replayed\n",
+          commit_cnt, logged_cnt, forced_cnt, stalled_cnt, split_cnt,
+          checkpoint_cnt, replay_cnt);
+}
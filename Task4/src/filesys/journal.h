@@ -0,0 +1,19 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+void journal_init (void);
+void journal_replay (void);
+void journal_open (void);
+void journal_close (void);
+void journal_begin (void);
+void journal_end (void);
+size_t journal_commit (void);
+void journal_force (void);
+bool journal_may_wait (void);
+size_t journal_sync (void);
+void journal_print_stats (void);
+
+#endif /* filesys/journal.h */
@@ -44,5 +44,7 @@ bool mkdir (const char *dir);
 bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
+int sync (void);
+int fsync (int fd);
 
 #endif /* lib/user/syscall.h */
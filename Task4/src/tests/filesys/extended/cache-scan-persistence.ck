@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($hot) = random_bytes (2048);
+my ($big) = random_bytes (256 * 1024);
+check_archive ({"hot" => [$hot], "big" => [$big]});
+pass;
@@ -0,0 +1,71 @@
+/* Reads a file much larger than the buffer cache from start to
+   end, rereading a small file between every two blocks of the
+   scan, and checks that both read back correctly.  The scan evicts
+   its own blocks many times over while the small file stays hot. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define HOT_SIZE 2048
+#define BIG_SIZE (256 * 1024)
+#define CHUNK_SIZE 4096
+
+static char hot[HOT_SIZE];
+static char big[BIG_SIZE];
+static char buf[CHUNK_SIZE];
+
+static void
+write_file (const char *file_name, const char *data, size_t size) 
+{
+  size_t ofs;
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  for (ofs = 0; ofs < size; ofs += CHUNK_SIZE) 
+    {
+      size_t chunk = size - ofs < CHUNK_SIZE ? size - ofs : CHUNK_SIZE;
+      if (write (fd, data + ofs, chunk) != (int) chunk)
+        fail ("write %zu bytes at offset %zu in \"%s\" failed",
+              chunk, ofs, file_name);
+    }
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
+
+void
+test_main (void) 
+{
+  int hot_fd, big_fd;
+  size_t ofs;
+
+  random_init (0);
+  random_bytes (hot, sizeof hot);
+  random_bytes (big, sizeof big);
+
+  write_file ("hot", hot, sizeof hot);
+  write_file ("big", big, sizeof big);
+
+  CHECK ((hot_fd = open ("hot")) > 1, "open \"hot\"");
+  CHECK ((big_fd = open ("big")) > 1, "open \"big\"");
+  msg ("scan \"big\", rereading \"hot\" as we go");
+  quiet = true;
+  for (ofs = 0; ofs < BIG_SIZE; ofs += CHUNK_SIZE) 
+    {
+      CHECK (read (big_fd, buf, CHUNK_SIZE) == CHUNK_SIZE,
+             "read %d bytes at offset %zu in \"big\"", CHUNK_SIZE, ofs);
+      compare_bytes (buf, big + ofs, CHUNK_SIZE, ofs, "big");
+      seek (hot_fd, 0);
+      check_file_handle (hot_fd, "hot", hot, sizeof hot);
+    }
+  quiet = false;
+  msg ("close \"big\"");
+  close (big_fd);
+  msg ("close \"hot\"");
+  close (hot_fd);
+
+  check_file ("hot", hot, sizeof hot);
+  check_file ("big", big, sizeof big);
+}
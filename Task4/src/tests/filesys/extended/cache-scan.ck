@@ -0,0 +1,26 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-scan) begin
+(cache-scan) create "hot"
+(cache-scan) open "hot"
+(cache-scan) close "hot"
+(cache-scan) create "big"
+(cache-scan) open "big"
+(cache-scan) close "big"
+(cache-scan) open "hot"
+(cache-scan) open "big"
+(cache-scan) scan "big", rereading "hot" as we go
+(cache-scan) close "big"
+(cache-scan) close "hot"
+(cache-scan) open "hot" for verification
+(cache-scan) verified contents of "hot"
+(cache-scan) close "hot"
+(cache-scan) open "big" for verification
+(cache-scan) verified contents of "big"
+(cache-scan) close "big"
+(cache-scan) end
+EOF
+pass;
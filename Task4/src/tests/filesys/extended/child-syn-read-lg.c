@@ -0,0 +1,47 @@
+/* Child process for syn-read-lg.
+   Reads the whole test file in chunks that straddle sector and
+   cache block boundaries, starting at a different offset in each
+   child so that the children keep asking for different blocks. */
+
+#include <random.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include "tests/filesys/extended/syn-read-lg.h"
+#include "tests/lib.h"
+
+static char buf1[BUF_SIZE];
+static char buf2[CHUNK_SIZE];
+
+int
+main (int argc, const char *argv[]) 
+{
+  int child_idx;
+  int fd;
+  size_t start, ofs;
+
+  test_name = "child-syn-read-lg";
+  quiet = true;
+
+  CHECK (argc == 2, "argc must be 2, actually %d", argc);
+  child_idx = atoi (argv[1]);
+
+  random_init (0);
+  random_bytes (buf1, sizeof buf1);
+
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  start = child_idx * (BUF_SIZE / 8) / CHUNK_SIZE * CHUNK_SIZE;
+  ofs = start;
+  do
+    {
+      size_t size = BUF_SIZE - ofs < CHUNK_SIZE ? BUF_SIZE - ofs : CHUNK_SIZE;
+      seek (fd, ofs);
+      CHECK (read (fd, buf2, size) == (int) size,
+             "read %zu bytes at offset %zu in \"%s\"", size, ofs, file_name);
+      compare_bytes (buf2, buf1 + ofs, size, ofs, file_name);
+      ofs = ofs + size < BUF_SIZE ? ofs + size : 0;
+    }
+  while (ofs != start);
+  close (fd);
+
+  return child_idx;
+}
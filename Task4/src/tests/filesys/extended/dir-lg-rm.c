@@ -0,0 +1,85 @@
+/* Creates many small files in one directory, removes every other
+   one, and checks that each name then resolves, or fails to
+   resolve, as it should, both by path and through readdir.  Looks
+   every name up before removing it, so that a stale cached lookup
+   would show up as a removed file that still opens. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 200
+
+static void
+make_name (char *name, size_t size, int i) 
+{
+  snprintf (name, size, "/d/f%d", i);
+}
+
+void
+test_main (void) 
+{
+  char name[32];
+  char entry[READDIR_MAX_LEN + 1];
+  int fd, i, cnt;
+
+  CHECK (mkdir ("/d"), "mkdir \"/d\"");
+
+  msg ("create /d/f0 through /d/f%d", FILE_CNT - 1);
+  quiet = true;
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      size_t len;
+      make_name (name, sizeof name, i);
+      len = strlen (name);
+      CHECK (create (name, 0), "create \"%s\"", name);
+      CHECK ((fd = open (name)) > 1, "open \"%s\"", name);
+      CHECK (write (fd, name, len) == (int) len, "write \"%s\"", name);
+      close (fd);
+    }
+  quiet = false;
+
+  msg ("remove odd-numbered files");
+  quiet = true;
+  for (i = 1; i < FILE_CNT; i += 2) 
+    {
+      make_name (name, sizeof name, i);
+      CHECK ((fd = open (name)) > 1, "open \"%s\"", name);
+      close (fd);
+      CHECK (remove (name), "remove \"%s\"", name);
+      CHECK (!remove (name), "remove \"%s\" again (must fail)", name);
+    }
+  quiet = false;
+
+  msg ("look up every name");
+  quiet = true;
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      make_name (name, sizeof name, i);
+      if (i % 2)
+        CHECK (open (name) == -1, "open \"%s\" (must fail)", name);
+      else
+        {
+          CHECK (!create (name, 0), "create \"%s\" (must fail)", name);
+          check_file (name, name, strlen (name));
+        }
+    }
+  quiet = false;
+
+  CHECK ((fd = open ("/d")) > 1, "open \"/d\"");
+  cnt = 0;
+  while (readdir (fd, entry)) 
+    {
+      int n = atoi (entry + 1);
+      snprintf (name, sizeof name, "f%d", n);
+      if (strcmp (entry, name) || n >= FILE_CNT || n % 2)
+        fail ("readdir \"/d\" returned unexpected \"%s\"", entry);
+      cnt++;
+    }
+  CHECK (cnt == FILE_CNT / 2, "readdir \"/d\" returned %d names", cnt);
+  msg ("close \"/d\"");
+  close (fd);
+}
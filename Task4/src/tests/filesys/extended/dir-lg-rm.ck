@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(dir-lg-rm) begin
+(dir-lg-rm) mkdir "/d"
+(dir-lg-rm) create /d/f0 through /d/f199
+(dir-lg-rm) remove odd-numbered files
+(dir-lg-rm) look up every name
+(dir-lg-rm) open "/d"
+(dir-lg-rm) readdir "/d" returned 100 names
+(dir-lg-rm) close "/d"
+(dir-lg-rm) end
+EOF
+pass;
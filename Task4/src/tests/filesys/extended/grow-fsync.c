@@ -0,0 +1,41 @@
+/* Grows a file a chunk at a time, calling fsync after each chunk,
+   then checks that fsync left nothing for sync to write: data
+   written past the end of a file, whose blocks are not yet given
+   sectors, must reach the disk by the time fsync returns. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define CHUNK_SIZE 1234
+#define CHUNK_CNT 10
+
+static char buf[CHUNK_SIZE * CHUNK_CNT];
+
+void
+test_main (void) 
+{
+  const char *file_name = "data";
+  int fd, i;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  msg ("write and fsync \"%s\" %d times", file_name, CHUNK_CNT);
+  quiet = true;
+  for (i = 0; i < CHUNK_CNT; i++) 
+    {
+      CHECK (write (fd, buf + i * CHUNK_SIZE, CHUNK_SIZE) == CHUNK_SIZE,
+             "write %d bytes at offset %d in \"%s\"",
+             CHUNK_SIZE, i * CHUNK_SIZE, file_name);
+      CHECK (fsync (fd) > 0, "fsync \"%s\" after write %d", file_name, i);
+    }
+  quiet = false;
+  CHECK (sync () == 0, "sync after fsync has nothing to write");
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, sizeof buf);
+}
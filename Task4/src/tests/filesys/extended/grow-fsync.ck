@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-fsync) begin
+(grow-fsync) create "data"
+(grow-fsync) open "data"
+(grow-fsync) write and fsync "data" 10 times
+(grow-fsync) sync after fsync has nothing to write
+(grow-fsync) close "data"
+(grow-fsync) open "data" for verification
+(grow-fsync) verified contents of "data"
+(grow-fsync) close "data"
+(grow-fsync) end
+EOF
+pass;
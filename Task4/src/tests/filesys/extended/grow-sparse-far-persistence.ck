@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+my ($head) = "head of sparse file\0";
+my ($tail) = "tail of sparse file\0";
+check_archive ({"sparse" => [$head . ("\0" x (300000 - length $head))
+                             . $tail]});
+pass;
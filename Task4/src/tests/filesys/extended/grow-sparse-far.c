@@ -0,0 +1,38 @@
+/* Writes a little data at the start of a file, seeks far past its
+   end and writes a little more, then checks that the file's size
+   covers the second write and that the hole in between reads back
+   as zeros. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define HOLE_END 300000
+
+static const char head[] = "head of sparse file";
+static const char tail[] = "tail of sparse file";
+static char buf[HOLE_END + sizeof tail];
+
+void
+test_main (void) 
+{
+  const char *file_name = "sparse";
+  int fd;
+
+  memcpy (buf, head, sizeof head);
+  memcpy (buf + HOLE_END, tail, sizeof tail);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, head, sizeof head) == (int) sizeof head,
+         "write head of \"%s\"", file_name);
+  msg ("seek \"%s\" past end", file_name);
+  seek (fd, HOLE_END);
+  CHECK (write (fd, tail, sizeof tail) == (int) sizeof tail,
+         "write tail of \"%s\"", file_name);
+  CHECK (filesize (fd) == (int) sizeof buf, "filesize \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, sizeof buf);
+}
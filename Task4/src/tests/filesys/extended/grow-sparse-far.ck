@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-sparse-far) begin
+(grow-sparse-far) create "sparse"
+(grow-sparse-far) open "sparse"
+(grow-sparse-far) write head of "sparse"
+(grow-sparse-far) seek "sparse" past end
+(grow-sparse-far) write tail of "sparse"
+(grow-sparse-far) filesize "sparse"
+(grow-sparse-far) close "sparse"
+(grow-sparse-far) open "sparse" for verification
+(grow-sparse-far) verified contents of "sparse"
+(grow-sparse-far) close "sparse"
+(grow-sparse-far) end
+EOF
+pass;
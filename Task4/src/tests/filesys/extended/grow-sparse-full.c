@@ -0,0 +1,40 @@
+/* Fills the disk, then seeks far past the end of an empty file and
+   writes to it.  Unless the write finds room for its data, the file
+   must not grow: its length must never take in a hole that the
+   write failed to fill. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define HOLE_END 100000
+
+static char buf[512];
+
+void
+test_main (void) 
+{
+  int sparse_fd, fill_fd, written;
+
+  CHECK (create ("sparse", 0), "create \"sparse\"");
+  CHECK ((sparse_fd = open ("sparse")) > 1, "open \"sparse\"");
+  CHECK (create ("fill", 0), "create \"fill\"");
+  CHECK ((fill_fd = open ("fill")) > 1, "open \"fill\"");
+
+  msg ("fill the disk");
+  while (write (fill_fd, buf, sizeof buf) > 0)
+    continue;
+
+  msg ("seek \"sparse\" past end");
+  seek (sparse_fd, HOLE_END);
+  written = write (sparse_fd, "x", 1);
+  CHECK (filesize (sparse_fd) == (written > 0 ? HOLE_END + 1 : 0),
+         "size of \"sparse\" matches what was written");
+
+  msg ("close \"sparse\"");
+  close (sparse_fd);
+  msg ("close \"fill\"");
+  close (fill_fd);
+  CHECK (remove ("sparse"), "remove \"sparse\"");
+  CHECK (remove ("fill"), "remove \"fill\"");
+}
@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-sparse-full) begin
+(grow-sparse-full) create "sparse"
+(grow-sparse-full) open "sparse"
+(grow-sparse-full) create "fill"
+(grow-sparse-full) open "fill"
+(grow-sparse-full) fill the disk
+(grow-sparse-full) seek "sparse" past end
+(grow-sparse-full) size of "sparse" matches what was written
+(grow-sparse-full) close "sparse"
+(grow-sparse-full) close "fill"
+(grow-sparse-full) remove "sparse"
+(grow-sparse-full) remove "fill"
+(grow-sparse-full) end
+EOF
+pass;
@@ -0,0 +1,11 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my (@islands) = map (random_bytes (512), 0...59);
+my (@holes) = map ($_ % 2 ? "\0" x 3584 : undef, 0...58);
+$holes[$_] = random_bytes (3584) foreach grep ($_ % 2 == 0, 0...58);
+my ($data) = join ('', map ($islands[$_] . $holes[$_], 0...58)) . $islands[59];
+check_archive ({"sparse" => [$data]});
+pass;
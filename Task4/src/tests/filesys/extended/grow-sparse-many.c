@@ -0,0 +1,62 @@
+/* Writes a sector of data every few sectors through a file, so that
+   the file maps more separate runs of sectors than fit in its inode,
+   syncs, then fills in every other hole and checks the contents,
+   holes and all. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define ISLAND_CNT 60
+#define ISLAND_SIZE 512
+#define STRIDE 4096
+#define FILE_SIZE ((ISLAND_CNT - 1) * STRIDE + ISLAND_SIZE)
+
+static char buf[FILE_SIZE];
+
+void
+test_main (void) 
+{
+  const char *file_name = "sparse";
+  int fd, i;
+
+  random_init (0);
+  for (i = 0; i < ISLAND_CNT; i++)
+    random_bytes (buf + i * STRIDE, ISLAND_SIZE);
+  for (i = 0; i < ISLAND_CNT - 1; i += 2)
+    random_bytes (buf + i * STRIDE + ISLAND_SIZE, STRIDE - ISLAND_SIZE);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+
+  msg ("write %d sectors %d bytes apart", ISLAND_CNT, STRIDE);
+  quiet = true;
+  for (i = 0; i < ISLAND_CNT; i++) 
+    {
+      seek (fd, i * STRIDE);
+      CHECK (write (fd, buf + i * STRIDE, ISLAND_SIZE) == ISLAND_SIZE,
+             "write %d bytes at offset %d in \"%s\"",
+             ISLAND_SIZE, i * STRIDE, file_name);
+    }
+  quiet = false;
+  CHECK (filesize (fd) == FILE_SIZE, "filesize \"%s\"", file_name);
+  CHECK (fsync (fd) >= 0, "fsync \"%s\"", file_name);
+
+  msg ("fill every other hole");
+  quiet = true;
+  for (i = 0; i < ISLAND_CNT - 1; i += 2) 
+    {
+      int ofs = i * STRIDE + ISLAND_SIZE;
+      seek (fd, ofs);
+      CHECK (write (fd, buf + ofs, STRIDE - ISLAND_SIZE)
+             == STRIDE - ISLAND_SIZE,
+             "write %d bytes at offset %d in \"%s\"",
+             STRIDE - ISLAND_SIZE, ofs, file_name);
+    }
+  quiet = false;
+  CHECK (filesize (fd) == FILE_SIZE, "filesize \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, sizeof buf);
+}
@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-sparse-many) begin
+(grow-sparse-many) create "sparse"
+(grow-sparse-many) open "sparse"
+(grow-sparse-many) write 60 sectors 4096 bytes apart
+(grow-sparse-many) filesize "sparse"
+(grow-sparse-many) fsync "sparse"
+(grow-sparse-many) fill every other hole
+(grow-sparse-many) filesize "sparse"
+(grow-sparse-many) close "sparse"
+(grow-sparse-many) open "sparse" for verification
+(grow-sparse-many) verified contents of "sparse"
+(grow-sparse-many) close "sparse"
+(grow-sparse-many) end
+EOF
+pass;
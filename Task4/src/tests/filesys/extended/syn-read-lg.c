@@ -0,0 +1,36 @@
+/* Spawns 8 child processes, all of which read from the same file,
+   which spans several buffer cache blocks, at the same time.  The
+   readers should not be serialized behind one another's disk reads,
+   and each must see exactly what was written. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/filesys/extended/syn-read-lg.h"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[BUF_SIZE];
+
+#define CHILD_CNT 8
+
+void
+test_main (void) 
+{
+  pid_t children[CHILD_CNT];
+  int fd;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, sizeof buf) == (int) sizeof buf,
+         "write \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  CHECK (sync () >= 0, "sync");
+
+  exec_children ("child-syn-read-lg", children, CHILD_CNT);
+  wait_children (children, CHILD_CNT);
+  check_file (file_name, buf, sizeof buf);
+}
@@ -0,0 +1,33 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(syn-read-lg) begin
+(syn-read-lg) create "data"
+(syn-read-lg) open "data"
+(syn-read-lg) write "data"
+(syn-read-lg) close "data"
+(syn-read-lg) sync
+(syn-read-lg) exec child 1 of 8: "child-syn-read-lg 0"
+(syn-read-lg) exec child 2 of 8: "child-syn-read-lg 1"
+(syn-read-lg) exec child 3 of 8: "child-syn-read-lg 2"
+(syn-read-lg) exec child 4 of 8: "child-syn-read-lg 3"
+(syn-read-lg) exec child 5 of 8: "child-syn-read-lg 4"
+(syn-read-lg) exec child 6 of 8: "child-syn-read-lg 5"
+(syn-read-lg) exec child 7 of 8: "child-syn-read-lg 6"
+(syn-read-lg) exec child 8 of 8: "child-syn-read-lg 7"
+(syn-read-lg) wait for child 1 of 8 returned 0 (expected 0)
+(syn-read-lg) wait for child 2 of 8 returned 1 (expected 1)
+(syn-read-lg) wait for child 3 of 8 returned 2 (expected 2)
+(syn-read-lg) wait for child 4 of 8 returned 3 (expected 3)
+(syn-read-lg) wait for child 5 of 8 returned 4 (expected 4)
+(syn-read-lg) wait for child 6 of 8 returned 5 (expected 5)
+(syn-read-lg) wait for child 7 of 8 returned 6 (expected 6)
+(syn-read-lg) wait for child 8 of 8 returned 7 (expected 7)
+(syn-read-lg) open "data" for verification
+(syn-read-lg) verified contents of "data"
+(syn-read-lg) close "data"
+(syn-read-lg) end
+EOF
+pass;
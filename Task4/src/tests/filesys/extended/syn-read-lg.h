@@ -0,0 +1,8 @@
+#ifndef TESTS_FILESYS_EXTENDED_SYN_READ_LG_H
+#define TESTS_FILESYS_EXTENDED_SYN_READ_LG_H
+
+#define CHUNK_SIZE 100
+#define BUF_SIZE (40 * 512)
+static const char file_name[] = "data";
+
+#endif /* tests/filesys/extended/syn-read-lg.h */
@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($big);
+$big = random_bytes (256 * 1024) foreach 0...7;
+my ($fs);
+$fs->{'r7'}{"f$_"} = ["/r7/f$_"] foreach 0...9;
+$fs->{'r7'}{'big'} = [$big];
+check_archive ($fs);
+pass;
@@ -0,0 +1,91 @@
+/* In each of several rounds, makes a directory holding a large file
+   and some small ones, syncs, then removes the previous round's
+   directory and syncs again.  Together the rounds write more than
+   the disk holds, so later rounds only fit if the blocks of removed
+   files are given back, and every round commits many metadata
+   changes at once. */
+
+#include <random.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define ROUND_CNT 8
+#define SMALL_CNT 10
+#define BIG_SIZE (256 * 1024)
+#define CHUNK_SIZE 4096
+
+static char buf[BIG_SIZE];
+
+static void
+make_round (int round) 
+{
+  char name[32];
+  size_t ofs;
+  int fd, i;
+
+  snprintf (name, sizeof name, "/r%d", round);
+  CHECK (mkdir (name), "mkdir \"%s\"", name);
+
+  for (i = 0; i < SMALL_CNT; i++) 
+    {
+      size_t len;
+      snprintf (name, sizeof name, "/r%d/f%d", round, i);
+      len = strlen (name);
+      CHECK (create (name, 0), "create \"%s\"", name);
+      CHECK ((fd = open (name)) > 1, "open \"%s\"", name);
+      CHECK (write (fd, name, len) == (int) len, "write \"%s\"", name);
+      close (fd);
+    }
+
+  random_bytes (buf, sizeof buf);
+  snprintf (name, sizeof name, "/r%d/big", round);
+  CHECK (create (name, 0), "create \"%s\"", name);
+  CHECK ((fd = open (name)) > 1, "open \"%s\"", name);
+  for (ofs = 0; ofs < BIG_SIZE; ofs += CHUNK_SIZE)
+    CHECK (write (fd, buf + ofs, CHUNK_SIZE) == CHUNK_SIZE,
+           "write %d bytes at offset %zu in \"%s\"", CHUNK_SIZE, ofs, name);
+  close (fd);
+}
+
+static void
+remove_round (int round) 
+{
+  char name[32];
+  int i;
+
+  for (i = 0; i < SMALL_CNT; i++) 
+    {
+      snprintf (name, sizeof name, "/r%d/f%d", round, i);
+      CHECK (remove (name), "remove \"%s\"", name);
+    }
+  snprintf (name, sizeof name, "/r%d/big", round);
+  CHECK (remove (name), "remove \"%s\"", name);
+  snprintf (name, sizeof name, "/r%d", round);
+  CHECK (remove (name), "remove \"%s\"", name);
+}
+
+void
+test_main (void) 
+{
+  int round;
+
+  random_init (0);
+  for (round = 0; round < ROUND_CNT; round++) 
+    {
+      msg ("round %d", round);
+      quiet = true;
+      make_round (round);
+      CHECK (sync () >= 0, "sync");
+      if (round > 0)
+        {
+          remove_round (round - 1);
+          CHECK (sync () >= 0, "sync");
+        }
+      quiet = false;
+    }
+
+  check_file ("/r7/big", buf, sizeof buf);
+}
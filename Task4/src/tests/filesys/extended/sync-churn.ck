@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(sync-churn) begin
+(sync-churn) round 0
+(sync-churn) round 1
+(sync-churn) round 2
+(sync-churn) round 3
+(sync-churn) round 4
+(sync-churn) round 5
+(sync-churn) round 6
+(sync-churn) round 7
+(sync-churn) open "/r7/big" for verification
+(sync-churn) verified contents of "/r7/big"
+(sync-churn) close "/r7/big"
+(sync-churn) end
+EOF
+pass;
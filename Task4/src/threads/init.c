@@ -36,6 +36,7 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif
@@ -257,6 +258,17 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        buffer_cache_set_size (atoi (value));
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (!buffer_cache_set_policy (value))
+            PANIC ("unknown cache policy `%s' (use -h for help)", value);
+        }
+      else if (!strcmp (name, "-flush-interval"))
+        buffer_cache_set_flush_interval (atoi (value));
+      else if (!strcmp (name, "-dirty-ratio"))
+        buffer_cache_set_dirty_ratio (atoi (value));
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -324,6 +336,10 @@ run_actions (char **argv)
       {"rm", 2, fsutil_rm},
       {"extract", 1, fsutil_extract},
       {"append", 2, fsutil_append},
+      {"cache-bench", 1, fsutil_cache_bench},
+      {"cache-mix", 1, fsutil_cache_mix},
+      {"open-bench", 1, fsutil_open_bench},
+      {"frag-bench", 1, fsutil_frag_bench},
 #endif
       {NULL, 0, NULL},
     };
@@ -373,6 +389,10 @@ usage (void)
           "Use these actions indirectly via `pintos' -g and -p options:\n"
           "  extract            Untar from scratch device into file system.\n"
           "  append FILE        Append FILE to tar file on scratch device.\n"
+          "  cache-bench        Time buffer cache lookups at several sizes.\n"
+          "  cache-mix          Report buffer cache hit rate on a mixed workload.\n"
+          "  open-bench         Time opens by path as more files are held open.\n"
+          "  frag-bench         Count extents of files written at once.\n"
 #endif
           "\nOptions:\n"
           "  -h                 Print this help message and power off.\n"
@@ -382,6 +402,11 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=SECTORS     Fix the buffer cache at SECTORS sectors (default: adapt\n"
+          "                     to free kernel memory).\n"
+          "  -cache-policy=NAME Evict cache blocks by NAME: 2q (default) or clock.\n"
+          "  -flush-interval=MS Write back dirty cache blocks every MS ms (0: never).\n"
+          "  -dirty-ratio=PCT   Throttle writers above PCT%% dirty cache blocks.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/interrupt.h"
 #include "threads/loader.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
@@ -31,11 +32,15 @@ struct pool
     struct lock lock;                   /* Mutual exclusion. */
     struct bitmap *used_map;            /* Bitmap of free pages. */
     uint8_t *base;                      /* Base of pool. */
+    size_t free_cnt;                    /* Number of free pages. */
   };
 
 /* Two pools: one for kernel data, one for user pages. */
 static struct pool kernel_pool, user_pool;
 
+/* Called when the kernel pool runs out, to free cached pages. */
+static palloc_reclaim_func *kernel_reclaim;
+
 static void init_pool (struct pool *, void *base, size_t page_cnt,
                        const char *name);
 static bool page_from_pool (const struct pool *, void *page);
@@ -79,10 +84,26 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt)
 
   lock_acquire (&pool->lock);
   page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+  if (page_idx == BITMAP_ERROR && pool == &kernel_pool
+      && kernel_reclaim != NULL)
+    {
+      /* Ask the owner of reclaimable pages to give some back, then
+         try again. */
+      lock_release (&pool->lock);
+      size_t reclaimed = kernel_reclaim (page_cnt);
+      lock_acquire (&pool->lock);
+      if (reclaimed > 0)
+        page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
+    }
   lock_release (&pool->lock);
 
   if (page_idx != BITMAP_ERROR)
-    pages = pool->base + PGSIZE * page_idx;
+    {
+      enum intr_level old_level = intr_disable ();
+      pool->free_cnt -= page_cnt;
+      intr_set_level (old_level);
+      pages = pool->base + PGSIZE * page_idx;
+    }
   else
     pages = NULL;
 
@@ -139,6 +160,12 @@ palloc_free_multiple (void *pages, size_t page_cnt)
 
   ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
   bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+
+  /* Pages are freed from thread_schedule_tail() with interrupts
+     off, so FREE_CNT cannot be protected by POOL's lock. */
+  enum intr_level old_level = intr_disable ();
+  pool->free_cnt += page_cnt;
+  intr_set_level (old_level);
 }
 
 /* Frees the page at PAGE. */
@@ -148,6 +175,30 @@ palloc_free_page (void *page)
   palloc_free_multiple (page, 1);
 }
 
+/* Returns the number of pages in the kernel pool. */
+size_t
+palloc_kernel_pages (void)
+{
+  return bitmap_size (kernel_pool.used_map);
+}
+
+/* Returns the number of free pages in the kernel pool. */
+size_t
+palloc_free_kernel_pages (void)
+{
+  return kernel_pool.free_cnt;
+}
+
+/* Sets RECLAIM to be called when a kernel pool allocation of
+   PAGE_CNT pages would fail.  It should free what it can, without
+   blocking on locks that a thread allocating pages might hold,
+   and return the number of pages freed. */
+void
+palloc_set_reclaim (palloc_reclaim_func *reclaim)
+{
+  kernel_reclaim = reclaim;
+}
+
 /* Initializes pool P as starting at START and ending at END,
    naming it NAME for debugging purposes. */
 static void
@@ -167,6 +218,7 @@ init_pool (struct pool *p, void *base, size_t page_cnt, const char *name)
   lock_init (&p->lock);
   p->used_map = bitmap_create_in_buf (page_cnt, base, bm_pages * PGSIZE);
   p->base = base + bm_pages * PGSIZE;
+  p->free_cnt = page_cnt;
 }
 
 /* Returns true if PAGE was allocated from POOL,
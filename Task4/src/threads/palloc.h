@@ -17,4 +17,12 @@ void *palloc_get_multiple (enum palloc_flags, size_t page_cnt);
 void palloc_free_page (void *);
 void palloc_free_multiple (void *, size_t page_cnt);
 
+size_t palloc_kernel_pages (void);
+size_t palloc_free_kernel_pages (void);
+
+/* Frees up to PAGE_CNT reclaimable kernel pages on demand and
+   returns the number freed. */
+typedef size_t palloc_reclaim_func (size_t page_cnt);
+void palloc_set_reclaim (palloc_reclaim_func *);
+
 #endif /* threads/palloc.h */
@@ -143,6 +143,7 @@ void *user_esp;
 
 #ifdef FILESYS
     struct dir *cur_dir;
+    int journal_depth;                  /* Nested journal_begin() calls. */
 #endif
     /* Owned by thread.c. */
     unsigned magic;                     /* Detects stack overflow. */
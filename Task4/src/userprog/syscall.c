@@ -1,6 +1,7 @@
 #include "userprog/syscall.h"
 #include "userprog/pagedir.h"
 #include "userprog/process.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/file.h"
 #include "filesys/inode.h"
@@ -17,6 +18,7 @@
 #include "devices/block.h"
 #include "filesys/directory.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 #include "lib/string.h"
 
@@ -43,6 +45,8 @@ bool mkdir (const char *);
 bool readdir (int, char *);
 bool isdir (int);
 int inumber (int);
+int sync (void);
+int fsync (int);
 #endif
 
 struct fsys {
@@ -52,7 +56,6 @@ struct fsys {
 };
 
 static void syscall_handler (struct intr_frame *);
-static struct lock filesys_lock;
 static bool is_directory (struct inode* );
 
 static void
@@ -80,7 +83,6 @@ void
 syscall_init (void) 
 {
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
-  lock_init (&filesys_lock);
 }
 
 static void
@@ -198,6 +200,16 @@ syscall_handler (struct intr_frame *f)
    
       (f->eax) = inumber ((int)arg0);
       break;
+
+    case SYS_SYNC:
+
+      (f->eax) = sync ();
+      break;
+
+    case SYS_FSYNC:
+
+      (f->eax) = fsync ((int)arg0);
+      break;
   }
 }
 
@@ -257,9 +269,7 @@ create (const char *file, unsigned initial_size)
     exit (-1);
   }
 
-  lock_acquire (&filesys_lock);
   bool success = filesys_create (file, initial_size);
-  lock_release (&filesys_lock);
   return success;
 }
 
@@ -270,9 +280,7 @@ remove (const char *file)
     exit (-1);
   }
 
-  lock_acquire (&filesys_lock);
   bool success = filesys_remove (file);
-  lock_release (&filesys_lock);
   return success;
 }
 
@@ -283,12 +291,10 @@ open (const char *file)
     return -1;
   }
 
-  lock_acquire (&filesys_lock);
   struct inode *inode = filesys_open_path (file);
   struct fsys *opened_file = (struct fsys *)malloc(sizeof (struct fsys));
 
   if (inode == NULL) {
-    lock_release (&filesys_lock);
     return -1;
   }
   if ((opened_file->is_dir = is_directory (inode)) == true) {
@@ -297,7 +303,6 @@ open (const char *file)
   else {
     opened_file->file = file_open (inode);
   }
-  lock_release (&filesys_lock);
 
   struct thread *t = thread_current ();
   int fd;
@@ -340,9 +345,7 @@ filesize (int fd)
     return 0;
   }
 
-  lock_acquire (&filesys_lock);
   length = file_length (opened_file);
-  lock_release (&filesys_lock);
 
   return length;
 }
@@ -358,17 +361,14 @@ read (int fd, void *buffer, unsigned size)
   struct thread *t = thread_current ();
   unsigned read_cnt = 0;
 
-  lock_acquire (&filesys_lock);
   if (fd == 0) {
     while (read_cnt <= size) {
       /* read key by input_getc() and write it into buffer at appropriate position */
       *(char *)(buffer + read_cnt++) = input_getc ();
     }
-    lock_release (&filesys_lock);
     return read_cnt;
   }
   if (fd == 1) {
-    lock_release (&filesys_lock);
     return 0;
   }
 
@@ -376,22 +376,18 @@ read (int fd, void *buffer, unsigned size)
   struct fsys *opened_fsys = t->fd_table[fd];
 
   if (opened_fsys == NULL) {
-    lock_release (&filesys_lock);
     return 0;
   }
   if (opened_fsys->is_dir) {
-    lock_release (&filesys_lock);
     return -1;
   }
   file = opened_fsys->file;
 
   if (file == NULL) {
-    lock_release (&filesys_lock);
     return 0;
   }
 
   read_cnt = file_read (file, buffer, size);
-  lock_release (&filesys_lock);
   return (int)read_cnt;
 }
 
@@ -406,36 +402,29 @@ write (int fd, const void *buffer, unsigned size)
   struct thread *t = thread_current ();
   int write_cnt = size;
   
-  lock_acquire (&filesys_lock);
   if (fd == 1) {
     putbuf (buffer, size);
-    lock_release (&filesys_lock);
     return write_cnt;
   }
   if (fd == 0) {
-    lock_release (&filesys_lock);
     return 0;
   }
 
   /* get file from fd */
   struct fsys *opened_fsys = t->fd_table[fd];
   if (opened_fsys == NULL) {
-    lock_release (&filesys_lock);
     return 0;
   }
   if (opened_fsys->is_dir) {
-    lock_release (&filesys_lock);
     return -1;
   }
   file = opened_fsys->file;
 
   if (file == NULL) {
-    lock_release (&filesys_lock);
     return 0;
   }
 
   write_cnt = file_write (file, buffer, size);
-  lock_release (&filesys_lock);
   return write_cnt;
 }
 
@@ -458,9 +447,7 @@ seek (int fd, unsigned position)
     return;
   }
 
-  lock_acquire (&filesys_lock);
   file_seek (opened_file, position);
-  lock_release (&filesys_lock);
 }
 
 unsigned
@@ -483,9 +470,7 @@ tell (int fd)
     return 0;
   }
 
-  lock_acquire (&filesys_lock);
   next = file_tell (opened_file);
-  lock_release (&filesys_lock);
 
   return (unsigned) next;
 }
@@ -503,9 +488,7 @@ close (int fd)
     return;
 
   if (opened_fsys->is_dir) {
-    lock_acquire (&filesys_lock);
     dir_close (opened_fsys->dir);
-    lock_release (&filesys_lock);
     t->fd_table[fd] = NULL;
     return;
   }
@@ -516,9 +499,7 @@ close (int fd)
     return;
   }
 
-  lock_acquire (&filesys_lock);
   file_close (opened_file);
-  lock_release (&filesys_lock);
   t->fd_table[fd] = NULL;
 }
 
@@ -556,9 +537,12 @@ mkdir (const char *dir)
 
   success = ((base = dir_open_dir (base_dir)) != NULL);
   if (success) {
-    success = free_map_allocate (1, &sector);
+    journal_begin ();
+    success = free_map_allocate_near (inode_get_inumber (dir_get_inode (base)),
+                                      1, &sector);
     success = success && dir_sub_create (sector, new_dir, base);
     dir_close (base);
+    journal_end ();
   }
  
   free (base_dir);
@@ -621,6 +605,33 @@ inumber (int fd)
   return inode_get_inumber (inode);
 }
 
+/* Makes everything written so far durable and returns the number
+   of disk commands that took.  File data is written back, but
+   metadata is only committed to the journal, so after a create()
+   or mkdir() this costs one sequential journal write. */
+int
+sync (void)
+{
+  return journal_sync ();
+}
+
+/* Makes the data written to FD durable.  The buffer cache does not
+   know which file a sector belongs to, so this makes everything
+   durable, like sync().  Returns the number of disk commands
+   issued, or -1 if FD is not open. */
+int
+fsync (int fd)
+{
+  if (fd >= MAX_FD || fd < 2)
+    return -1;
+
+  struct thread *t = thread_current ();
+  if (t->fd_table[fd] == NULL)
+    return -1;
+
+  return journal_sync ();
+}
+
 static bool
 is_directory (struct inode* inode)
 {